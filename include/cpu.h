@@ -0,0 +1,25 @@
+#ifndef CPU_H
+#define CPU_H
+
+/*
+ * Instruction sets the hot kernels come compiled for, each level with
+ * everything below it. Binaries are built for the baseline and pick their
+ * kernels at startup from what cpuid reports.
+ */
+typedef enum {
+	CPU_GENERIC,
+	CPU_PCLMUL, /* SSE4.1 and carry-less multiply */
+	CPU_AVX2, /* AVX2, BMI1, BMI2 and LZCNT */
+	CPU_AVX512, /* AVX-512 F, BW and VL, with VPCLMULQDQ */
+} CpuLevel;
+
+/*
+ * The best level this CPU and kernel support, detected on the first call,
+ * which the kernels make from constructors. ZIPPEEK_CPU set to a level
+ * name caps it, to try the slower paths.
+ */
+CpuLevel cpu_level(void);
+
+const char *cpu_level_name(CpuLevel level);
+
+#endif
@@ -0,0 +1,16 @@
+#ifndef CRC32_H
+#define CRC32_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Continues the CRC-32 (ISO-HDLC, as stored in ZIP headers) of a stream
+ * with len more bytes. Start from crc 0.
+ */
+uint32_t crc32_update(uint32_t crc, const void *buf, size_t len);
+
+/* Which implementation this CPU runs, for --cpu-info */
+const char *crc32_kernel(void);
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef DEFLATE_H
+#define DEFLATE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* COMPRESSION LEVELS */
+#define DEFLATE_LEVEL_STORE 0
+#define DEFLATE_LEVEL_FASTEST 1
+#define DEFLATE_LEVEL_DEFAULT 6
+#define DEFLATE_LEVEL_MAX 9
+#define DEFLATE_LEVEL_OPTIMAL 10
+
+#define DEFLATE_WINDOW_SIZE 32768
+#define DEFLATE_MIN_MATCH 3
+#define DEFLATE_MAX_MATCH 258
+
+typedef struct DeflateEncoder DeflateEncoder;
+
+/*
+ * Levels 1-2 use a single-probe hash table and greedy parsing, levels 3-5
+ * walk hash chains greedily, levels 6-9 add lazy matching and levels 7-9
+ * also search for the cheapest split of every block. DEFLATE_LEVEL_OPTIMAL
+ * iterates a shortest-path parse against the Huffman costs it produces,
+ * then splits and re-optimizes each block: far slower, for output that is
+ * written once and read many times.
+ */
+DeflateEncoder *deflate_encoder_new(int level);
+void deflate_encoder_free(DeflateEncoder *enc);
+
+/*
+ * Rsyncable output: at content-defined points, roughly every 64 KiB, the
+ * encoder ends its block, byte-aligns and drops its window, so unchanged
+ * regions of the input compress to identical bytes and delta transfers
+ * stay small. Costs a little ratio.
+ */
+void deflate_set_rsyncable(DeflateEncoder *enc, bool rsyncable);
+
+/*
+ * Compresses in_len bytes of in as a complete raw DEFLATE stream (RFC 1951).
+ * Returns the compressed size, or 0 when out_cap is too small.
+ */
+size_t deflate_compress(DeflateEncoder *enc, const void *in, size_t in_len,
+			void *out, size_t out_cap);
+
+/* Output capacity that is always enough for deflate_compress */
+size_t deflate_bound(size_t in_len);
+
+#endif
@@ -0,0 +1,145 @@
+/*
+ * Entry table template, included by unzip.c once per width with TABLE_WIDTH
+ * set to 32 or 64. Every function and type gets the width as a suffix, and
+ * the entry_table##TABLE_WIDTH ops table collects them for dispatch.
+ */
+
+#define TABLE_CAT_(a, b) a##b
+#define TABLE_CAT(a, b) TABLE_CAT_(a, b)
+#define TABLE(name) TABLE_CAT(name, TABLE_WIDTH)
+#define table_uint TABLE_CAT(TABLE_CAT(uint, TABLE_WIDTH), _t)
+
+struct TABLE(entry_record) {
+	table_uint comp_size;
+	table_uint uncomp_size;
+	table_uint local_header_offset;
+	table_uint name_offset; /* into the names pool, or sorted position */
+	uint32_t crc32;
+	uint32_t external_file_attr;
+	uint16_t comp_method;
+	uint16_t bit_flag;
+	uint16_t last_mod_file_time;
+	uint16_t last_mod_file_date;
+	uint16_t file_name_len;
+};
+
+static void TABLE(table_store)(void *table, uint64_t index,
+			       const ZipEntry *entry, uint64_t name_offset)
+{
+	struct TABLE(entry_record) *r = (struct TABLE(entry_record) *)table +
+					index;
+
+	r->comp_size = entry->comp_size;
+	r->uncomp_size = entry->uncomp_size;
+	r->local_header_offset = entry->local_header_offset;
+	r->name_offset = name_offset;
+	r->crc32 = entry->crc32;
+	r->external_file_attr = entry->external_file_attr;
+	r->comp_method = entry->comp_method;
+	r->bit_flag = entry->bit_flag;
+	r->last_mod_file_time = entry->last_mod_file_time;
+	r->last_mod_file_date = entry->last_mod_file_date;
+	r->file_name_len = entry->file_name_len;
+}
+
+static void TABLE(table_load)(const void *table, uint64_t index,
+			      ZipEntry *entry)
+{
+	const struct TABLE(entry_record) *r =
+		(const struct TABLE(entry_record) *)table + index;
+
+	entry->comp_size = r->comp_size;
+	entry->uncomp_size = r->uncomp_size;
+	entry->local_header_offset = r->local_header_offset;
+	entry->crc32 = r->crc32;
+	entry->external_file_attr = r->external_file_attr;
+	entry->comp_method = r->comp_method;
+	entry->bit_flag = r->bit_flag;
+	entry->last_mod_file_time = r->last_mod_file_time;
+	entry->last_mod_file_date = r->last_mod_file_date;
+	entry->file_name_len = r->file_name_len;
+}
+
+static uint64_t TABLE(table_name_offset)(const void *table, uint64_t index)
+{
+	return ((const struct TABLE(entry_record) *)table)[index].name_offset;
+}
+
+static void TABLE(table_set_name_offset)(void *table, uint64_t index,
+					 uint64_t name_offset)
+{
+	((struct TABLE(entry_record) *)table)[index].name_offset = name_offset;
+}
+
+static int TABLE(compare_names)(const void *a, const void *b, void *arg)
+{
+	const ZipArchive *archive = arg;
+	const struct TABLE(entry_record) *table = archive->entries;
+	uint32_t i = *(const uint32_t *)a, j = *(const uint32_t *)b;
+	const struct TABLE(entry_record) *x = &table[i], *y = &table[j];
+	size_t len = x->file_name_len < y->file_name_len ? x->file_name_len :
+							    y->file_name_len;
+
+	int cmp = memcmp(archive->names + x->name_offset,
+			 archive->names + y->name_offset, len);
+	if (cmp == 0)
+		cmp = (x->file_name_len > y->file_name_len) -
+		      (x->file_name_len < y->file_name_len);
+
+	/* Equal names keep central directory order, like the name hash */
+	return cmp != 0 ? cmp : (i > j) - (i < j);
+}
+
+static void TABLE(hash_insert)(ZipArchive *archive, uint64_t first,
+			       uint64_t end)
+{
+	const struct TABLE(entry_record) *table = archive->entries;
+	table_uint *slots = archive->name_slots;
+
+	for (uint64_t i = first; i < end; i++) {
+		uint64_t slot = zip_name_hash(archive->names +
+						      table[i].name_offset,
+					      table[i].file_name_len, 0);
+
+		slot &= archive->name_mask;
+		while (slots[slot] != 0)
+			slot = (slot + 1) & archive->name_mask;
+		slots[slot] = i + 1;
+	}
+}
+
+static int64_t TABLE(hash_locate)(const ZipArchive *archive,
+				  const char *name, size_t len)
+{
+	const struct TABLE(entry_record) *table = archive->entries;
+	const table_uint *slots = archive->name_slots;
+	uint64_t slot = zip_name_hash(name, len, 0) & archive->name_mask;
+
+	for (; slots[slot] != 0; slot = (slot + 1) & archive->name_mask) {
+		const struct TABLE(entry_record) *r = &table[slots[slot] - 1];
+
+		if (r->file_name_len == len &&
+		    memcmp(archive->names + r->name_offset, name, len) == 0)
+			return slots[slot] - 1;
+	}
+
+	return -1;
+}
+
+static const struct entry_table TABLE(entry_table) = {
+	.width = TABLE_WIDTH,
+	.record_size = sizeof(struct TABLE(entry_record)),
+	.slot_size = sizeof(table_uint),
+	.store = TABLE(table_store),
+	.load = TABLE(table_load),
+	.name_offset = TABLE(table_name_offset),
+	.set_name_offset = TABLE(table_set_name_offset),
+	.compare_names = TABLE(compare_names),
+	.hash_insert = TABLE(hash_insert),
+	.hash_locate = TABLE(hash_locate),
+};
+
+#undef table_uint
+#undef TABLE
+#undef TABLE_CAT
+#undef TABLE_CAT_
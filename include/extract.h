@@ -0,0 +1,38 @@
+#ifndef EXTRACT_H
+#define EXTRACT_H
+
+#include "unzip.h"
+#include <stdint.h>
+
+typedef struct {
+	const char *dir; /* destination, the current directory when NULL */
+	unsigned jobs; /* decode threads, 0 for one per online CPU */
+	uint64_t memory; /* bytes to stay within, 0 for 256 MiB */
+	bool huge_pages; /* back large buffers with transparent huge pages */
+	bool verbose; /* print each entry like unzip does */
+	bool resume; /* journal finished entries, skip those journaled */
+	bool hardlinks; /* duplicate entries may be hard links to one file */
+} ZipExtractOptions;
+
+/*
+ * Extracts every entry under opts->dir, checking sizes and CRCs. One
+ * thread reads the archive front to back in large blocks, in local header
+ * order, the decode threads inflate whole entries and the calling thread
+ * creates and writes the files. Bounded queues between the three keep
+ * the reads sequential, which suits disks and network mounts that seek
+ * badly. The reader admits entries against opts->memory by their declared
+ * sizes: small neighbours travel in batches decoded in one shot into a
+ * buffer of their full size, the rest stream through in chunks. Huge
+ * deflated entries wait until the end and are then split between all
+ * jobs, see inflate_decode_parallel. Entries whose compressed data is
+ * the same are decoded once and the others reflinked, hard linked when
+ * opts->hardlinks allows and their modes and times agree, or copied from
+ * that output. With opts->resume a journal in the destination records
+ * finished entries, and those it already lists are skipped if they are
+ * still there with their size; it goes once every entry is out. Returns
+ * 0, -2 when some entries failed, -1 on other errors.
+ */
+int8_t zip_extract(ZipArchive *archive, const char *filename,
+		   const ZipExtractOptions *opts);
+
+#endif
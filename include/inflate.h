@@ -0,0 +1,86 @@
+#ifndef INFLATE_H
+#define INFLATE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define INFLATE_CHUNK (1 << 18) /* most bytes handed to write at once */
+#define INFLATE_SLACK 266 /* bytes decoding may scribble past a buffer */
+#define INFLATE_HISTORY (1 << 15) /* bytes of output decoding refers back to */
+
+typedef struct InflateDecoder InflateDecoder;
+
+/*
+ * Hands the decoder its next input bytes through buf and returns how many
+ * there are, 0 at the end of the input (or on a read error, which the
+ * callback records for itself).
+ */
+typedef size_t (*inflate_read_fn)(void *ctx, const unsigned char **buf);
+
+/* Takes len decoded bytes; nonzero stops decoding */
+typedef int8_t (*inflate_write_fn)(void *ctx, const unsigned char *buf,
+				   size_t len);
+
+/* Hands the decoder an empty output buffer, NULL on failure */
+typedef unsigned char *(*inflate_next_fn)(void *ctx);
+
+/* Decoders keep their window between streams, so reuse one per thread */
+InflateDecoder *inflate_decoder_new(void);
+void inflate_decoder_free(InflateDecoder *dec);
+
+/* Memory one decoder holds, for callers budgeting many of them */
+size_t inflate_decoder_size(void);
+
+/*
+ * Decodes one complete raw DEFLATE stream (RFC 1951), pulling input from
+ * read and pushing output to write in large pieces. Returns 0, -1 when
+ * write failed, or -2 on malformed or truncated data. The output is
+ * checksummed as it is decoded, see inflate_crc.
+ */
+int8_t inflate_decode(InflateDecoder *dec, inflate_read_fn read,
+		      inflate_write_fn write, void *ctx);
+
+/*
+ * Like inflate_decode, but decodes into buffers from next, each with room
+ * for INFLATE_HISTORY + span + INFLATE_SLACK bytes, and hands write
+ * pieces of them in place. A piece lies in the buffer next returned last
+ * and, once written, the decoder is done with that buffer for good, so
+ * write may keep it. Only the piece of the first buffer starts at its
+ * beginning, the others INFLATE_HISTORY bytes in, and all but the last
+ * piece hold span bytes or more.
+ */
+int8_t inflate_decode_into(InflateDecoder *dec, inflate_read_fn read,
+			   inflate_next_fn next, size_t span,
+			   inflate_write_fn write, void *ctx);
+
+/*
+ * Decodes a raw DEFLATE stream held whole in memory straight into out,
+ * which must have room for out_cap + INFLATE_SLACK bytes, with no copies
+ * or callbacks. Output longer than out_cap is an error. Returns 0 with
+ * the decoded size in out_len, or -2 on malformed or truncated data.
+ */
+int8_t inflate_decode_buffer(InflateDecoder *dec, const void *in,
+			     size_t in_len, void *out, size_t out_cap,
+			     size_t *out_len);
+
+/* CRC-32 of the output of the last stream dec decoded in full */
+uint32_t inflate_crc(const InflateDecoder *dec);
+
+/* Which decoder build this CPU runs, for --cpu-info */
+const char *inflate_kernel(void);
+
+/*
+ * Decodes a raw DEFLATE stream held whole in memory on up to jobs threads
+ * and pushes the output to write in order, exactly as inflate_decode
+ * would. Each round, every thread but the first guesses where a block
+ * starts in its chunk_len bytes of input and decodes from there with the
+ * history before it left symbolic; guesses that prove wrong are decoded
+ * again serially. Each thread holds up to about 32 * chunk_len bytes of
+ * output. Returns 0 with the CRC-32 of the output in crc, -1 when write
+ * or an allocation failed, or -2 on malformed or truncated data.
+ */
+int8_t inflate_decode_parallel(const void *in, size_t in_len, unsigned jobs,
+			       size_t chunk_len, inflate_write_fn write,
+			       void *ctx, uint32_t *crc);
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+#include <sys/stat.h>
+
+typedef struct ResumeJournal ResumeJournal;
+
+/*
+ * Opens the journal of an extraction into dir_fd and loads the entries it
+ * lists as done, provided it was written for this archive: same size,
+ * modification time and entry count. Any other journal is started over.
+ * NULL on errors, reported.
+ */
+ResumeJournal *journal_open(int dir_fd, const struct stat *archive,
+			    uint64_t entry_count);
+
+/* Whether entry index was recorded with this CRC and size */
+bool journal_has(const ResumeJournal *j, uint64_t index, uint32_t crc,
+		 uint64_t size);
+
+/*
+ * Records entry index as extracted. Records go out in batches, every few
+ * seconds, each after a syncfs, so the journal never lists data a crash
+ * could still lose. A journal that cannot be written is reported once and
+ * then ignored.
+ */
+void journal_add(ResumeJournal *j, uint64_t index, uint32_t crc,
+		 uint64_t size);
+
+/*
+ * Writes what is still batched and frees j. When the extraction finished
+ * the journal has served its purpose and is removed instead.
+ */
+void journal_close(ResumeJournal *j, bool finished);
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+typedef struct BufferPool BufferPool;
+
+/*
+ * Reusable buffers in power-of-two size classes, 64-byte aligned. Only
+ * the thread owning a pool takes buffers from it, without locking, but
+ * any thread may give them back; they return to the pool they came
+ * from. With huge_pages, classes of 2 MiB and up are backed by
+ * transparent huge pages where the kernel offers them.
+ */
+BufferPool *pool_new(bool huge_pages);
+
+/* Frees the pool and every buffer given back to it; none may be in use */
+void pool_free(BufferPool *pool);
+
+/* A buffer of at least size bytes, or NULL */
+void *pool_get(BufferPool *pool, size_t size);
+
+/* Gives buf back to its pool, from any thread; NULL is ignored */
+void pool_put(void *buf);
+
+/* Bytes a request for size actually occupies */
+size_t pool_class_size(size_t size);
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef PRINT_H
+#define PRINT_H
+
+#include "unzip.h"
+#include <stdint.h>
+
+/*
+ * Writes the data of the entry called name to fd, like unzip -p, and
+ * checks its size and CRC once it is out. Into a pipe, which is grown
+ * for fewer wakeups, stored data is spliced straight from the page cache.
+ * Deflated data is written from the decoder's buffer: pages handed over
+ * with vmsplice could not be reused while the reader might still splice
+ * them on, and fresh ones cost more than the copy. Returns 0, -2 when
+ * the entry is missing, unsupported or damaged, or -1 on other errors.
+ */
+int8_t zip_print_entry(ZipArchive *archive, const char *filename,
+		       const char *name, int fd);
+
+#endif
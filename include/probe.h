@@ -0,0 +1,17 @@
+#ifndef PROBE_H
+#define PROBE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Classifies files as ZIP, ZIP64, truncated ZIP or not a ZIP from their
+ * first bytes and the end records in their tail, without parsing further,
+ * and prints one tab separated line per file. Files go through in batches
+ * whose statx, open, read and close calls are submitted together with
+ * io_uring, or made one by one where io_uring is unavailable. With paths
+ * NULL, newline separated paths are read from stdin.
+ */
+int8_t zip_probe(char *const paths[], size_t npaths);
+
+#endif
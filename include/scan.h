@@ -0,0 +1,22 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include "unzip.h"
+#include <stdint.h>
+
+typedef struct {
+	bool cache_neutral; /* leave the page cache as the scan found it */
+} ZipScanOptions;
+
+/*
+ * Decodes every entry and checks its size and CRC, printing the results
+ * like unzip -t. Entry data is read in large sequential chunks through a
+ * descriptor of its own. With cache_neutral those reads use O_DIRECT, or,
+ * where the file system refuses it, each chunk is dropped from the page
+ * cache once consumed. Returns 0 when every entry is intact, -2 when some
+ * are not, -1 on other errors.
+ */
+int8_t zip_test_archive(ZipArchive *archive, const char *filename,
+			const ZipScanOptions *opts);
+
+#endif
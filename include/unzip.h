@@ -17,6 +17,36 @@
 
 #define LFD_SIGNATURE 0x06054b50
 
+#define LFH_SIGNATURE 0x04034b50
+#define LFH_FIXED_SIZE 30
+
+#define ZIP64_EOCD_FIXED_SIZE 56
+#define ZIP64_EOCD_LOCATOR_SIZE 20
+#define ZIP64_EXTRA_ID 0x0001
+#define ZIP64_LIMIT_U16 0xFFFF
+#define ZIP64_LIMIT_U32 0xFFFFFFFF
+
+#define ZIP_NAME_MAX 0xFFFF
+
+/*
+ * Optional name index: a minimal perfect hash over entry names, stored as an
+ * unreferenced record right before the central directory and located through
+ * the fixed trailer that ends it. Other tools skip it like any gap.
+ */
+#define ZIP_INDEX_SIGNATURE 0x5849505a /* "ZPIX" */
+#define ZIP_INDEX_VERSION 1
+#define ZIP_INDEX_HEADER_SIZE 40
+#define ZIP_INDEX_TRAILER_SIZE 16
+#define ZIP_INDEX_BUCKET_SIZE 4 /* average names per displacement bucket */
+#define ZIP_INDEX_EMPTY 0xFFFFFFFF
+
+/* COMPRESSION METHODS */
+#define ZIP_METHOD_STORE 0
+#define ZIP_METHOD_DEFLATE 8
+
+/* GENERAL PURPOSE FLAGS */
+#define ZIP_FLAG_ENCRYPTED 0x0001
+
 typedef struct ZipArchive ZipArchive;
 
 /* Local File Header */
@@ -103,12 +133,88 @@ typedef struct {
 	/* NOT IMPLEMENTED .ZIP file comment (variable size) */
 } __attribute__((packed)) EOCD;
 
+/* Central directory entry, decoded with its ZIP64 fields applied */
+typedef struct {
+	uint64_t comp_size;
+	uint64_t uncomp_size;
+	uint64_t local_header_offset;
+	uint32_t crc32;
+	uint32_t external_file_attr;
+	uint16_t comp_method;
+	uint16_t bit_flag;
+	uint16_t last_mod_file_time;
+	uint16_t last_mod_file_date;
+	uint16_t file_name_len;
+} ZipEntry;
+
+typedef struct {
+	bool front_coded; /* front-code sorted names: far smaller, slower */
+	bool lazy; /* decode the central directory in windows, on demand */
+	bool scan_only; /* build nothing: entries only through zip_iter_* */
+} ZipOpenOptions;
+
+/* Window of the central directory iterator, enough for any one record */
+#define ZIP_ITER_WINDOW (256 * 1024)
+
+typedef struct ZipIterator ZipIterator;
+
+/*
+ * Transient view of one central directory record. name is not terminated
+ * and, like the view, only valid until the next zip_iter_next.
+ */
+typedef struct {
+	ZipEntry entry;
+	const char *name;
+} ZipEntryView;
+
+/*
+ * Maps the archive and indexes its central directory. When the archive
+ * carries a valid name index it is used in place, with nothing built.
+ */
 ZipArchive *openzip(const char *filename);
+ZipArchive *openzip_ex(const char *filename, const ZipOpenOptions *opts);
 void closezip(ZipArchive *archive);
 void zip_inspect_archive(ZipArchive *archive);
+uint64_t zip_entry_count(const ZipArchive *archive);
+int8_t zip_get_entry(ZipArchive *archive, uint64_t index, ZipEntry *entry);
+
+/*
+ * Returns the NUL-terminated name of an entry, either in place or copied
+ * into buf, which must hold ZIP_NAME_MAX + 1 bytes. NULL on error.
+ */
+const char *zip_entry_name(ZipArchive *archive, uint64_t index, char *buf);
+
+/* Index of the entry called name, or -1 when there is none */
+int64_t zip_locate(ZipArchive *archive, const char *name);
+
+/*
+ * Forward iteration over the central directory through one fixed window
+ * read with pread, whatever its size and however the archive was opened.
+ * zip_iter_next returns 0 with a view, 1 past the last entry, or -1/-2 on
+ * read or format errors.
+ */
+ZipIterator *zip_iter_new(ZipArchive *archive);
+int8_t zip_iter_next(ZipIterator *it, ZipEntryView *view);
+void zip_iter_free(ZipIterator *it);
+
+/* Prints the entries like unzip -l, in constant memory */
+int8_t zip_list_archive(ZipArchive *archive);
 int8_t find_eocd(FILE *fp, EOCD *eocd);
 int8_t find_zip64_eocd(FILE *fp, ZIP64_EOCD *eocd);
 
+/*
+ * Buffer based end record helpers behind find_eocd and find_zip64_eocd,
+ * for callers already holding the tail of a file. zip_scan_eocd searches
+ * the last len bytes backwards and returns the EOCD offset in tail, or -1.
+ * The parsers return -2 when the signature does not match.
+ */
+int64_t zip_scan_eocd(const unsigned char *tail, size_t len);
+
+/* Which signature scanner this CPU runs, for --cpu-info */
+const char *zip_scan_kernel(void);
+int8_t zip_parse_zip64_locator(const unsigned char *p, uint64_t *record_offset);
+int8_t zip_parse_zip64_eocd(const unsigned char *p, ZIP64_EOCD *eocd);
+
 static inline uint16_t read_u16(const unsigned char *buffer, size_t offset)
 {
 	return (uint16_t)buffer[offset] | ((uint16_t)buffer[offset + 1] << 8);
@@ -132,4 +238,64 @@ static inline uint64_t read_u64(const unsigned char *buffer, size_t offset)
 	       ((uint64_t)buffer[offset + 7] << 56);
 }
 
+static inline void write_u16(unsigned char *buffer, size_t offset,
+			     uint16_t value)
+{
+	buffer[offset] = value;
+	buffer[offset + 1] = value >> 8;
+}
+
+static inline void write_u32(unsigned char *buffer, size_t offset,
+			     uint32_t value)
+{
+	write_u16(buffer, offset, value);
+	write_u16(buffer, offset + 2, value >> 16);
+}
+
+static inline void write_u64(unsigned char *buffer, size_t offset,
+			     uint64_t value)
+{
+	write_u32(buffer, offset, value);
+	write_u32(buffer, offset + 4, value >> 32);
+}
+
+static inline uint64_t zip_index_mix(uint64_t x)
+{
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ULL;
+	x ^= x >> 33;
+	return x;
+}
+
+/* Seeded 64-bit hash of an entry name, shared by the writer and reader */
+static inline uint64_t zip_name_hash(const void *name, size_t len,
+				     uint64_t seed)
+{
+	const unsigned char *p = name;
+	uint64_t h = seed ^ (len * 0x9e3779b97f4a7c15ULL);
+
+	for (; len >= 8; p += 8, len -= 8)
+		h = (h ^ zip_index_mix(read_u64(p, 0))) * 0x9e3779b97f4a7c15ULL;
+
+	uint64_t tail = 0;
+	for (size_t i = 0; i < len; i++)
+		tail |= (uint64_t)p[i] << (8 * i);
+
+	return zip_index_mix(h ^ tail);
+}
+
+static inline uint32_t zip_index_bucket(uint64_t hash, uint32_t nbuckets)
+{
+	return (hash >> 32) % nbuckets;
+}
+
+static inline uint32_t zip_index_slot(uint64_t hash, uint32_t displacement,
+				      uint32_t nslots)
+{
+	return zip_index_mix(hash + displacement * 0x9e3779b97f4a7c15ULL) %
+	       nslots;
+}
+
 #endif
@@ -0,0 +1,26 @@
+#ifndef ZIPWRITE_H
+#define ZIPWRITE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+	int level; /* DEFLATE_LEVEL_STORE up to DEFLATE_LEVEL_OPTIMAL */
+	unsigned jobs; /* compression threads, 0 for one per online CPU */
+	bool no_sample; /* compress even entries whose samples don't shrink */
+	bool rsyncable; /* delta-transfer friendly DEFLATE output */
+	bool index; /* embed a perfect hash name index for zippeek readers */
+	bool verbose; /* report each entry and a summary on stderr */
+} ZipWriteOptions;
+
+/*
+ * Writes a new archive holding the given files and directory trees.
+ * Entries are compressed in parallel and laid out in argument order, with
+ * directory contents sorted by name. Files of 64 KiB and up are sampled
+ * first: when a fast trial compression of a few slices barely shrinks them
+ * they are stored without compressing the rest.
+ */
+int8_t zip_create(const char *filename, char *const paths[], size_t npaths,
+		  const ZipWriteOptions *opts);
+
+#endif
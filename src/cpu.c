@@ -0,0 +1,67 @@
+/*
+ * cpu.c -- Instruction Set Detection
+ * Copyright (C) 2025 Jacopo Costantini
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "cpu.h"
+#include <stdlib.h>
+#include <string.h>
+
+static const char *const level_names[] = { "generic", "pclmul", "avx2",
+					   "avx512" };
+
+static CpuLevel detect(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (!__builtin_cpu_supports("sse4.1") ||
+	    !__builtin_cpu_supports("pclmul"))
+		return CPU_GENERIC;
+	if (!__builtin_cpu_supports("avx2") || !__builtin_cpu_supports("bmi") ||
+	    !__builtin_cpu_supports("bmi2") ||
+	    !__builtin_cpu_supports("lzcnt"))
+		return CPU_PCLMUL;
+	if (!__builtin_cpu_supports("avx512f") ||
+	    !__builtin_cpu_supports("avx512bw") ||
+	    !__builtin_cpu_supports("avx512vl") ||
+	    !__builtin_cpu_supports("vpclmulqdq"))
+		return CPU_AVX2;
+	return CPU_AVX512;
+#else
+	return CPU_GENERIC;
+#endif
+}
+
+CpuLevel cpu_level(void)
+{
+	static int level = -1;
+
+	if (level < 0) {
+		const char *cap = getenv("ZIPPEEK_CPU");
+
+		level = detect();
+		for (int i = 0; cap != NULL && i < level; i++)
+			if (strcmp(cap, level_names[i]) == 0)
+				level = i;
+	}
+
+	return level;
+}
+
+const char *cpu_level_name(CpuLevel level)
+{
+	return level_names[level];
+}
@@ -0,0 +1,237 @@
+/*
+ * crc32.c -- CRC-32 Checksum
+ * Copyright (C) 2025 Jacopo Costantini
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "crc32.h"
+#include "cpu.h"
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_CRC_FOLD
+#endif
+
+#define CRC32_POLY 0xEDB88320u
+#define CRC_FOLD_MIN 64 /* shorter runs stay on the tables */
+#define CRC_WIDE_MIN 512 /* and these on 128-bit folding */
+
+/* Slicing-by-8: table k advances a byte k positions ahead of the end */
+static uint32_t crc_table[8][256];
+
+#ifdef HAVE_CRC_FOLD
+static CpuLevel crc_level;
+
+/*
+ * Carry-less multiplication folding (Intel, "Fast CRC Computation for
+ * Generic Polynomials Using PCLMULQDQ"). A 128-bit lane is folded forward
+ * D bits by multiplying its halves by x^(D+32) and x^(D-32) mod P, bit
+ * reflected, and adding it to the data there. The kernels fold the bulk
+ * into one lane, then finish alike with a Barrett reduction to 32 bits.
+ * All take and return the inverted crc.
+ */
+#define FOLD_CONST(lo, hi) _mm_set_epi64x(hi, lo)
+#define K128 FOLD_CONST(0x01751997d0, 0x00ccaa009e)
+#define K512 FOLD_CONST(0x0154442bd4, 0x01c6e41596)
+
+#define PCLMUL_TARGET __attribute__((target("pclmul,sse4.1")))
+#define WIDE_TARGET                                                          \
+	__attribute__((target("avx512f,avx512bw,avx512vl,vpclmulqdq,"       \
+			      "pclmul,sse4.1")))
+
+static inline __attribute__((always_inline)) PCLMUL_TARGET __m128i
+fold(__m128i x, __m128i k, __m128i next)
+{
+	__m128i t = _mm_clmulepi64_si128(x, k, 0x00);
+
+	x = _mm_clmulepi64_si128(x, k, 0x11);
+	return _mm_xor_si128(_mm_xor_si128(x, t), next);
+}
+
+/* Folds the remaining 16-byte blocks into x, then reduces it */
+static inline __attribute__((always_inline)) PCLMUL_TARGET uint32_t
+fold_finish(__m128i x, const unsigned char *p, size_t len)
+{
+	const __m128i k5 = _mm_set_epi64x(0, 0x0163cd6124);
+	const __m128i poly = FOLD_CONST(0x01db710641, 0x01f7011641);
+	const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+	__m128i t;
+
+	for (; len >= 16; p += 16, len -= 16)
+		x = fold(x, K128, _mm_loadu_si128((const __m128i *)p));
+
+	/* 128 bits down to 64, then 32 more zero bits appended */
+	t = _mm_clmulepi64_si128(x, K128, 0x10);
+	x = _mm_xor_si128(_mm_srli_si128(x, 8), t);
+	t = _mm_srli_si128(x, 4);
+	x = _mm_clmulepi64_si128(_mm_and_si128(x, mask32), k5, 0x00);
+	x = _mm_xor_si128(x, t);
+
+	t = _mm_clmulepi64_si128(_mm_and_si128(x, mask32), poly, 0x10);
+	t = _mm_clmulepi64_si128(_mm_and_si128(t, mask32), poly, 0x00);
+	x = _mm_xor_si128(x, t);
+
+	return _mm_extract_epi32(x, 1);
+}
+
+/* Four lanes, 64 bytes a round; len a multiple of 16, at least 64 */
+PCLMUL_TARGET static uint32_t crc_fold(uint32_t crc, const unsigned char *p,
+				       size_t len)
+{
+	__m128i x1 = _mm_loadu_si128((const __m128i *)(p + 0x00));
+	__m128i x2 = _mm_loadu_si128((const __m128i *)(p + 0x10));
+	__m128i x3 = _mm_loadu_si128((const __m128i *)(p + 0x20));
+	__m128i x4 = _mm_loadu_si128((const __m128i *)(p + 0x30));
+
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+	for (p += 64, len -= 64; len >= 64; p += 64, len -= 64) {
+		x1 = fold(x1, K512, _mm_loadu_si128((const __m128i *)(p + 0)));
+		x2 = fold(x2, K512, _mm_loadu_si128((const __m128i *)(p + 16)));
+		x3 = fold(x3, K512, _mm_loadu_si128((const __m128i *)(p + 32)));
+		x4 = fold(x4, K512, _mm_loadu_si128((const __m128i *)(p + 48)));
+	}
+	x1 = fold(x1, K128, x2);
+	x1 = fold(x1, K128, x3);
+	x1 = fold(x1, K128, x4);
+
+	return fold_finish(x1, p, len);
+}
+
+static inline __attribute__((always_inline)) WIDE_TARGET __m512i
+fold_wide(__m512i x, __m512i k, __m512i next)
+{
+	__m512i t = _mm512_clmulepi64_epi128(x, k, 0x00);
+
+	x = _mm512_clmulepi64_epi128(x, k, 0x11);
+	return _mm512_ternarylogic_epi64(x, t, next, 0x96);
+}
+
+/*
+ * Sixteen lanes in four 512-bit registers, 256 bytes a round; len a
+ * multiple of 16, at least CRC_WIDE_MIN
+ */
+WIDE_TARGET static uint32_t crc_fold_wide(uint32_t crc, const unsigned char *p,
+					  size_t len)
+{
+	const __m512i k2048 = _mm512_broadcast_i32x4(
+		FOLD_CONST(0x011542778a, 0x01322d1430));
+	const __m512i k512 = _mm512_broadcast_i32x4(K512);
+	/* Lanes 0 to 2 of the last register onto lane 3 */
+	const __m512i k_lanes = _mm512_set_epi64(0, 0, 0x00ccaa009e,
+						 0x01751997d0, 0x015a546366,
+						 0x00f1da05aa, 0x0174359406,
+						 0x003db1ecdc);
+	__m512i x0 = _mm512_loadu_si512(p + 0x00);
+	__m512i x1 = _mm512_loadu_si512(p + 0x40);
+	__m512i x2 = _mm512_loadu_si512(p + 0x80);
+	__m512i x3 = _mm512_loadu_si512(p + 0xC0);
+
+	x0 = _mm512_xor_si512(x0, _mm512_inserti32x4(_mm512_setzero_si512(),
+						     _mm_cvtsi32_si128(crc), 0));
+	for (p += 256, len -= 256; len >= 256; p += 256, len -= 256) {
+		x0 = fold_wide(x0, k2048, _mm512_loadu_si512(p + 0x00));
+		x1 = fold_wide(x1, k2048, _mm512_loadu_si512(p + 0x40));
+		x2 = fold_wide(x2, k2048, _mm512_loadu_si512(p + 0x80));
+		x3 = fold_wide(x3, k2048, _mm512_loadu_si512(p + 0xC0));
+	}
+	x1 = fold_wide(x0, k512, x1);
+	x2 = fold_wide(x1, k512, x2);
+	x3 = fold_wide(x2, k512, x3);
+
+	__m512i lo = _mm512_clmulepi64_epi128(x3, k_lanes, 0x00);
+	__m512i hi = _mm512_clmulepi64_epi128(x3, k_lanes, 0x11);
+	__m512i t = _mm512_xor_si512(lo, hi);
+	__m128i x = _mm_xor_si128(
+		_mm_xor_si128(_mm512_extracti32x4_epi32(t, 0),
+			      _mm512_extracti32x4_epi32(t, 1)),
+		_mm_xor_si128(_mm512_extracti32x4_epi32(t, 2),
+			      _mm512_extracti32x4_epi32(x3, 3)));
+
+	return fold_finish(x, p, len);
+}
+#endif
+
+__attribute__((constructor)) static void crc32_init_tables(void)
+{
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t c = i;
+		for (int k = 0; k < 8; k++)
+			c = (c >> 1) ^ (CRC32_POLY & -(c & 1));
+		crc_table[0][i] = c;
+	}
+
+	for (uint32_t i = 0; i < 256; i++) {
+		for (int k = 1; k < 8; k++)
+			crc_table[k][i] = (crc_table[k - 1][i] >> 8) ^
+					  crc_table[0][crc_table[k - 1][i] & 0xFF];
+	}
+
+#ifdef HAVE_CRC_FOLD
+	crc_level = cpu_level();
+#endif
+}
+
+uint32_t crc32_update(uint32_t crc, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+
+	crc = ~crc;
+#ifdef HAVE_CRC_FOLD
+	if (crc_level >= CPU_PCLMUL && len >= CRC_FOLD_MIN) {
+		size_t n = len & ~(size_t)15;
+
+		if (crc_level >= CPU_AVX512 && n >= CRC_WIDE_MIN)
+			crc = crc_fold_wide(crc, p, n);
+		else
+			crc = crc_fold(crc, p, n);
+		p += n;
+		len -= n;
+	}
+#endif
+	while (len > 0 && ((uintptr_t)p & 7) != 0) {
+		crc = (crc >> 8) ^ crc_table[0][(crc ^ *p++) & 0xFF];
+		len--;
+	}
+
+	while (len >= 8) {
+		uint32_t lo, hi;
+		memcpy(&lo, p, sizeof(lo));
+		memcpy(&hi, p + 4, sizeof(hi));
+		lo ^= crc;
+		crc = crc_table[7][lo & 0xFF] ^ crc_table[6][(lo >> 8) & 0xFF] ^
+		      crc_table[5][(lo >> 16) & 0xFF] ^ crc_table[4][lo >> 24] ^
+		      crc_table[3][hi & 0xFF] ^ crc_table[2][(hi >> 8) & 0xFF] ^
+		      crc_table[1][(hi >> 16) & 0xFF] ^ crc_table[0][hi >> 24];
+		p += 8;
+		len -= 8;
+	}
+
+	while (len-- > 0)
+		crc = (crc >> 8) ^ crc_table[0][(crc ^ *p++) & 0xFF];
+
+	return ~crc;
+}
+
+const char *crc32_kernel(void)
+{
+#ifdef HAVE_CRC_FOLD
+	if (crc_level >= CPU_AVX512)
+		return "avx512 vpclmulqdq folding";
+	if (crc_level >= CPU_PCLMUL)
+		return "pclmulqdq folding";
+#endif
+	return "slicing-by-8 tables";
+}
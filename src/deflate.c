@@ -0,0 +1,1513 @@
+/*
+ * deflate.c -- DEFLATE Encoder
+ * Copyright (C) 2025 Jacopo Costantini
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "deflate.h"
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define WSIZE DEFLATE_WINDOW_SIZE
+#define WMASK (WSIZE - 1)
+#define HASH_BITS 15
+#define HASH_SIZE (1u << HASH_BITS)
+
+#define SEQ_CAP 32768 /* sequences buffered before a block is emitted */
+#define SPLIT_CHUNK 2048 /* sequences per candidate split segment */
+#define MIN_BLOCK_LEN 1024 /* smallest block produced by splitting */
+#define TOO_FAR 4096 /* length 3 matches further than this cost more */
+#define REBASE_LIMIT 0x80000000u
+
+#define RSYNC_BITS 16 /* one reset every 64 KiB on average */
+#define RSYNC_MIN_CHUNK 16384
+
+#define OPT_SEGMENT (1u << 18) /* input parsed optimally at a time */
+#define OPT_MAX_CHAIN 2048
+#define OPT_MAX_MATCHES 32 /* matches of increasing length per position */
+#define OPT_ITERATIONS 15 /* cost model refinements per segment */
+#define OPT_BLOCK_ITERATIONS 5 /* and again per block once split */
+#define OPT_UNUSED_COST 15 /* bits assumed for symbols not seen yet */
+
+#define LITLEN_SYMS 288
+#define DIST_SYMS 32
+#define PRECODE_SYMS 19
+#define END_OF_BLOCK 256
+#define MAX_CODE_LEN 15
+#define MAX_PRECODE_LEN 7
+
+#define BLOCK_STORED 0
+#define BLOCK_FIXED 1
+#define BLOCK_DYNAMIC 2
+
+enum strategy { STRAT_FAST, STRAT_GREEDY, STRAT_LAZY, STRAT_OPTIMAL };
+
+struct level_params {
+	enum strategy strategy;
+	uint16_t max_chain; /* hash chain entries probed per position */
+	uint16_t good_len; /* probe a quarter of the chain past this length */
+	uint16_t nice_len; /* stop searching once a match is this long */
+	uint16_t max_lazy; /* no lazy evaluation past this length */
+	bool split; /* search the cheapest block split */
+};
+
+static const struct level_params level_table[DEFLATE_LEVEL_OPTIMAL + 1] = {
+	{ STRAT_FAST, 0, 0, 0, 0, false }, /* 0: stored, no parsing */
+	{ STRAT_FAST, 1, 0, 32, 0, false },
+	{ STRAT_FAST, 1, 0, 64, 0, false },
+	{ STRAT_GREEDY, 8, 4, 32, 0, false },
+	{ STRAT_GREEDY, 16, 8, 64, 0, false },
+	{ STRAT_GREEDY, 32, 16, 128, 0, false },
+	{ STRAT_LAZY, 128, 8, 128, 16, false },
+	{ STRAT_LAZY, 256, 8, 128, 32, true },
+	{ STRAT_LAZY, 1024, 32, 258, 128, true },
+	{ STRAT_LAZY, 4096, 32, 258, 258, true },
+	{ STRAT_OPTIMAL, OPT_MAX_CHAIN, 258, 258, 258, true },
+};
+
+static const uint16_t len_base[29] = { 3,  4,  5,  6,   7,   8,   9,   10,
+				       11, 13, 15, 17,  19,  23,  27,  31,
+				       35, 43, 51, 59,  67,  83,  99,  115,
+				       131, 163, 195, 227, 258 };
+
+static const uint8_t len_extra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1,
+				       1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+				       4, 4, 4, 4, 5, 5, 5, 5, 0 };
+
+static const uint16_t dist_base[30] = { 1,    2,    3,     4,     5,
+					7,    9,    13,    17,    25,
+					33,   49,   65,    97,    129,
+					193,  257,  385,   513,   769,
+					1025, 1537, 2049,  3073,  4097,
+					6145, 8193, 12289, 16385, 24577 };
+
+static const uint8_t dist_extra[30] = { 0, 0, 0,  0,  1,  1,  2,  2,
+					3, 3, 4,  4,  5,  5,  6,  6,
+					7, 7, 8,  8,  9,  9,  10, 10,
+					11, 11, 12, 12, 13, 13 };
+
+static const uint8_t precode_order[PRECODE_SYMS] = {
+	16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+/* A literal when dist is 0, otherwise a back-reference */
+struct seq {
+	uint16_t dist;
+	uint16_t litlen;
+};
+
+struct freqs {
+	uint32_t litlen[LITLEN_SYMS];
+	uint32_t dist[DIST_SYMS];
+};
+
+struct block_plan {
+	uint8_t litlen_len[LITLEN_SYMS];
+	uint8_t dist_len[DIST_SYMS];
+	uint8_t precode_len[PRECODE_SYMS];
+	uint8_t rle_sym[LITLEN_SYMS + DIST_SYMS];
+	uint8_t rle_extra[LITLEN_SYMS + DIST_SYMS];
+	unsigned nrle;
+	unsigned hlit;
+	unsigned hdist;
+	unsigned hclen;
+};
+
+struct lz_match {
+	uint16_t len;
+	uint16_t dist;
+};
+
+/* Working memory of the near-optimal parser */
+struct optimal_state {
+	uint32_t *match_at; /* first match of each segment position */
+	struct lz_match *matches;
+	size_t match_cap;
+	uint32_t *cost; /* cheapest encoding of the first i bytes */
+	struct seq *step; /* last sequence of that encoding */
+	struct seq *trial;
+	struct seq *best;
+	size_t nbest;
+};
+
+/* Bits per symbol the optimal parser assumes */
+struct cost_model {
+	uint32_t lit[256];
+	uint32_t len[DEFLATE_MAX_MATCH + 1];
+	uint32_t dist[DIST_SYMS];
+};
+
+struct split_state {
+	struct freqs *sum; /* statistics of every chunk before this one */
+	size_t *seq_at; /* first sequence of each chunk, plus the end */
+	size_t *byte_at; /* first input byte of each chunk, plus the end */
+	bool *cut; /* a block ends after this chunk */
+};
+
+struct bitwriter {
+	uint8_t *start;
+	uint8_t *next;
+	uint8_t *end;
+	uint64_t buf;
+	unsigned count;
+	bool overflow;
+};
+
+struct DeflateEncoder {
+	const struct level_params *params;
+	int level;
+	const uint8_t *in;
+	size_t in_len;
+	size_t base; /* position hash table entries are relative to */
+	size_t window_start; /* matches never reach before this position */
+	size_t block_start; /* first input byte of the pending block */
+	size_t seq_pos; /* input consumed by the buffered sequences */
+	struct seq *seqs;
+	size_t nseqs;
+	size_t seq_cap;
+	uint32_t *head;
+	uint32_t *prev;
+	struct bitwriter bw;
+	struct split_state split;
+	struct optimal_state *opt;
+	bool rsyncable;
+	size_t rsync_pos; /* input rolled into rsync_hash so far */
+	uint64_t rsync_hash;
+};
+
+static inline uint32_t load_u32(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint32_t hash4(const uint8_t *p)
+{
+	return (load_u32(p) * 2654435761u) >> (32 - HASH_BITS);
+}
+
+static inline uint32_t hash3(const uint8_t *p)
+{
+	uint32_t v = (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+		     ((uint32_t)p[2] << 16);
+	return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+/* Number of equal leading bytes of a and b, at most max */
+static inline unsigned match_len(const uint8_t *a, const uint8_t *b,
+				 unsigned max)
+{
+	unsigned len = 0;
+
+#ifdef __SSE2__
+	while (len + 16 <= max) {
+		__m128i x = _mm_loadu_si128((const __m128i *)(a + len));
+		__m128i y = _mm_loadu_si128((const __m128i *)(b + len));
+		unsigned diff =
+			(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) ^
+			0xFFFF;
+		if (diff != 0)
+			return len + __builtin_ctz(diff);
+		len += 16;
+	}
+#endif
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	while (len + 8 <= max) {
+		uint64_t x, y;
+		memcpy(&x, a + len, sizeof(x));
+		memcpy(&y, b + len, sizeof(y));
+		if (x != y)
+			return len + (__builtin_ctzll(x ^ y) >> 3);
+		len += 8;
+	}
+#endif
+	while (len < max && a[len] == b[len])
+		len++;
+
+	return len;
+}
+
+static inline unsigned len_code(unsigned len)
+{
+	unsigned x = len - 3;
+
+	if (len == DEFLATE_MAX_MATCH)
+		return 28;
+	if (x < 8)
+		return x;
+
+	unsigned bits = 31 - __builtin_clz(x);
+	return 4 * (bits - 1) + ((x >> (bits - 2)) & 3);
+}
+
+static inline unsigned dist_code(unsigned dist)
+{
+	unsigned x = dist - 1;
+
+	if (x < 4)
+		return x;
+
+	unsigned bits = 31 - __builtin_clz(x);
+	return 2 * bits + ((x >> (bits - 1)) & 1);
+}
+
+static inline uint16_t reverse_bits(uint16_t code, unsigned len)
+{
+	uint16_t out = 0;
+
+	for (unsigned i = 0; i < len; i++) {
+		out = (out << 1) | (code & 1);
+		code >>= 1;
+	}
+
+	return out;
+}
+
+static inline void put_bits(struct bitwriter *bw, uint32_t bits, unsigned n)
+{
+	bw->buf |= (uint64_t)bits << bw->count;
+	bw->count += n;
+	if (bw->count < 32)
+		return;
+
+	if (bw->end - bw->next >= 4) {
+		uint32_t word = (uint32_t)bw->buf;
+		bw->next[0] = word;
+		bw->next[1] = word >> 8;
+		bw->next[2] = word >> 16;
+		bw->next[3] = word >> 24;
+		bw->next += 4;
+	} else {
+		bw->overflow = true;
+	}
+	bw->buf >>= 32;
+	bw->count -= 32;
+}
+
+/* Pads to a byte boundary and writes out every pending bit */
+static void flush_bits(struct bitwriter *bw)
+{
+	while (bw->count > 0) {
+		if (bw->next < bw->end)
+			*bw->next++ = (uint8_t)bw->buf;
+		else
+			bw->overflow = true;
+		bw->buf >>= 8;
+		bw->count = bw->count > 8 ? bw->count - 8 : 0;
+	}
+	bw->buf = 0;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/*
+ * Huffman code lengths for freq, limited to max_len bits. Every code built
+ * here is complete: a lone symbol gets a partner so strict decoders accept
+ * the table.
+ */
+static void build_code_lengths(const uint32_t *freq, unsigned nsyms,
+			       unsigned max_len, uint8_t *lens)
+{
+	uint64_t sorted[LITLEN_SYMS];
+	uint32_t weight[2 * LITLEN_SYMS];
+	uint16_t parent[2 * LITLEN_SYMS];
+	uint8_t depth[2 * LITLEN_SYMS];
+	unsigned bl_count[MAX_CODE_LEN + 1] = { 0 };
+	unsigned n = 0;
+
+	memset(lens, 0, nsyms);
+	for (unsigned s = 0; s < nsyms; s++) {
+		if (freq[s] != 0)
+			sorted[n++] = ((uint64_t)freq[s] << 16) | s;
+	}
+
+	if (n < 2) {
+		unsigned used = n == 1 ? (unsigned)(sorted[0] & 0xFFFF) : 0;
+		lens[used] = 1;
+		lens[used == 0 ? 1 : 0] = 1;
+		return;
+	}
+
+	qsort(sorted, n, sizeof(sorted[0]), compare_u64);
+
+	/* Two-queue construction: leaves are sorted, internal nodes are
+	 * created in non-decreasing weight order. */
+	for (unsigned i = 0; i < n; i++)
+		weight[i] = (uint32_t)(sorted[i] >> 16);
+
+	unsigned leaf = 0, node = n;
+	for (unsigned next = n; next < 2 * n - 1; next++) {
+		unsigned pick[2];
+		for (unsigned k = 0; k < 2; k++) {
+			if (leaf < n &&
+			    (node >= next || weight[leaf] <= weight[node]))
+				pick[k] = leaf++;
+			else
+				pick[k] = node++;
+		}
+		weight[next] = weight[pick[0]] + weight[pick[1]];
+		parent[pick[0]] = next;
+		parent[pick[1]] = next;
+	}
+
+	depth[2 * n - 2] = 0;
+	for (int i = 2 * n - 3; i >= 0; i--)
+		depth[i] = depth[parent[i]] + 1;
+
+	for (unsigned i = 0; i < n; i++)
+		bl_count[depth[i] < max_len ? depth[i] : max_len]++;
+
+	/* Clamping oversubscribes the code: move leaves down until the Kraft
+	 * sum is exactly one again. */
+	uint32_t kraft = 0;
+	for (unsigned len = 1; len <= max_len; len++)
+		kraft += bl_count[len] << (max_len - len);
+	while (kraft > (1u << max_len)) {
+		bl_count[max_len]--;
+		for (unsigned len = max_len - 1; len > 0; len--) {
+			if (bl_count[len] != 0) {
+				bl_count[len]--;
+				bl_count[len + 1] += 2;
+				break;
+			}
+		}
+		kraft--;
+	}
+
+	/* The rarest symbols take the longest codes */
+	unsigned k = 0;
+	for (unsigned len = max_len; len >= 1; len--) {
+		for (unsigned c = bl_count[len]; c > 0; c--)
+			lens[sorted[k++] & 0xFFFF] = len;
+	}
+}
+
+static void build_codes(const uint8_t *lens, unsigned nsyms, uint16_t *codes)
+{
+	uint16_t bl_count[MAX_CODE_LEN + 1] = { 0 };
+	uint16_t next_code[MAX_CODE_LEN + 1];
+	uint16_t code = 0;
+
+	for (unsigned s = 0; s < nsyms; s++)
+		bl_count[lens[s]]++;
+	bl_count[0] = 0;
+
+	for (unsigned len = 1; len <= MAX_CODE_LEN; len++) {
+		code = (code + bl_count[len - 1]) << 1;
+		next_code[len] = code;
+	}
+
+	for (unsigned s = 0; s < nsyms; s++) {
+		if (lens[s] != 0)
+			codes[s] = reverse_bits(next_code[lens[s]]++, lens[s]);
+	}
+}
+
+static void fixed_lengths(uint8_t *litlen_len, uint8_t *dist_len)
+{
+	unsigned s = 0;
+
+	for (; s < 144; s++)
+		litlen_len[s] = 8;
+	for (; s < 256; s++)
+		litlen_len[s] = 9;
+	for (; s < 280; s++)
+		litlen_len[s] = 7;
+	for (; s < LITLEN_SYMS; s++)
+		litlen_len[s] = 8;
+	for (s = 0; s < DIST_SYMS; s++)
+		dist_len[s] = 5;
+}
+
+static void count_freqs(const struct seq *seqs, size_t lo, size_t hi,
+			struct freqs *f)
+{
+	for (size_t i = lo; i < hi; i++) {
+		if (seqs[i].dist == 0) {
+			f->litlen[seqs[i].litlen]++;
+		} else {
+			f->litlen[257 + len_code(seqs[i].litlen)]++;
+			f->dist[dist_code(seqs[i].dist)]++;
+		}
+	}
+}
+
+/* Bits spent on length and distance extra bits, whatever the code */
+static uint64_t extra_bits_cost(const struct freqs *f)
+{
+	uint64_t cost = 0;
+
+	for (unsigned c = 0; c < 29; c++)
+		cost += (uint64_t)f->litlen[257 + c] * len_extra[c];
+	for (unsigned c = 0; c < 30; c++)
+		cost += (uint64_t)f->dist[c] * dist_extra[c];
+
+	return cost;
+}
+
+static uint64_t symbols_cost(const struct freqs *f, const uint8_t *litlen_len,
+			     const uint8_t *dist_len)
+{
+	uint64_t cost = extra_bits_cost(f);
+
+	for (unsigned s = 0; s < 286; s++)
+		cost += (uint64_t)f->litlen[s] * litlen_len[s];
+	for (unsigned s = 0; s < 30; s++)
+		cost += (uint64_t)f->dist[s] * dist_len[s];
+
+	return cost;
+}
+
+static void rle_push(struct block_plan *plan, uint32_t *pre_freq, uint8_t sym,
+		     uint8_t extra)
+{
+	plan->rle_sym[plan->nrle] = sym;
+	plan->rle_extra[plan->nrle] = extra;
+	plan->nrle++;
+	pre_freq[sym]++;
+}
+
+/* Builds the dynamic Huffman tables for f and returns the block cost in bits */
+static uint64_t plan_dynamic(const struct freqs *f, struct block_plan *plan)
+{
+	uint8_t all[LITLEN_SYMS + DIST_SYMS];
+	uint32_t pre_freq[PRECODE_SYMS] = { 0 };
+
+	memset(plan->litlen_len, 0, sizeof(plan->litlen_len));
+	memset(plan->dist_len, 0, sizeof(plan->dist_len));
+	build_code_lengths(f->litlen, 286, MAX_CODE_LEN, plan->litlen_len);
+	build_code_lengths(f->dist, 30, MAX_CODE_LEN, plan->dist_len);
+
+	plan->hlit = 286;
+	while (plan->hlit > 257 && plan->litlen_len[plan->hlit - 1] == 0)
+		plan->hlit--;
+	plan->hdist = 30;
+	while (plan->hdist > 1 && plan->dist_len[plan->hdist - 1] == 0)
+		plan->hdist--;
+
+	unsigned total = plan->hlit + plan->hdist;
+	memcpy(all, plan->litlen_len, plan->hlit);
+	memcpy(all + plan->hlit, plan->dist_len, plan->hdist);
+
+	plan->nrle = 0;
+	for (unsigned i = 0; i < total;) {
+		uint8_t len = all[i];
+		unsigned run = 1;
+		while (i + run < total && all[i + run] == len)
+			run++;
+		i += run;
+
+		if (len == 0) {
+			while (run >= 11) {
+				unsigned r = run < 138 ? run : 138;
+				rle_push(plan, pre_freq, 18, r - 11);
+				run -= r;
+			}
+			if (run >= 3) {
+				rle_push(plan, pre_freq, 17, run - 3);
+				run = 0;
+			}
+		} else {
+			rle_push(plan, pre_freq, len, 0);
+			run--;
+			while (run >= 3) {
+				unsigned r = run < 6 ? run : 6;
+				rle_push(plan, pre_freq, 16, r - 3);
+				run -= r;
+			}
+		}
+		while (run-- > 0)
+			rle_push(plan, pre_freq, len, 0);
+	}
+
+	build_code_lengths(pre_freq, PRECODE_SYMS, MAX_PRECODE_LEN,
+			   plan->precode_len);
+	plan->hclen = PRECODE_SYMS;
+	while (plan->hclen > 4 &&
+	       plan->precode_len[precode_order[plan->hclen - 1]] == 0)
+		plan->hclen--;
+
+	uint64_t cost = 5 + 5 + 4 + 3 * plan->hclen;
+	for (unsigned i = 0; i < plan->nrle; i++) {
+		uint8_t sym = plan->rle_sym[i];
+		cost += plan->precode_len[sym];
+		cost += sym == 16 ? 2 : sym == 17 ? 3 : sym == 18 ? 7 : 0;
+	}
+
+	return cost + symbols_cost(f, plan->litlen_len, plan->dist_len);
+}
+
+static uint64_t fixed_cost(const struct freqs *f)
+{
+	uint8_t litlen_len[LITLEN_SYMS];
+	uint8_t dist_len[DIST_SYMS];
+
+	fixed_lengths(litlen_len, dist_len);
+	return symbols_cost(f, litlen_len, dist_len);
+}
+
+/* Stored blocks holding len bytes when the writer sits at bit bitpos */
+static uint64_t stored_cost(size_t len, unsigned bitpos)
+{
+	uint64_t cost = 3 + (8 - (bitpos + 3) % 8) % 8 + 32;
+	size_t first = len < 0xFFFF ? len : 0xFFFF;
+	size_t rest = len - first;
+
+	cost += 8 * (uint64_t)first;
+	if (rest > 0)
+		cost += (uint64_t)((rest + 0xFFFE) / 0xFFFF) * 40 + 8 * rest;
+
+	return cost;
+}
+
+/* Cheapest encoding of a block, ignoring the block header bits */
+static uint64_t block_cost(const struct freqs *f, size_t nbytes, int *type)
+{
+	struct block_plan plan;
+	uint64_t best = stored_cost(nbytes, 0);
+	uint64_t cost;
+
+	*type = BLOCK_STORED;
+	if ((cost = fixed_cost(f)) < best) {
+		best = cost;
+		*type = BLOCK_FIXED;
+	}
+	if ((cost = plan_dynamic(f, &plan)) < best) {
+		best = cost;
+		*type = BLOCK_DYNAMIC;
+	}
+
+	return best;
+}
+
+static void write_stored(struct bitwriter *bw, const uint8_t *data, size_t len,
+			 bool final)
+{
+	do {
+		size_t chunk = len < 0xFFFF ? len : 0xFFFF;
+		len -= chunk;
+
+		put_bits(bw, (final && len == 0) ? 1 : 0, 1);
+		put_bits(bw, BLOCK_STORED, 2);
+		flush_bits(bw);
+		put_bits(bw, chunk, 16);
+		put_bits(bw, ~chunk & 0xFFFF, 16);
+		flush_bits(bw);
+
+		if ((size_t)(bw->end - bw->next) >= chunk) {
+			memcpy(bw->next, data, chunk);
+			bw->next += chunk;
+		} else {
+			bw->overflow = true;
+		}
+		data += chunk;
+	} while (len > 0);
+}
+
+static void write_symbols(struct bitwriter *bw, const struct seq *seqs,
+			  size_t lo, size_t hi, const uint8_t *litlen_len,
+			  const uint16_t *litlen_code, const uint8_t *dist_len,
+			  const uint16_t *dist_code_bits)
+{
+	for (size_t i = lo; i < hi; i++) {
+		unsigned litlen = seqs[i].litlen;
+
+		if (seqs[i].dist == 0) {
+			put_bits(bw, litlen_code[litlen], litlen_len[litlen]);
+			continue;
+		}
+
+		unsigned lc = len_code(litlen);
+		unsigned dc = dist_code(seqs[i].dist);
+		put_bits(bw, litlen_code[257 + lc], litlen_len[257 + lc]);
+		put_bits(bw, litlen - len_base[lc], len_extra[lc]);
+		put_bits(bw, dist_code_bits[dc], dist_len[dc]);
+		put_bits(bw, seqs[i].dist - dist_base[dc], dist_extra[dc]);
+	}
+
+	put_bits(bw, litlen_code[END_OF_BLOCK], litlen_len[END_OF_BLOCK]);
+}
+
+static void write_block(DeflateEncoder *enc, size_t seq_lo, size_t seq_hi,
+			size_t byte_lo, size_t byte_hi, bool final)
+{
+	struct bitwriter *bw = &enc->bw;
+	struct freqs f = { 0 };
+	struct block_plan plan;
+	uint8_t litlen_len[LITLEN_SYMS];
+	uint8_t dist_len[DIST_SYMS];
+	uint16_t litlen_code[LITLEN_SYMS];
+	uint16_t dist_codes[DIST_SYMS];
+
+	count_freqs(enc->seqs, seq_lo, seq_hi, &f);
+	f.litlen[END_OF_BLOCK] = 1;
+
+	uint64_t dynamic = plan_dynamic(&f, &plan);
+	uint64_t fixed = fixed_cost(&f);
+	uint64_t stored = stored_cost(byte_hi - byte_lo, bw->count);
+
+	if (stored <= fixed && stored <= dynamic) {
+		write_stored(bw, enc->in + byte_lo, byte_hi - byte_lo, final);
+		return;
+	}
+
+	put_bits(bw, final ? 1 : 0, 1);
+	if (fixed <= dynamic) {
+		put_bits(bw, BLOCK_FIXED, 2);
+		fixed_lengths(litlen_len, dist_len);
+	} else {
+		put_bits(bw, BLOCK_DYNAMIC, 2);
+		put_bits(bw, plan.hlit - 257, 5);
+		put_bits(bw, plan.hdist - 1, 5);
+		put_bits(bw, plan.hclen - 4, 4);
+		for (unsigned i = 0; i < plan.hclen; i++)
+			put_bits(bw, plan.precode_len[precode_order[i]], 3);
+
+		uint16_t precode[PRECODE_SYMS];
+		build_codes(plan.precode_len, PRECODE_SYMS, precode);
+		for (unsigned i = 0; i < plan.nrle; i++) {
+			uint8_t sym = plan.rle_sym[i];
+			put_bits(bw, precode[sym], plan.precode_len[sym]);
+			if (sym >= 16)
+				put_bits(bw, plan.rle_extra[i],
+					 sym == 16 ? 2 : sym == 17 ? 3 : 7);
+		}
+		memcpy(litlen_len, plan.litlen_len, sizeof(litlen_len));
+		memcpy(dist_len, plan.dist_len, sizeof(dist_len));
+	}
+
+	build_codes(litlen_len, LITLEN_SYMS, litlen_code);
+	build_codes(dist_len, DIST_SYMS, dist_codes);
+	write_symbols(bw, enc->seqs, seq_lo, seq_hi, litlen_len, litlen_code,
+		      dist_len, dist_codes);
+}
+
+static uint64_t range_cost(const struct split_state *st, unsigned lo,
+			   unsigned hi)
+{
+	struct freqs f;
+	int type;
+
+	for (unsigned s = 0; s < LITLEN_SYMS; s++)
+		f.litlen[s] = st->sum[hi].litlen[s] - st->sum[lo].litlen[s];
+	for (unsigned s = 0; s < DIST_SYMS; s++)
+		f.dist[s] = st->sum[hi].dist[s] - st->sum[lo].dist[s];
+	f.litlen[END_OF_BLOCK] = 1;
+
+	return 3 + block_cost(&f, st->byte_at[hi] - st->byte_at[lo], &type);
+}
+
+/* Recursively cuts [lo, hi) at the point that lowers the total cost most */
+static void split_range(struct split_state *st, unsigned lo, unsigned hi,
+			uint64_t whole)
+{
+	uint64_t best = whole;
+	uint64_t best_left = 0, best_right = 0;
+	unsigned best_at = 0;
+
+	for (unsigned at = lo + 1; at < hi; at++) {
+		if (st->byte_at[at] - st->byte_at[lo] < MIN_BLOCK_LEN ||
+		    st->byte_at[hi] - st->byte_at[at] < MIN_BLOCK_LEN)
+			continue;
+
+		uint64_t left = range_cost(st, lo, at);
+		uint64_t right = range_cost(st, at, hi);
+		if (left + right < best) {
+			best = left + right;
+			best_left = left;
+			best_right = right;
+			best_at = at;
+		}
+	}
+
+	if (best_at == 0)
+		return;
+
+	st->cut[best_at - 1] = true;
+	split_range(st, lo, best_at, best_left);
+	split_range(st, best_at, hi, best_right);
+}
+
+/*
+ * Chops seqs, which encode the input from pos on, into chunks and marks the
+ * chunk boundaries where a new block should start. Returns the chunk count.
+ */
+static unsigned plan_splits(DeflateEncoder *enc, const struct seq *seqs,
+			    size_t nseqs, size_t pos)
+{
+	struct split_state *st = &enc->split;
+	unsigned nchunks = (nseqs + SPLIT_CHUNK - 1) / SPLIT_CHUNK;
+
+	memset(&st->sum[0], 0, sizeof(st->sum[0]));
+	for (unsigned c = 0; c < nchunks; c++) {
+		size_t lo = (size_t)c * SPLIT_CHUNK;
+		size_t hi = lo + SPLIT_CHUNK < nseqs ? lo + SPLIT_CHUNK : nseqs;
+		st->sum[c + 1] = st->sum[c];
+		count_freqs(seqs, lo, hi, &st->sum[c + 1]);
+		st->seq_at[c] = lo;
+		st->byte_at[c] = pos;
+		st->cut[c] = false;
+		for (size_t i = lo; i < hi; i++)
+			pos += seqs[i].dist ? seqs[i].litlen : 1;
+	}
+	st->seq_at[nchunks] = nseqs;
+	st->byte_at[nchunks] = pos;
+
+	if (nchunks >= 2)
+		split_range(st, 0, nchunks, range_cost(st, 0, nchunks));
+
+	return nchunks;
+}
+
+static void flush_block(DeflateEncoder *enc, bool final)
+{
+	struct split_state *st = &enc->split;
+
+	if (!enc->params->split || enc->nseqs <= SPLIT_CHUNK) {
+		write_block(enc, 0, enc->nseqs, enc->block_start, enc->seq_pos,
+			    final);
+		goto done;
+	}
+
+	unsigned nchunks =
+		plan_splits(enc, enc->seqs, enc->nseqs, enc->block_start);
+	unsigned from = 0;
+	for (unsigned c = 0; c < nchunks; c++) {
+		if (!st->cut[c] && c != nchunks - 1)
+			continue;
+		write_block(enc, st->seq_at[from], st->seq_at[c + 1],
+			    st->byte_at[from], st->byte_at[c + 1],
+			    final && c == nchunks - 1);
+		from = c + 1;
+	}
+
+done:
+	enc->nseqs = 0;
+	enc->block_start = enc->seq_pos;
+}
+
+static inline void emit_literal(DeflateEncoder *enc, uint8_t lit)
+{
+	enc->seqs[enc->nseqs++] = (struct seq){ 0, lit };
+	enc->seq_pos++;
+}
+
+static inline void emit_match(DeflateEncoder *enc, unsigned len,
+			      unsigned dist)
+{
+	enc->seqs[enc->nseqs++] = (struct seq){ dist, len };
+	enc->seq_pos += len;
+}
+
+/*
+ * Table entries are 32-bit offsets from base: slide them before the distance
+ * to the current position can overflow.
+ */
+static void rebase_tables(DeflateEncoder *enc, size_t pos)
+{
+	if (pos - enc->base < REBASE_LIMIT)
+		return;
+
+	uint32_t delta = pos - enc->base - WSIZE;
+	for (size_t i = 0; i < HASH_SIZE; i++)
+		enc->head[i] = enc->head[i] > delta ? enc->head[i] - delta : 0;
+	for (size_t i = 0; i < WSIZE; i++)
+		enc->prev[i] = enc->prev[i] > delta ? enc->prev[i] - delta : 0;
+	enc->base += delta;
+}
+
+/* Keeps room for the next sequences, emitting a block when full */
+static inline void reserve_seqs(DeflateEncoder *enc)
+{
+	if (enc->nseqs + 2 <= enc->seq_cap)
+		return;
+
+	flush_block(enc, false);
+	rebase_tables(enc, enc->seq_pos);
+}
+
+static void parse_fast(DeflateEncoder *enc, size_t p, size_t end)
+{
+	const uint8_t *in = enc->in;
+	size_t limit = end - p >= 4 ? end - 3 : p;
+	bool insert_all = enc->level >= 2;
+	unsigned misses = 0;
+
+	while (p < limit) {
+		reserve_seqs(enc);
+
+		uint32_t h = hash4(in + p);
+		size_t cand = enc->base + enc->head[h];
+		enc->head[h] = p - enc->base;
+
+		if (cand >= p || cand < enc->window_start ||
+		    p - cand > WSIZE || load_u32(in + cand) != load_u32(in + p)) {
+			/* Skip faster through data that does not match */
+			unsigned step = insert_all ? 1 : 1 + (misses++ >> 5);
+			while (step-- > 0 && p < limit &&
+			       enc->nseqs < enc->seq_cap)
+				emit_literal(enc, in[p++]);
+			continue;
+		}
+
+		size_t max = end - p < DEFLATE_MAX_MATCH ? end - p :
+							   DEFLATE_MAX_MATCH;
+		unsigned len = 4 + match_len(in + cand + 4, in + p + 4, max - 4);
+		emit_match(enc, len, p - cand);
+		misses = 0;
+
+		size_t next = p + len;
+		for (p = insert_all ? p + 1 : next - 1; p < next && p < limit;
+		     p++)
+			enc->head[hash4(in + p)] = p - enc->base;
+		p = next;
+	}
+
+	while (p < end) {
+		reserve_seqs(enc);
+		emit_literal(enc, in[p++]);
+	}
+}
+
+static inline size_t insert_hash(DeflateEncoder *enc, size_t p)
+{
+	uint32_t h = hash3(enc->in + p);
+	size_t cand = enc->base + enc->head[h];
+
+	enc->prev[p & WMASK] = enc->head[h];
+	enc->head[h] = p - enc->base;
+
+	return cand;
+}
+
+/* Longest match at p from the hash chain starting at cand, if > prev_len */
+static unsigned longest_match(DeflateEncoder *enc, size_t p, size_t end,
+			      size_t cand, unsigned prev_len, unsigned *dist)
+{
+	const struct level_params *params = enc->params;
+	const uint8_t *in = enc->in;
+	unsigned max = end - p < DEFLATE_MAX_MATCH ? end - p :
+						     DEFLATE_MAX_MATCH;
+	unsigned nice = params->nice_len < max ? params->nice_len : max;
+	unsigned chain = params->max_chain;
+	unsigned best = prev_len > 2 ? prev_len : 2;
+	unsigned found = 0;
+
+	if (best >= max)
+		return 0;
+	if (prev_len >= params->good_len)
+		chain >>= 2;
+
+	while (chain-- > 0) {
+		if (cand >= p || cand < enc->window_start || p - cand > WSIZE)
+			break;
+
+		if (in[cand + best] == in[p + best] && in[cand] == in[p] &&
+		    in[cand + 1] == in[p + 1]) {
+			unsigned len = match_len(in + cand, in + p, max);
+			if (len > best) {
+				best = len;
+				found = len;
+				*dist = p - cand;
+				if (len >= nice)
+					break;
+			}
+		}
+
+		size_t next = enc->base + enc->prev[cand & WMASK];
+		if (next >= cand)
+			break;
+		cand = next;
+	}
+
+	return found;
+}
+
+static void parse_greedy(DeflateEncoder *enc, size_t p, size_t end)
+{
+	const uint8_t *in = enc->in;
+	size_t limit = end - p >= 3 ? end - 2 : p;
+
+	while (p < limit) {
+		reserve_seqs(enc);
+
+		unsigned dist = 0;
+		size_t cand = insert_hash(enc, p);
+		unsigned len = longest_match(enc, p, end, cand, 0, &dist);
+		if (len == 3 && dist > TOO_FAR)
+			len = 0;
+
+		if (len < DEFLATE_MIN_MATCH) {
+			emit_literal(enc, in[p++]);
+			continue;
+		}
+
+		emit_match(enc, len, dist);
+		size_t next = p + len;
+		for (p++; p < next && p < limit; p++)
+			insert_hash(enc, p);
+		p = next;
+	}
+
+	while (p < end) {
+		reserve_seqs(enc);
+		emit_literal(enc, in[p++]);
+	}
+}
+
+static void parse_lazy(DeflateEncoder *enc, size_t p, size_t end)
+{
+	const uint8_t *in = enc->in;
+	size_t limit = end - p >= 3 ? end - 2 : p;
+	unsigned prev_len = 0, prev_dist = 0;
+	bool pending = false;
+
+	while (p < limit) {
+		reserve_seqs(enc);
+
+		unsigned len = 0, dist = 0;
+		size_t cand = insert_hash(enc, p);
+		if (prev_len < enc->params->max_lazy)
+			len = longest_match(enc, p, end, cand, prev_len, &dist);
+		if (len == 3 && dist > TOO_FAR)
+			len = 0;
+
+		if (prev_len >= DEFLATE_MIN_MATCH && len <= prev_len) {
+			/* The match found at the previous position wins */
+			emit_match(enc, prev_len, prev_dist);
+			size_t next = p - 1 + prev_len;
+			for (p++; p < next && p < limit; p++)
+				insert_hash(enc, p);
+			p = next;
+			prev_len = 0;
+			pending = false;
+			continue;
+		}
+
+		if (pending)
+			emit_literal(enc, in[p - 1]);
+		pending = true;
+		prev_len = len;
+		prev_dist = dist;
+		p++;
+	}
+
+	if (pending) {
+		reserve_seqs(enc);
+		if (prev_len >= DEFLATE_MIN_MATCH) {
+			emit_match(enc, prev_len, prev_dist);
+			p = p - 1 + prev_len;
+		} else {
+			emit_literal(enc, in[p - 1]);
+		}
+	}
+
+	while (p < end) {
+		reserve_seqs(enc);
+		emit_literal(enc, in[p++]);
+	}
+}
+
+/*
+ * Records, for every position of [lo, hi), the matches of increasing length
+ * found on its hash chain. Positions covered by a maximal match only get
+ * that match, shortened, which keeps long runs from going quadratic.
+ */
+static bool find_segment_matches(DeflateEncoder *enc, size_t lo, size_t hi)
+{
+	struct optimal_state *opt = enc->opt;
+	const uint8_t *in = enc->in;
+	size_t nmatches = 0;
+	unsigned run_len = 0, run_dist = 0;
+
+	for (size_t p = lo; p < hi; p++) {
+		opt->match_at[p - lo] = nmatches;
+		if (enc->in_len - p < DEFLATE_MIN_MATCH)
+			continue;
+
+		if (opt->match_cap - nmatches < OPT_MAX_MATCHES) {
+			size_t cap = opt->match_cap * 2;
+			struct lz_match *m =
+				realloc(opt->matches, cap * sizeof(*m));
+			if (m == NULL)
+				return false;
+			opt->matches = m;
+			opt->match_cap = cap;
+		}
+
+		size_t cand = insert_hash(enc, p);
+		unsigned max = hi - p < DEFLATE_MAX_MATCH ? hi - p :
+							    DEFLATE_MAX_MATCH;
+
+		if (run_len > DEFLATE_MIN_MATCH) {
+			run_len--;
+			if (run_len > max)
+				run_len = max;
+			opt->matches[nmatches++] =
+				(struct lz_match){ run_len, run_dist };
+			continue;
+		}
+		run_len = 0;
+
+		unsigned best = 2;
+		unsigned found = 0;
+		for (unsigned chain = OPT_MAX_CHAIN; chain > 0; chain--) {
+			if (best >= max || cand >= p ||
+			    cand < enc->window_start || p - cand > WSIZE ||
+			    found == OPT_MAX_MATCHES)
+				break;
+
+			if (in[cand + best] == in[p + best]) {
+				unsigned len = match_len(in + cand, in + p, max);
+				if (len > best) {
+					best = len;
+					opt->matches[nmatches + found++] =
+						(struct lz_match){ len,
+								   p - cand };
+				}
+			}
+
+			size_t next = enc->base + enc->prev[cand & WMASK];
+			if (next >= cand)
+				break;
+			cand = next;
+		}
+		nmatches += found;
+
+		if (best == DEFLATE_MAX_MATCH) {
+			run_len = best;
+			run_dist = opt->matches[nmatches - 1].dist;
+		}
+	}
+	opt->match_at[hi - lo] = nmatches;
+
+	return true;
+}
+
+static void fixed_cost_model(struct cost_model *m)
+{
+	uint8_t litlen_len[LITLEN_SYMS];
+	uint8_t dist_len[DIST_SYMS];
+
+	fixed_lengths(litlen_len, dist_len);
+	for (unsigned s = 0; s < 256; s++)
+		m->lit[s] = litlen_len[s];
+	for (unsigned len = DEFLATE_MIN_MATCH; len <= DEFLATE_MAX_MATCH; len++) {
+		unsigned lc = len_code(len);
+		m->len[len] = litlen_len[257 + lc] + len_extra[lc];
+	}
+	for (unsigned dc = 0; dc < 30; dc++)
+		m->dist[dc] = dist_len[dc] + dist_extra[dc];
+}
+
+/* Costs of the Huffman codes f would be encoded with */
+static void update_cost_model(const struct freqs *f, struct cost_model *m)
+{
+	uint8_t litlen_len[LITLEN_SYMS];
+	uint8_t dist_len[DIST_SYMS];
+
+	build_code_lengths(f->litlen, 286, MAX_CODE_LEN, litlen_len);
+	build_code_lengths(f->dist, 30, MAX_CODE_LEN, dist_len);
+	for (unsigned s = 0; s < 286; s++) {
+		if (litlen_len[s] == 0)
+			litlen_len[s] = OPT_UNUSED_COST;
+	}
+	for (unsigned s = 0; s < 30; s++) {
+		if (dist_len[s] == 0)
+			dist_len[s] = OPT_UNUSED_COST;
+	}
+
+	for (unsigned s = 0; s < 256; s++)
+		m->lit[s] = litlen_len[s];
+	for (unsigned len = DEFLATE_MIN_MATCH; len <= DEFLATE_MAX_MATCH; len++) {
+		unsigned lc = len_code(len);
+		m->len[len] = litlen_len[257 + lc] + len_extra[lc];
+	}
+	for (unsigned dc = 0; dc < 30; dc++)
+		m->dist[dc] = dist_len[dc] + dist_extra[dc];
+}
+
+/*
+ * Shortest path over [lo, hi) under cost model m, using the matches found
+ * from seg_lo on. Leaves the sequences in opt->trial and returns their count.
+ */
+static size_t optimal_pass(DeflateEncoder *enc, size_t seg_lo, size_t lo,
+			   size_t hi, const struct cost_model *m)
+{
+	struct optimal_state *opt = enc->opt;
+	const uint8_t *in = enc->in;
+	uint32_t *cost = opt->cost;
+	struct seq *step = opt->step;
+	size_t n = hi - lo;
+
+	cost[0] = 0;
+	for (size_t k = 1; k <= n; k++)
+		cost[k] = UINT32_MAX;
+
+	for (size_t k = 0; k < n; k++) {
+		size_t p = lo + k;
+		uint32_t base = cost[k];
+
+		uint32_t lit = base + m->lit[in[p]];
+		if (lit < cost[k + 1]) {
+			cost[k + 1] = lit;
+			step[k + 1] = (struct seq){ 0, in[p] };
+		}
+
+		unsigned shortest = DEFLATE_MIN_MATCH;
+		for (uint32_t i = opt->match_at[p - seg_lo];
+		     i < opt->match_at[p - seg_lo + 1]; i++) {
+			unsigned dist = opt->matches[i].dist;
+			unsigned longest = opt->matches[i].len;
+			if (longest > n - k)
+				longest = n - k;
+
+			uint32_t with_dist = base + m->dist[dist_code(dist)];
+			for (unsigned len = shortest; len <= longest; len++) {
+				uint32_t c = with_dist + m->len[len];
+				if (c < cost[k + len]) {
+					cost[k + len] = c;
+					step[k + len] =
+						(struct seq){ dist, len };
+				}
+			}
+			if (longest + 1 > shortest)
+				shortest = longest + 1;
+		}
+	}
+
+	/* Walk the cheapest path back, then put it in input order */
+	size_t nseqs = 0;
+	for (size_t k = n; k > 0;) {
+		struct seq s = step[k];
+		opt->trial[nseqs++] = s;
+		k -= s.dist ? s.litlen : 1;
+	}
+	for (size_t i = 0; i < nseqs / 2; i++) {
+		struct seq t = opt->trial[i];
+		opt->trial[i] = opt->trial[nseqs - 1 - i];
+		opt->trial[nseqs - 1 - i] = t;
+	}
+
+	return nseqs;
+}
+
+/*
+ * Iterates parse and cost model over [lo, hi), starting from the parse in
+ * start when given or from the fixed code otherwise, and leaves the
+ * cheapest parse seen in enc->seqs.
+ */
+static void optimize_range(DeflateEncoder *enc, size_t seg_lo, size_t lo,
+			   size_t hi, const struct seq *start, size_t nstart,
+			   unsigned iterations)
+{
+	struct optimal_state *opt = enc->opt;
+	struct cost_model model;
+	uint64_t best = UINT64_MAX;
+	int type;
+
+	fixed_cost_model(&model);
+	if (start != NULL) {
+		struct freqs f = { 0 };
+		count_freqs(start, 0, nstart, &f);
+		f.litlen[END_OF_BLOCK] = 1;
+		best = block_cost(&f, hi - lo, &type);
+		memcpy(enc->seqs, start, nstart * sizeof(*enc->seqs));
+		enc->nseqs = nstart;
+		update_cost_model(&f, &model);
+	}
+
+	for (unsigned it = 0; it < iterations; it++) {
+		struct freqs f = { 0 };
+
+		size_t nseqs = optimal_pass(enc, seg_lo, lo, hi, &model);
+		count_freqs(opt->trial, 0, nseqs, &f);
+		f.litlen[END_OF_BLOCK] = 1;
+
+		uint64_t cost = block_cost(&f, hi - lo, &type);
+		if (cost < best) {
+			best = cost;
+			memcpy(enc->seqs, opt->trial, nseqs * sizeof(*enc->seqs));
+			enc->nseqs = nseqs;
+		} else if (cost == best) {
+			break;
+		}
+
+		update_cost_model(&f, &model);
+	}
+
+	enc->block_start = lo;
+	enc->seq_pos = hi;
+}
+
+static bool compress_optimal(DeflateEncoder *enc, size_t start, size_t end,
+			     bool final)
+{
+	struct optimal_state *opt = enc->opt;
+	struct split_state *st = &enc->split;
+
+	if (start == end) {
+		flush_block(enc, final);
+		return true;
+	}
+
+	for (size_t lo = start; lo < end;) {
+		size_t hi = end - lo < OPT_SEGMENT ? end : lo + OPT_SEGMENT;
+		bool last = final && hi == end;
+
+		rebase_tables(enc, lo);
+		if (!find_segment_matches(enc, lo, hi))
+			return false;
+
+		optimize_range(enc, lo, lo, hi, NULL, 0, OPT_ITERATIONS);
+		memcpy(opt->best, enc->seqs, enc->nseqs * sizeof(*opt->best));
+		opt->nbest = enc->nseqs;
+
+		/* Each block gets its own codes: re-optimize it alone */
+		unsigned nchunks = plan_splits(enc, opt->best, opt->nbest, lo);
+		unsigned from = 0;
+		for (unsigned c = 0; c < nchunks; c++) {
+			if (!st->cut[c] && c != nchunks - 1)
+				continue;
+
+			optimize_range(enc, lo, st->byte_at[from],
+				       st->byte_at[c + 1],
+				       opt->best + st->seq_at[from],
+				       st->seq_at[c + 1] - st->seq_at[from],
+				       OPT_BLOCK_ITERATIONS);
+			write_block(enc, 0, enc->nseqs, enc->block_start,
+				    enc->seq_pos, last && c == nchunks - 1);
+			from = c + 1;
+		}
+		enc->nseqs = 0;
+		lo = hi;
+	}
+
+	return true;
+}
+
+/* Encodes [start, end) as one or more complete blocks */
+static bool compress_range(DeflateEncoder *enc, size_t start, size_t end,
+			   bool final)
+{
+	switch (enc->params->strategy) {
+	case STRAT_FAST:
+		parse_fast(enc, start, end);
+		break;
+	case STRAT_GREEDY:
+		parse_greedy(enc, start, end);
+		break;
+	case STRAT_LAZY:
+		parse_lazy(enc, start, end);
+		break;
+	case STRAT_OPTIMAL:
+		return compress_optimal(enc, start, end, final);
+	}
+	flush_block(enc, final);
+
+	return true;
+}
+
+/*
+ * Next content-defined reset point at least RSYNC_MIN_CHUNK bytes past
+ * from. A gear hash shifts one bit per byte, so its top RSYNC_BITS bits
+ * depend only on the last 64 bytes: a point falls where they are all zero.
+ * The hash rolls over the whole input, skipped bytes included.
+ */
+static size_t next_rsync_boundary(DeflateEncoder *enc, size_t from)
+{
+	const uint8_t *in = enc->in;
+
+	while (enc->rsync_pos < enc->in_len) {
+		size_t p = enc->rsync_pos++;
+
+		enc->rsync_hash = (enc->rsync_hash << 1) +
+				  (in[p] + 1) * 0x9E3779B97F4A7C15ull;
+		if (p + 1 - from >= RSYNC_MIN_CHUNK &&
+		    (enc->rsync_hash >> (64 - RSYNC_BITS)) == 0)
+			return p + 1;
+	}
+
+	return enc->in_len;
+}
+
+static void free_optimal_state(struct optimal_state *opt)
+{
+	if (opt == NULL)
+		return;
+
+	free(opt->match_at);
+	free(opt->matches);
+	free(opt->cost);
+	free(opt->step);
+	free(opt->trial);
+	free(opt->best);
+	free(opt);
+}
+
+static struct optimal_state *new_optimal_state(void)
+{
+	struct optimal_state *opt = calloc(1, sizeof(*opt));
+	if (opt == NULL)
+		return NULL;
+
+	opt->match_cap = 4 * (size_t)OPT_SEGMENT;
+	opt->match_at = malloc((OPT_SEGMENT + 1) * sizeof(*opt->match_at));
+	opt->matches = malloc(opt->match_cap * sizeof(*opt->matches));
+	opt->cost = malloc((OPT_SEGMENT + 1) * sizeof(*opt->cost));
+	opt->step = malloc((OPT_SEGMENT + 1) * sizeof(*opt->step));
+	opt->trial = malloc(OPT_SEGMENT * sizeof(*opt->trial));
+	opt->best = malloc(OPT_SEGMENT * sizeof(*opt->best));
+	if (opt->match_at == NULL || opt->matches == NULL ||
+	    opt->cost == NULL || opt->step == NULL || opt->trial == NULL ||
+	    opt->best == NULL) {
+		free_optimal_state(opt);
+		return NULL;
+	}
+
+	return opt;
+}
+
+DeflateEncoder *deflate_encoder_new(int level)
+{
+	if (level < DEFLATE_LEVEL_STORE || level > DEFLATE_LEVEL_OPTIMAL)
+		return NULL;
+
+	DeflateEncoder *enc = calloc(1, sizeof(*enc));
+	if (enc == NULL)
+		return NULL;
+
+	enc->level = level;
+	enc->params = &level_table[level];
+	enc->seq_cap = level == DEFLATE_LEVEL_OPTIMAL ? OPT_SEGMENT : SEQ_CAP;
+
+	size_t nchunks = enc->seq_cap / SPLIT_CHUNK;
+	enc->split.sum = malloc((nchunks + 1) * sizeof(*enc->split.sum));
+	enc->split.seq_at = malloc((nchunks + 1) * sizeof(*enc->split.seq_at));
+	enc->split.byte_at =
+		malloc((nchunks + 1) * sizeof(*enc->split.byte_at));
+	enc->split.cut = malloc(nchunks * sizeof(*enc->split.cut));
+	enc->seqs = malloc(enc->seq_cap * sizeof(*enc->seqs));
+	enc->head = malloc(HASH_SIZE * sizeof(*enc->head));
+	enc->prev = malloc(WSIZE * sizeof(*enc->prev));
+	if (level == DEFLATE_LEVEL_OPTIMAL)
+		enc->opt = new_optimal_state();
+
+	if (enc->split.sum == NULL || enc->split.seq_at == NULL ||
+	    enc->split.byte_at == NULL || enc->split.cut == NULL ||
+	    enc->seqs == NULL || enc->head == NULL || enc->prev == NULL ||
+	    (level == DEFLATE_LEVEL_OPTIMAL && enc->opt == NULL)) {
+		deflate_encoder_free(enc);
+		return NULL;
+	}
+
+	return enc;
+}
+
+void deflate_encoder_free(DeflateEncoder *enc)
+{
+	if (enc == NULL)
+		return;
+
+	free_optimal_state(enc->opt);
+	free(enc->split.sum);
+	free(enc->split.seq_at);
+	free(enc->split.byte_at);
+	free(enc->split.cut);
+	free(enc->seqs);
+	free(enc->head);
+	free(enc->prev);
+	free(enc);
+}
+
+void deflate_set_rsyncable(DeflateEncoder *enc, bool rsyncable)
+{
+	if (enc != NULL)
+		enc->rsyncable = rsyncable;
+}
+
+size_t deflate_bound(size_t in_len)
+{
+	/* Every block is at least MIN_BLOCK_LEN bytes or the last one, and
+	 * never costs more than storing it. Rsyncable resets add 5 bytes at
+	 * most every RSYNC_MIN_CHUNK. */
+	return in_len + (in_len >> 6) + 64;
+}
+
+size_t deflate_compress(DeflateEncoder *enc, const void *in, size_t in_len,
+			void *out, size_t out_cap)
+{
+	if (enc == NULL || (in == NULL && in_len > 0) || out == NULL)
+		return 0;
+
+	enc->in = in;
+	enc->in_len = in_len;
+	enc->base = 0;
+	enc->window_start = 0;
+	enc->block_start = 0;
+	enc->seq_pos = 0;
+	enc->nseqs = 0;
+	enc->bw = (struct bitwriter){ out, out, (uint8_t *)out + out_cap,
+				      0, 0, false };
+	memset(enc->head, 0, HASH_SIZE * sizeof(*enc->head));
+	memset(enc->prev, 0, WSIZE * sizeof(*enc->prev));
+
+	enc->rsync_pos = 0;
+	enc->rsync_hash = 0;
+
+	if (enc->level == DEFLATE_LEVEL_STORE) {
+		write_stored(&enc->bw, enc->in, in_len, true);
+		goto done;
+	}
+
+	if (!enc->rsyncable) {
+		if (!compress_range(enc, 0, in_len, true))
+			return 0;
+		goto done;
+	}
+
+	/*
+	 * At each boundary: end the block, byte-align with an empty stored
+	 * block and forget the window, so the output that follows depends only
+	 * on the input that follows.
+	 */
+	size_t start = 0;
+	do {
+		size_t end = next_rsync_boundary(enc, start);
+		if (!compress_range(enc, start, end, end == in_len))
+			return 0;
+		if (end < in_len)
+			write_stored(&enc->bw, enc->in + end, 0, false);
+		enc->window_start = end;
+		start = end;
+	} while (start < in_len);
+
+done:
+	flush_bits(&enc->bw);
+	if (enc->bw.overflow)
+		return 0;
+
+	return enc->bw.next - enc->bw.start;
+}
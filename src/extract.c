@@ -0,0 +1,1608 @@
+/*
+ * extract.c -- Archive Extraction
+ * Copyright (C) 2025 Jacopo Costantini
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include "extract.h"
+#include "crc32.h"
+#include "inflate.h"
+#include "journal.h"
+#include "pool.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <linux/fs.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define READ_BLOCK (4 << 20) /* bytes per sequential archive read */
+#define CHUNK_SIZE (1 << 20) /* streamed entries reach the decoders in these */
+#define CHUNKS_AHEAD 4 /* chunks queued per streamed entry */
+#define PIECE_SPAN (INFLATE_CHUNK - INFLATE_HISTORY - INFLATE_SLACK)
+#define TASKS_PER_JOB 2 /* entries queued for decoding, per decode thread */
+#define PIECES_PER_JOB 4 /* decoded pieces queued for the writer, likewise */
+#define DEFAULT_MEMORY (256 << 20)
+#define MIN_MEMORY (4 * CHUNK_SIZE) /* admitted beyond the fixed costs */
+#define ONESHOT_MAX (1 << 20) /* bigger buffers fault in more than they save */
+#define BATCH_ENTRIES 64 /* small entries handed over together */
+#define PARALLEL_MIN (64 << 20) /* deflated entries all jobs decode at once */
+#define PARALLEL_CHUNK_MIN (64 << 10)
+#define PARALLEL_CHUNK_MAX (4 << 20)
+#define SPARSE_BLOCK 4096 /* aligned blocks of zeros left as holes */
+#define PREALLOC_MIN (1 << 20) /* smaller outputs get no reservation */
+#define DEFLATE_MAX_RATIO 1032 /* 258 bytes out per 2 bits in, at best */
+#define DEDUPE_MIN (64 << 10) /* smaller duplicates decode as fast */
+
+enum entry_status {
+	STATUS_OK,
+	STATUS_BAD_CRC,
+	STATUS_BAD_DATA,
+	STATUS_ENCRYPTED,
+	STATUS_UNSUPPORTED,
+};
+
+/* Bounded FIFO of pointers; push blocks while full, pop while empty */
+struct queue {
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	void **items;
+	size_t cap;
+	size_t head;
+	size_t count;
+	bool closed; /* no more pushes: pop returns NULL once drained */
+};
+
+struct extract_entry {
+	ZipEntry entry;
+	const char *name;
+	uint64_t index; /* in the central directory */
+	bool skip; /* refused at collection, or parallel, never queued */
+	bool parallel; /* decoded once the pipeline is done */
+	struct extract_entry *copy_of; /* holds the same data, decoded */
+
+	/* Writer side */
+	enum entry_status status;
+	const char *verb; /* for -v, when not decoded */
+	bool opened;
+	bool failed;
+	bool prealloc; /* blocks were reserved for the declared size */
+	int fd;
+	uint64_t pos; /* output bytes so far, written or skipped */
+	uint64_t zeros; /* skipped from here up to pos, nothing in between */
+};
+
+/*
+ * Bytes admitted into the pipeline. Every charged buffer carries its
+ * charge and returns it when freed, wherever that happens. Only the
+ * reader waits, so nothing holding memory ever waits on it.
+ */
+struct budget {
+	pthread_mutex_t lock;
+	pthread_cond_t freed;
+	uint64_t limit;
+	uint64_t used;
+};
+
+/* A small entry of a batch, decoded in one shot */
+struct batch_item {
+	struct extract_entry *e;
+	bool bad; /* local header or data could not be read */
+	size_t in_off;
+	size_t in_len;
+	const unsigned char *out;
+	size_t out_len;
+	enum entry_status status;
+};
+
+/*
+ * Work for a decode thread: a large entry streaming in chunks, or a batch
+ * of small neighbours read whole, whose charge covers their declared
+ * output as well. A decoded batch goes on to the writer in one piece.
+ */
+struct task {
+	struct extract_entry *e; /* the streamed entry, NULL for a batch */
+	bool bad;
+	bool chunked;
+	struct queue chunks;
+	unsigned char *data;
+	unsigned char *out;
+	uint64_t charge;
+	size_t count;
+	struct batch_item items[];
+};
+
+struct chunk {
+	unsigned char *data;
+	size_t len; /* also its charge */
+};
+
+/* Decoded bytes for the writer; the last one carries the verdict */
+struct piece {
+	struct task *batch; /* a whole decoded batch instead */
+	struct extract_entry *e;
+	unsigned char *data;
+	const unsigned char *start; /* where the bytes begin in data */
+	size_t len;
+	uint64_t charge; /* 0 for streamed output, covered up front */
+	bool last;
+	enum entry_status status;
+};
+
+struct extraction {
+	int archive_fd;
+	int dir_fd;
+	bool verbose;
+	bool hardlinks; /* duplicates that look alike may share an inode */
+
+	struct extract_entry *entries; /* sorted by local header offset */
+	size_t count;
+	char *names;
+
+	/* Reader side */
+	unsigned char *block;
+	uint64_t block_pos;
+	size_t block_len;
+	int8_t read_err;
+
+	struct queue tasks;
+	struct queue pieces;
+	BufferPool **pools; /* the reader's, then one per decode thread */
+	unsigned pool_count;
+	unsigned next_pool;
+	unsigned workers; /* decode threads left, the last closes pieces */
+	struct budget budget;
+	uint64_t oneshot_max; /* largest charge decoded in one shot */
+
+	/* Writer side */
+	char *made_dir; /* last directory known to exist */
+	char *path;
+	uint32_t stamp_hour; /* DOS date and hour, plus one, of stamp_base */
+	time_t stamp_base;
+	uint64_t failed;
+	uint64_t sparse; /* zero bytes skipped rather than written */
+	ResumeJournal *journal;
+	uint64_t resumed; /* journaled entries found in place */
+};
+
+/* Output side of a parallel decode */
+struct parallel_ctx {
+	struct extraction *x;
+	struct extract_entry *e;
+	uint32_t crc;
+	uint64_t size;
+};
+
+/* Decode state of the task a worker is on */
+struct decode_ctx {
+	struct extraction *x;
+	struct task *t;
+	BufferPool *pool;
+	struct chunk *chunk; /* handed to the decoder, freed on the next read */
+	unsigned char *out; /* being decoded into, a piece once written */
+	bool write_failed;
+	uint32_t crc;
+	uint64_t size;
+};
+
+static int8_t queue_init(struct queue *q, BufferPool *pool, size_t cap)
+{
+	q->items = pool_get(pool, cap * sizeof(*q->items));
+	if (q->items == NULL)
+		return -1;
+
+	q->cap = cap;
+	q->head = 0;
+	q->count = 0;
+	q->closed = false;
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->not_empty, NULL);
+	pthread_cond_init(&q->not_full, NULL);
+
+	return 0;
+}
+
+static void queue_destroy(struct queue *q)
+{
+	pthread_mutex_destroy(&q->lock);
+	pthread_cond_destroy(&q->not_empty);
+	pthread_cond_destroy(&q->not_full);
+	pool_put(q->items);
+}
+
+static void queue_push(struct queue *q, void *item)
+{
+	pthread_mutex_lock(&q->lock);
+	while (q->count == q->cap)
+		pthread_cond_wait(&q->not_full, &q->lock);
+	q->items[(q->head + q->count) % q->cap] = item;
+	q->count++;
+	pthread_cond_signal(&q->not_empty);
+	pthread_mutex_unlock(&q->lock);
+}
+
+static void *queue_pop(struct queue *q)
+{
+	void *item = NULL;
+
+	pthread_mutex_lock(&q->lock);
+	while (q->count == 0 && !q->closed)
+		pthread_cond_wait(&q->not_empty, &q->lock);
+	if (q->count > 0) {
+		item = q->items[q->head];
+		q->head = (q->head + 1) % q->cap;
+		q->count--;
+		pthread_cond_signal(&q->not_full);
+	}
+	pthread_mutex_unlock(&q->lock);
+
+	return item;
+}
+
+static void queue_close(struct queue *q)
+{
+	pthread_mutex_lock(&q->lock);
+	q->closed = true;
+	pthread_cond_broadcast(&q->not_empty);
+	pthread_mutex_unlock(&q->lock);
+}
+
+/* Waits until bytes fit, or nothing else is admitted */
+static void budget_acquire(struct budget *b, uint64_t bytes)
+{
+	pthread_mutex_lock(&b->lock);
+	while (b->used > 0 && b->used + bytes > b->limit)
+		pthread_cond_wait(&b->freed, &b->lock);
+	b->used += bytes;
+	pthread_mutex_unlock(&b->lock);
+}
+
+static void budget_release(struct budget *b, uint64_t bytes)
+{
+	if (bytes == 0)
+		return;
+
+	pthread_mutex_lock(&b->lock);
+	b->used -= bytes;
+	pthread_cond_signal(&b->freed);
+	pthread_mutex_unlock(&b->lock);
+}
+
+/*
+ * Decoders, the read block and streamed output pieces cost the same
+ * whatever the archive holds, so they come off the top. What is left is
+ * admitted to compressed data and one-shot outputs, and an entry may
+ * go one-shot while jobs of its size still fit twice over.
+ */
+static void budget_init(struct extraction *x, uint64_t memory, unsigned jobs)
+{
+	uint64_t per_job = inflate_decoder_size() +
+			   (PIECES_PER_JOB + 1) * (uint64_t)INFLATE_CHUNK;
+	uint64_t fixed = READ_BLOCK + jobs * per_job;
+
+	if (memory == 0)
+		memory = DEFAULT_MEMORY;
+	x->budget.limit = memory > fixed + MIN_MEMORY ? memory - fixed :
+							  MIN_MEMORY;
+	x->oneshot_max = x->budget.limit / (2 * (uint64_t)jobs);
+	if (x->oneshot_max > ONESHOT_MAX)
+		x->oneshot_max = ONESHOT_MAX;
+}
+
+static void free_chunk(struct extraction *x, struct chunk *c)
+{
+	budget_release(&x->budget, pool_class_size(c->len));
+	pool_put(c->data);
+	pool_put(c);
+}
+
+static void free_task(struct extraction *x, struct task *t)
+{
+	budget_release(&x->budget, t->charge);
+	pool_put(t->data);
+	pool_put(t->out);
+	pool_put(t);
+}
+
+/* Copies len archive bytes at offset through the sequential block */
+static int8_t read_range(struct extraction *x, uint64_t offset, void *dst,
+			 size_t len)
+{
+	unsigned char *out = dst;
+
+	while (len > 0) {
+		if (offset < x->block_pos ||
+		    offset >= x->block_pos + x->block_len) {
+			ssize_t n;
+
+			do {
+				n = pread(x->archive_fd, x->block, READ_BLOCK,
+					  offset);
+			} while (n < 0 && errno == EINTR);
+			if (n < 0) {
+				perror("PREAD");
+				x->read_err = -1;
+				return -1;
+			}
+			x->block_pos = offset;
+			x->block_len = n;
+			if (n == 0)
+				return -2;
+		}
+
+		size_t avail = x->block_pos + x->block_len - offset;
+		if (avail > len)
+			avail = len;
+		memcpy(out, x->block + (offset - x->block_pos), avail);
+		out += avail;
+		offset += avail;
+		len -= avail;
+	}
+
+	return 0;
+}
+
+/* Finds where the data of e starts, past its local header */
+static int8_t locate_data(struct extraction *x, const struct extract_entry *e,
+			  uint64_t *pos)
+{
+	unsigned char lfh[LFH_FIXED_SIZE];
+
+	*pos = e->entry.local_header_offset;
+	if (read_range(x, *pos, lfh, sizeof(lfh)) != 0 ||
+	    read_u32(lfh, 0) != LFH_SIGNATURE)
+		return -2;
+	*pos += LFH_FIXED_SIZE + read_u16(lfh, 26) + read_u16(lfh, 28);
+
+	return 0;
+}
+
+/*
+ * Gathers the small entries from i on into one batch, as many as fit the
+ * one-shot limit together, and returns how many entries it went past, 0
+ * when entry i must stream. Declared sizes decide; a lie only makes
+ * decoding fail.
+ */
+static size_t read_batch(struct extraction *x, size_t i)
+{
+	size_t end = i, count = 0;
+	uint64_t in = 0, out = 0, cost = 0;
+
+	for (; end < x->count && count < BATCH_ENTRIES; end++) {
+		const ZipEntry *entry = &x->entries[end].entry;
+
+		if (x->entries[end].skip)
+			continue;
+		if (entry->comp_size > x->oneshot_max ||
+		    entry->uncomp_size > x->oneshot_max)
+			break;
+
+		uint64_t next_out = out;
+		if (entry->comp_method == ZIP_METHOD_DEFLATE)
+			next_out += entry->uncomp_size;
+		uint64_t next_cost = pool_class_size(in + entry->comp_size);
+		if (next_out > 0)
+			next_cost += pool_class_size(next_out + INFLATE_SLACK);
+		if (next_cost > x->oneshot_max)
+			break;
+		in += entry->comp_size;
+		out = next_out;
+		cost = next_cost;
+		count++;
+	}
+	if (count == 0)
+		return 0;
+
+	BufferPool *pool = x->pools[0];
+	struct task *t = pool_get(pool, sizeof(*t) + count * sizeof(*t->items));
+	if (t == NULL) {
+		perror("MALLOC");
+		x->read_err = -1;
+		return end - i;
+	}
+	memset(t, 0, sizeof(*t));
+	t->count = count;
+	budget_acquire(&x->budget, cost);
+	t->charge = cost;
+	t->data = pool_get(pool, in);
+
+	size_t off = 0, k = 0;
+	for (size_t j = i; j < end; j++) {
+		struct extract_entry *e = &x->entries[j];
+		struct batch_item *item = &t->items[k];
+		uint64_t pos;
+
+		if (e->skip)
+			continue;
+		k++;
+		*item = (struct batch_item){ .e = e, .in_off = off };
+		if (t->data == NULL || locate_data(x, e, &pos) != 0 ||
+		    read_range(x, pos, t->data + off, e->entry.comp_size) !=
+			    0) {
+			item->bad = true;
+			continue;
+		}
+		item->in_len = e->entry.comp_size;
+		off += item->in_len;
+	}
+	queue_push(&x->tasks, t);
+
+	return end - i;
+}
+
+/* Queues one large entry, then feeds it chunk by chunk */
+static void read_entry(struct extraction *x, struct extract_entry *e)
+{
+	BufferPool *pool = x->pools[0];
+	struct task *t = pool_get(pool, sizeof(*t));
+	uint64_t pos;
+
+	if (t == NULL) {
+		perror("MALLOC");
+		x->read_err = -1;
+		return;
+	}
+	memset(t, 0, sizeof(*t));
+	t->e = e;
+
+	if (locate_data(x, e, &pos) != 0 ||
+	    queue_init(&t->chunks, pool, CHUNKS_AHEAD) != 0) {
+		t->bad = true;
+		queue_push(&x->tasks, t);
+		return;
+	}
+	t->chunked = true;
+	queue_push(&x->tasks, t);
+
+	/* A short feed shows up to the decoder as truncated data */
+	uint64_t left = e->entry.comp_size;
+	while (left > 0 && x->read_err == 0) {
+		struct chunk *c = pool_get(pool, sizeof(*c));
+		size_t len = left < CHUNK_SIZE ? left : CHUNK_SIZE;
+
+		if (c == NULL)
+			break;
+		budget_acquire(&x->budget, pool_class_size(len));
+		c->len = len;
+		c->data = pool_get(pool, len);
+		if (c->data == NULL || read_range(x, pos, c->data, len) != 0) {
+			free_chunk(x, c);
+			break;
+		}
+		queue_push(&t->chunks, c);
+		pos += len;
+		left -= len;
+	}
+	queue_close(&t->chunks);
+}
+
+static void *reader_thread(void *arg)
+{
+	struct extraction *x = arg;
+	size_t i = 0;
+
+	while (i < x->count && x->read_err == 0) {
+		size_t n = 1;
+
+		if (!x->entries[i].skip && (n = read_batch(x, i)) == 0) {
+			read_entry(x, &x->entries[i]);
+			n = 1;
+		}
+		i += n;
+	}
+	queue_close(&x->tasks);
+
+	return NULL;
+}
+
+static void push_piece(struct decode_ctx *c, unsigned char *data,
+		       const unsigned char *start, size_t len, uint64_t charge,
+		       bool last, enum entry_status status)
+{
+	struct extraction *x = c->x;
+	struct piece *p = pool_get(c->pool, sizeof(*p));
+
+	if (p == NULL) {
+		/* The writer never hears of it: report and drop the entry */
+		perror("MALLOC");
+		budget_release(&x->budget, charge);
+		pool_put(data);
+		return;
+	}
+	p->batch = NULL;
+	p->e = c->t->e;
+	p->data = data;
+	p->start = start;
+	p->len = len;
+	p->charge = charge;
+	p->last = last;
+	p->status = status;
+	queue_push(&x->pieces, p);
+}
+
+static size_t task_read(void *ctx, const unsigned char **buf)
+{
+	struct decode_ctx *c = ctx;
+
+	if (c->chunk != NULL)
+		free_chunk(c->x, c->chunk);
+	c->chunk = queue_pop(&c->t->chunks);
+	if (c->chunk == NULL)
+		return 0;
+	*buf = c->chunk->data;
+
+	return c->chunk->len;
+}
+
+/* Output is decoded straight into the pieces the writer gets */
+static unsigned char *task_next(void *ctx)
+{
+	struct decode_ctx *c = ctx;
+
+	c->out = pool_get(c->pool, INFLATE_CHUNK);
+	if (c->out == NULL)
+		c->write_failed = true;
+
+	return c->out;
+}
+
+static int8_t task_write(void *ctx, const unsigned char *buf, size_t len)
+{
+	struct decode_ctx *c = ctx;
+
+	c->size += len;
+	push_piece(c, c->out, buf, len, 0, false, STATUS_OK);
+	c->out = NULL;
+
+	return 0;
+}
+
+/* Stored chunks go to the writer as they are, charges and all */
+static void pass_stored(struct decode_ctx *c)
+{
+	struct chunk *chunk;
+
+	while ((chunk = queue_pop(&c->t->chunks)) != NULL) {
+		c->crc = crc32_update(c->crc, chunk->data, chunk->len);
+		c->size += chunk->len;
+		push_piece(c, chunk->data, chunk->data, chunk->len,
+			   pool_class_size(chunk->len), false, STATUS_OK);
+		pool_put(chunk);
+	}
+}
+
+static enum entry_status decode_task(struct decode_ctx *c,
+				     InflateDecoder *dec)
+{
+	const ZipEntry *entry = &c->t->e->entry;
+
+	if (c->t->bad)
+		return STATUS_BAD_DATA;
+	if (entry->bit_flag & ZIP_FLAG_ENCRYPTED)
+		return STATUS_ENCRYPTED;
+
+	if (entry->comp_method == ZIP_METHOD_STORE) {
+		pass_stored(c);
+	} else if (entry->comp_method == ZIP_METHOD_DEFLATE) {
+		int8_t err = inflate_decode_into(dec, task_read, task_next,
+						 PIECE_SPAN, task_write, c);
+
+		/* Still here when decoding stopped short of writing it */
+		pool_put(c->out);
+		c->out = NULL;
+		if (err != 0)
+			return STATUS_BAD_DATA;
+		c->crc = inflate_crc(dec);
+	} else {
+		return STATUS_UNSUPPORTED;
+	}
+
+	if (c->size != entry->uncomp_size)
+		return STATUS_BAD_DATA;
+
+	return c->crc == entry->crc32 ? STATUS_OK : STATUS_BAD_CRC;
+}
+
+/*
+ * Decodes one entry of a batch at *out, which moves past its output. The
+ * slack decoding may scribble past the end is overwritten by the next.
+ * Stored entries are left where they are.
+ */
+static enum entry_status decode_item(struct decode_ctx *c,
+				     struct batch_item *item,
+				     InflateDecoder *dec, unsigned char **out)
+{
+	const ZipEntry *entry = &item->e->entry;
+	const unsigned char *data = c->t->data + item->in_off;
+	size_t len = item->in_len;
+
+	if (item->bad)
+		return STATUS_BAD_DATA;
+	if (entry->bit_flag & ZIP_FLAG_ENCRYPTED)
+		return STATUS_ENCRYPTED;
+	if (entry->comp_method != ZIP_METHOD_STORE &&
+	    entry->comp_method != ZIP_METHOD_DEFLATE)
+		return STATUS_UNSUPPORTED;
+
+	if (entry->comp_method == ZIP_METHOD_DEFLATE) {
+		if (dec == NULL || c->t->out == NULL) {
+			c->write_failed = true;
+			return STATUS_BAD_DATA;
+		}
+		if (inflate_decode_buffer(dec, data, len, *out,
+					  entry->uncomp_size, &len) != 0)
+			return STATUS_BAD_DATA;
+		data = *out;
+		*out += len;
+	}
+
+	item->out = data;
+	item->out_len = len;
+	if (len != entry->uncomp_size)
+		return STATUS_BAD_DATA;
+
+	uint32_t crc = entry->comp_method == ZIP_METHOD_DEFLATE ?
+			       inflate_crc(dec) :
+			       crc32_update(0, data, len);
+	return crc == entry->crc32 ? STATUS_OK : STATUS_BAD_CRC;
+}
+
+/* Decodes a batch into one buffer and hands it all to the writer */
+static void decode_batch(struct decode_ctx *c, InflateDecoder *dec)
+{
+	struct task *t = c->t;
+	size_t out_size = 0;
+
+	for (size_t k = 0; k < t->count; k++)
+		if (t->items[k].e->entry.comp_method == ZIP_METHOD_DEFLATE)
+			out_size += t->items[k].e->entry.uncomp_size;
+	t->out = pool_get(c->pool, out_size + INFLATE_SLACK);
+
+	unsigned char *out = t->out;
+	for (size_t k = 0; k < t->count; k++)
+		t->items[k].status = decode_item(c, &t->items[k], dec, &out);
+	if (c->write_failed)
+		perror("MALLOC");
+
+	struct piece *p = pool_get(c->pool, sizeof(*p));
+	if (p == NULL) {
+		/* As with single pieces, the writer never hears of these */
+		perror("MALLOC");
+		free_task(c->x, t);
+		return;
+	}
+	*p = (struct piece){ .batch = t };
+	queue_push(&c->x->pieces, p);
+}
+
+static void *decode_worker(void *arg)
+{
+	struct extraction *x = arg;
+	unsigned id = __atomic_add_fetch(&x->next_pool, 1, __ATOMIC_RELAXED);
+	BufferPool *pool = x->pools[id];
+	InflateDecoder *dec = inflate_decoder_new();
+	struct task *t;
+
+	while ((t = queue_pop(&x->tasks)) != NULL) {
+		struct decode_ctx c = { .x = x, .t = t, .pool = pool };
+		enum entry_status status = STATUS_BAD_DATA;
+
+		if (t->e == NULL) {
+			decode_batch(&c, dec);
+			continue;
+		}
+		if (dec != NULL)
+			status = decode_task(&c, dec);
+		if (c.write_failed)
+			perror("MALLOC");
+		push_piece(&c, NULL, NULL, 0, 0, true, status);
+
+		/* The reader is done with the task once its chunks close */
+		if (c.chunk != NULL)
+			free_chunk(x, c.chunk);
+		if (t->chunked) {
+			struct chunk *chunk;
+
+			while ((chunk = queue_pop(&t->chunks)) != NULL)
+				free_chunk(x, chunk);
+			queue_destroy(&t->chunks);
+		}
+		free_task(x, t);
+	}
+
+	if (dec == NULL)
+		perror("MALLOC");
+	inflate_decoder_free(dec);
+	if (__atomic_sub_fetch(&x->workers, 1, __ATOMIC_ACQ_REL) == 0)
+		queue_close(&x->pieces);
+
+	return NULL;
+}
+
+/* Creates the directories leading to name, skipping known ones */
+static int8_t make_parents(struct extraction *x, const char *name)
+{
+	const char *slash = strrchr(name, '/');
+	if (slash == NULL)
+		return 0;
+
+	/* Leading components shared with the last directory made exist */
+	size_t len = slash - name, known = 0;
+	while (known < len && x->made_dir[known] == name[known])
+		known++;
+
+	char *dir = x->path;
+	memcpy(dir, name, len);
+	dir[len] = '\0';
+	for (size_t i = 1; i <= len; i++) {
+		if (dir[i] != '/' && dir[i] != '\0')
+			continue;
+		if (i <= known &&
+		    (x->made_dir[i] == '/' || x->made_dir[i] == '\0'))
+			continue;
+
+		char c = dir[i];
+		dir[i] = '\0';
+		if (mkdirat(x->dir_fd, dir, 0755) != 0 && errno != EEXIST) {
+			perror(dir);
+			x->made_dir[0] = '\0';
+			return -1;
+		}
+		dir[i] = c;
+	}
+	memcpy(x->made_dir, dir, len + 1);
+
+	return 0;
+}
+
+static bool is_dir_entry(const struct extract_entry *e)
+{
+	size_t len = e->entry.file_name_len;
+
+	return len > 0 && e->name[len - 1] == '/';
+}
+
+static void open_output(struct extraction *x, struct extract_entry *e)
+{
+	e->opened = true;
+	e->fd = -1;
+	if (make_parents(x, e->name) != 0) {
+		e->failed = true;
+		return;
+	}
+	if (is_dir_entry(e))
+		return;
+
+	mode_t mode = (e->entry.external_file_attr >> 16) & 0777;
+	e->fd = openat(x->dir_fd, e->name,
+		       O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC,
+		       mode != 0 ? mode : 0644);
+	if (e->fd < 0) {
+		perror(e->name);
+		e->failed = true;
+		return;
+	}
+
+	/*
+	 * Keeps large outputs in few extents, unless their declared size is
+	 * more than the data could inflate to. Zeros skipped are punched
+	 * back out, and a failed reservation may still have left some.
+	 */
+	uint64_t size = e->entry.uncomp_size;
+	e->pos = e->zeros = 0;
+	if (e->copy_of == NULL && size >= PREALLOC_MIN &&
+	    size / DEFLATE_MAX_RATIO <= e->entry.comp_size) {
+		int err = fallocate(e->fd, FALLOC_FL_KEEP_SIZE, 0, size);
+		e->prealloc = err == 0 || errno != EOPNOTSUPP;
+	}
+}
+
+/*
+ * Writes len bytes at off, after the zeros skipped since the last write.
+ * Those are then punched out of the reservation, if any, as a courtesy:
+ * they read back as zeros either way. Only once the file reaches past
+ * them, as ext4 ignores punches beyond its end.
+ */
+static int8_t put_data(struct extract_entry *e, const unsigned char *buf,
+		       size_t len, uint64_t off)
+{
+	uint64_t zeros = e->zeros;
+
+	e->zeros = off + len;
+	for (uint64_t at = off; len > 0;) {
+		ssize_t n = pwrite(e->fd, buf, len, at);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -1;
+		buf += n;
+		len -= n;
+		at += n;
+	}
+	if (e->prealloc && zeros < off)
+		fallocate(e->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			  zeros, off - zeros);
+
+	return 0;
+}
+
+/* Gives a file the size of its output, whatever was skipped or reserved */
+static int8_t end_data(struct extract_entry *e)
+{
+	bool resize = e->prealloc || e->zeros < e->pos;
+
+	if ((resize && ftruncate(e->fd, e->pos) != 0) ||
+	    put_data(e, NULL, 0, e->pos) != 0)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * glibc's mktime rereads the zone, allocating, on every call, so the
+ * start of the last local hour seen is kept and minutes added to it.
+ */
+static time_t unix_time(struct extraction *x, uint16_t time, uint16_t date)
+{
+	uint32_t hour = ((uint32_t)date << 5 | time >> 11) + 1;
+
+	if (hour != x->stamp_hour) {
+		struct tm tm = {
+			.tm_year = (date >> 9) + 80,
+			.tm_mon = ((date >> 5) & 0xF) - 1,
+			.tm_mday = date & 0x1F,
+			.tm_hour = time >> 11,
+			.tm_isdst = -1,
+		};
+
+		x->stamp_hour = hour;
+		x->stamp_base = mktime(&tm);
+	}
+
+	return x->stamp_base + ((time >> 5) & 0x3F) * 60 + (time & 0x1F) * 2;
+}
+
+static void finish_entry(struct extraction *x, struct extract_entry *e,
+			 enum entry_status status)
+{
+	e->status = status;
+	if (e->fd >= 0) {
+		struct timespec times[2] = {
+			{ .tv_nsec = UTIME_OMIT },
+			{ .tv_sec = unix_time(x, e->entry.last_mod_file_time,
+					      e->entry.last_mod_file_date) },
+		};
+
+		if (end_data(e) != 0) {
+			perror(e->name);
+			e->failed = true;
+		}
+		futimens(e->fd, times);
+		if (close(e->fd) != 0 && !e->failed) {
+			perror(e->name);
+			e->failed = true;
+		}
+		e->fd = -1;
+	}
+
+	switch (status) {
+	case STATUS_OK:
+		break;
+	case STATUS_BAD_CRC:
+		fprintf(stderr, "%s: bad CRC\n", e->name);
+		break;
+	case STATUS_BAD_DATA:
+		fprintf(stderr, "%s: bad compressed data\n", e->name);
+		break;
+	case STATUS_ENCRYPTED:
+		fprintf(stderr, "%s: skipping, encrypted\n", e->name);
+		break;
+	case STATUS_UNSUPPORTED:
+		fprintf(stderr, "%s: skipping, unsupported method %u\n",
+			e->name, e->entry.comp_method);
+		break;
+	}
+
+	if (status != STATUS_OK || e->failed)
+		x->failed++;
+	else if (x->journal != NULL)
+		journal_add(x->journal, e->index, e->entry.crc32,
+			    e->entry.uncomp_size);
+	if (status == STATUS_OK && !e->failed && x->verbose)
+		printf("%s: %s\n",
+		       e->verb != NULL ? e->verb :
+		       is_dir_entry(e) ? "   creating" :
+		       e->entry.comp_method == ZIP_METHOD_STORE ?
+					 " extracting" :
+					 "  inflating",
+		       e->name);
+}
+
+/* Most blocks holding data give up on the first word */
+static bool all_zero(const unsigned char *p, size_t len)
+{
+	typedef uint64_t vec __attribute__((vector_size(64)));
+	vec acc = { 0 };
+	uint64_t first;
+
+	if (len < SPARSE_BLOCK) {
+		for (size_t i = 0; i < len; i++)
+			if (p[i] != 0)
+				return false;
+		return true;
+	}
+
+	memcpy(&first, p, sizeof(first));
+	if (first != 0)
+		return false;
+	for (size_t i = 0; i < SPARSE_BLOCK; i += sizeof(vec)) {
+		vec v;
+
+		memcpy(&v, p + i, sizeof(v));
+		acc |= v;
+	}
+	for (size_t i = 1; i < sizeof(vec) / sizeof(acc[0]); i++)
+		acc[0] |= acc[i];
+
+	return acc[0] == 0;
+}
+
+/*
+ * Skips aligned blocks of zeros and writes the rest. Unwritten bytes read
+ * back as zeros, and whole blocks of them take no space: zeros at either
+ * end of buf are skipped too, so blocks split between calls count whole.
+ */
+static void write_data(struct extraction *x, struct extract_entry *e,
+		       const unsigned char *buf, size_t len)
+{
+	uint64_t off = e->pos;
+	size_t done = 0;
+
+	if (e->fd < 0)
+		return;
+	e->pos += len;
+	for (size_t i = 0; i < len;) {
+		size_t n = SPARSE_BLOCK - (off + i) % SPARSE_BLOCK;
+		if (n > len - i)
+			n = len - i;
+
+		if (all_zero(buf + i, n)) {
+			if (i > done &&
+			    put_data(e, buf + done, i - done, off + done) != 0)
+				goto fail;
+			done = i + n;
+			x->sparse += n;
+		}
+		i += n;
+	}
+	if (len > done && put_data(e, buf + done, len - done, off + done) != 0)
+		goto fail;
+
+	return;
+
+fail:
+	perror(e->name);
+	e->failed = true;
+	close(e->fd);
+	e->fd = -1;
+}
+
+static void write_batch(struct extraction *x, struct task *t)
+{
+	for (size_t k = 0; k < t->count; k++) {
+		struct batch_item *item = &t->items[k];
+
+		open_output(x, item->e);
+		write_data(x, item->e, item->out, item->out_len);
+		finish_entry(x, item->e, item->status);
+	}
+	free_task(x, t);
+}
+
+static void write_pieces(struct extraction *x)
+{
+	struct piece *p;
+
+	while ((p = queue_pop(&x->pieces)) != NULL) {
+		struct extract_entry *e = p->e;
+
+		if (p->batch != NULL) {
+			write_batch(x, p->batch);
+			pool_put(p);
+			continue;
+		}
+		if (!e->opened)
+			open_output(x, e);
+		write_data(x, e, p->start, p->len);
+		if (p->last)
+			finish_entry(x, e, p->status);
+
+		budget_release(&x->budget, p->charge);
+		pool_put(p->data);
+		pool_put(p);
+	}
+}
+
+static int8_t parallel_write(void *ctx, const unsigned char *buf,
+			     size_t len)
+{
+	struct parallel_ctx *c = ctx;
+
+	c->size += len;
+	write_data(c->x, c->e, buf, len);
+
+	return c->e->failed ? -1 : 0;
+}
+
+/*
+ * Decodes a huge deflated entry on all jobs together, straight from the
+ * archive mapped whole. By then the pipeline is done and its budget
+ * free: each job holds about 32 bytes of output per input byte of its
+ * chunk, so chunks are sized to fit.
+ */
+static void extract_parallel(struct extraction *x, struct extract_entry *e,
+			     unsigned jobs)
+{
+	const ZipEntry *entry = &e->entry;
+	struct parallel_ctx c = { .x = x, .e = e };
+	struct stat st;
+	uint64_t pos;
+
+	open_output(x, e);
+	if (locate_data(x, e, &pos) != 0 || fstat(x->archive_fd, &st) != 0 ||
+	    pos + entry->comp_size > (uint64_t)st.st_size) {
+		finish_entry(x, e, STATUS_BAD_DATA);
+		return;
+	}
+
+	uint64_t map_off = pos & ~(uint64_t)(sysconf(_SC_PAGESIZE) - 1);
+	size_t map_len = pos - map_off + entry->comp_size;
+	unsigned char *map = mmap(NULL, map_len, PROT_READ, MAP_SHARED,
+				  x->archive_fd, map_off);
+	if (map == MAP_FAILED) {
+		perror("MMAP");
+		e->failed = true;
+		finish_entry(x, e, STATUS_OK);
+		return;
+	}
+
+	uint64_t chunk_len = x->budget.limit / (32 * ((uint64_t)jobs + 1));
+	if (chunk_len < PARALLEL_CHUNK_MIN)
+		chunk_len = PARALLEL_CHUNK_MIN;
+	if (chunk_len > PARALLEL_CHUNK_MAX)
+		chunk_len = PARALLEL_CHUNK_MAX;
+
+	int8_t err = inflate_decode_parallel(map + (pos - map_off),
+					     entry->comp_size, jobs, chunk_len,
+					     parallel_write, &c, &c.crc);
+	munmap(map, map_len);
+
+	enum entry_status status = STATUS_BAD_DATA;
+	if (err == -1) {
+		if (!e->failed)
+			perror("MALLOC");
+		e->failed = true;
+		status = STATUS_OK; /* reported already */
+	} else if (err == 0 && c.size == entry->uncomp_size) {
+		status = c.crc == entry->crc32 ? STATUS_OK : STATUS_BAD_CRC;
+	}
+	finish_entry(x, e, status);
+}
+
+/* Whether a hard link would show e as its own extraction would */
+static bool looks_alike(const struct extract_entry *e,
+			const struct extract_entry *from)
+{
+	const ZipEntry *u = &e->entry, *v = &from->entry;
+
+	return ((u->external_file_attr ^ v->external_file_attr) >> 16 &
+		0777) == 0 &&
+	       u->last_mod_file_time == v->last_mod_file_time &&
+	       u->last_mod_file_date == v->last_mod_file_date;
+}
+
+/*
+ * Gives e the output of the entry it duplicates, which is done by now: a
+ * reflink where the file system shares blocks, else a hard link when
+ * allowed and the two look alike, else a copy that keeps the holes. Any
+ * of these beats decoding the data again, and the verdict is the same.
+ */
+static void extract_copy(struct extraction *x, struct extract_entry *e)
+{
+	const struct extract_entry *from = e->copy_of;
+	struct stat st;
+
+	if (!from->opened || from->failed) {
+		fprintf(stderr, "%s: skipping, %s was not extracted\n",
+			e->name, from->name);
+		x->failed++;
+		return;
+	}
+
+	if (x->hardlinks && looks_alike(e, from) &&
+	    make_parents(x, e->name) == 0 &&
+	    (unlinkat(x->dir_fd, e->name, 0) == 0 || errno == ENOENT) &&
+	    linkat(x->dir_fd, from->name, x->dir_fd, e->name, 0) == 0) {
+		e->opened = true;
+		e->fd = -1;
+		e->verb = "    linking";
+		finish_entry(x, e, from->status);
+		return;
+	}
+
+	int src = openat(x->dir_fd, from->name,
+			 O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (src < 0 || fstat(src, &st) != 0) {
+		perror(from->name);
+		e->failed = true;
+		finish_entry(x, e, STATUS_OK);
+		if (src >= 0)
+			close(src);
+		return;
+	}
+	open_output(x, e);
+
+	if (e->fd >= 0 && ioctl(e->fd, FICLONE, src) == 0) {
+		e->pos = e->zeros = st.st_size;
+		e->verb = "    cloning";
+	} else {
+		e->verb = "    copying";
+	}
+	while (e->fd >= 0 && e->pos < (uint64_t)st.st_size) {
+		ssize_t n = pread(src, x->block, READ_BLOCK, e->pos);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			perror(from->name);
+			e->failed = true;
+			break;
+		}
+		write_data(x, e, x->block, n);
+	}
+	close(src);
+	finish_entry(x, e, from->status);
+}
+
+/*
+ * 0 for entries to extract, 1 for ones skipped like the writer skips them,
+ * such as symlinks, and -2 for absolute names or .. components.
+ */
+static int8_t check_entry(const ZipEntry *entry, const char *name)
+{
+	mode_t type = (entry->external_file_attr >> 16) & S_IFMT;
+
+	if (type != 0 && type != S_IFREG && type != S_IFDIR) {
+		fprintf(stderr, "%s: skipping, not a regular file\n", name);
+		return 1;
+	}
+
+	if (name[0] == '\0' || name[0] == '/' ||
+	    strlen(name) != entry->file_name_len)
+		goto unsafe;
+	for (const char *p = name; *p != '\0';) {
+		size_t len = strcspn(p, "/");
+		if (len == 2 && p[0] == '.' && p[1] == '.')
+			goto unsafe;
+		p += len;
+		p += *p == '/';
+	}
+
+	return 0;
+
+unsafe:
+	fprintf(stderr, "%s: skipping, unsafe path\n", name);
+	return -2;
+}
+
+static int compare_offsets(const void *a, const void *b)
+{
+	const struct extract_entry *x = a, *y = b;
+	uint64_t u = x->entry.local_header_offset;
+	uint64_t v = y->entry.local_header_offset;
+
+	return (u > v) - (u < v);
+}
+/* Reads the central directory into entries sorted by local header offset */
+static int8_t collect_entries(struct extraction *x, ZipArchive *archive)
+{
+	uint64_t count = zip_entry_count(archive);
+	size_t names_cap = 4096, names_len = 0;
+	ZipEntryView view;
+	int8_t err;
+
+	x->entries = calloc(count > 0 ? count : 1, sizeof(*x->entries));
+	x->names = malloc(names_cap);
+	ZipIterator *it = zip_iter_new(archive);
+	if (x->entries == NULL || x->names == NULL || it == NULL) {
+		perror("MALLOC");
+		zip_iter_free(it);
+		return -1;
+	}
+
+	/* Names are gathered as offsets, the pool moving as it grows */
+	while ((err = zip_iter_next(it, &view)) == 0 && x->count < count) {
+		size_t len = view.entry.file_name_len;
+
+		if (names_len + len + 1 > names_cap) {
+			char *names;
+
+			while (names_len + len + 1 > names_cap)
+				names_cap *= 2;
+			names = realloc(x->names, names_cap);
+			if (names == NULL) {
+				perror("MALLOC");
+				zip_iter_free(it);
+				return -1;
+			}
+			x->names = names;
+		}
+		memcpy(x->names + names_len, view.name, len);
+		x->names[names_len + len] = '\0';
+
+		struct extract_entry *e = &x->entries[x->count];
+		e->entry = view.entry;
+		e->index = x->count++;
+		e->name = (const char *)(uintptr_t)names_len;
+		e->fd = -1;
+		names_len += len + 1;
+	}
+	zip_iter_free(it);
+	if (err < 0) {
+		fprintf(stderr, "bad central directory\n");
+		return err;
+	}
+
+	for (size_t i = 0; i < x->count; i++) {
+		struct extract_entry *e = &x->entries[i];
+
+		e->name = x->names + (uintptr_t)e->name;
+		int8_t check = check_entry(&e->entry, e->name);
+		e->skip = check != 0;
+		x->failed += check < 0;
+	}
+	qsort(x->entries, x->count, sizeof(*x->entries), compare_offsets);
+
+	return 0;
+}
+
+static int open_destination(const char *dir)
+{
+	if (dir == NULL)
+		dir = ".";
+	if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+		perror(dir);
+		return -1;
+	}
+
+	int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		perror(dir);
+
+	return fd;
+}
+
+/*
+ * Skips the entries the journal lists, if what they were extracted to is
+ * still there with their size. Anything else is extracted again.
+ */
+static int8_t skip_resumed(struct extraction *x)
+{
+	struct stat st;
+
+	if (fstat(x->archive_fd, &st) != 0) {
+		perror("FSTAT");
+		return -1;
+	}
+	x->journal = journal_open(x->dir_fd, &st, x->count);
+	if (x->journal == NULL)
+		return -1;
+
+	for (size_t i = 0; i < x->count; i++) {
+		struct extract_entry *e = &x->entries[i];
+
+		if (e->skip ||
+		    !journal_has(x->journal, e->index, e->entry.crc32,
+				 e->entry.uncomp_size) ||
+		    fstatat(x->dir_fd, e->name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+			continue;
+
+		bool present = S_ISREG(st.st_mode) &&
+			       (uint64_t)st.st_size == e->entry.uncomp_size;
+		if (is_dir_entry(e))
+			present = S_ISDIR(st.st_mode);
+		e->skip |= present;
+		x->resumed += present;
+	}
+
+	return 0;
+}
+
+static bool dedupe_candidate(const struct extract_entry *e)
+{
+	const ZipEntry *entry = &e->entry;
+
+	return !e->skip && entry->uncomp_size >= DEDUPE_MIN &&
+	       !(entry->bit_flag & ZIP_FLAG_ENCRYPTED) &&
+	       (entry->comp_method == ZIP_METHOD_STORE ||
+		entry->comp_method == ZIP_METHOD_DEFLATE);
+}
+
+/* Orders by what the central directory says of the data */
+static int compare_content(const struct extract_entry *x,
+			   const struct extract_entry *y)
+{
+	const ZipEntry *u = &x->entry, *v = &y->entry;
+	int c = (u->crc32 > v->crc32) - (u->crc32 < v->crc32);
+
+	if (c == 0)
+		c = (u->uncomp_size > v->uncomp_size) -
+		    (u->uncomp_size < v->uncomp_size);
+	if (c == 0)
+		c = (u->comp_size > v->comp_size) -
+		    (u->comp_size < v->comp_size);
+	if (c == 0)
+		c = (u->comp_method > v->comp_method) -
+		    (u->comp_method < v->comp_method);
+
+	return c;
+}
+
+/* Then by position, so that the first of a group comes first */
+static int compare_duplicates(const void *a, const void *b)
+{
+	const struct extract_entry *x = *(struct extract_entry *const *)a;
+	const struct extract_entry *y = *(struct extract_entry *const *)b;
+	int c = compare_content(x, y);
+
+	return c != 0 ? c : (x > y) - (x < y);
+}
+
+/* The compressed data of entry in the mapped archive, NULL if outside */
+static const unsigned char *mapped_data(const unsigned char *map,
+					size_t size, const ZipEntry *entry)
+{
+	uint64_t pos = entry->local_header_offset;
+
+	if (pos > size || size - pos < LFH_FIXED_SIZE ||
+	    read_u32(map + pos, 0) != LFH_SIGNATURE)
+		return NULL;
+	pos += LFH_FIXED_SIZE + read_u16(map + pos, 26) +
+	       read_u16(map + pos, 28);
+	if (pos > size || size - pos < entry->comp_size)
+		return NULL;
+
+	return map + pos;
+}
+
+/*
+ * Groups the entries whose central directory records promise the same
+ * data and confirms each against the first of its group, comparing the
+ * compressed bytes. Only the first is decoded; the others are skipped and
+ * copied from its output at the end. Errors only leave more to decode.
+ */
+static void find_duplicates(struct extraction *x)
+{
+	struct extract_entry **sorted = malloc(x->count * sizeof(*sorted) + 1);
+	size_t n = 0;
+	bool any = false;
+
+	if (sorted == NULL)
+		return;
+	for (size_t i = 0; i < x->count; i++)
+		if (dedupe_candidate(&x->entries[i]))
+			sorted[n++] = &x->entries[i];
+	qsort(sorted, n, sizeof(*sorted), compare_duplicates);
+	for (size_t i = 1; i < n && !any; i++)
+		any = compare_content(sorted[i - 1], sorted[i]) == 0;
+
+	struct stat st;
+	unsigned char *map = MAP_FAILED;
+	if (any && fstat(x->archive_fd, &st) == 0 && st.st_size > 0)
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED,
+			   x->archive_fd, 0);
+	if (map == MAP_FAILED) {
+		free(sorted);
+		return;
+	}
+
+	for (size_t i = 0; i < n;) {
+		struct extract_entry *first = sorted[i];
+		const unsigned char *data =
+			mapped_data(map, st.st_size, &first->entry);
+
+		while (++i < n && compare_content(first, sorted[i]) == 0) {
+			struct extract_entry *e = sorted[i];
+			const unsigned char *other =
+				mapped_data(map, st.st_size, &e->entry);
+
+			if (data != NULL && other != NULL &&
+			    memcmp(data, other, e->entry.comp_size) == 0) {
+				e->copy_of = first;
+				e->skip = true;
+			}
+		}
+	}
+	munmap(map, st.st_size);
+	free(sorted);
+}
+
+static void free_extraction(struct extraction *x)
+{
+	journal_close(x->journal, false);
+	if (x->archive_fd >= 0)
+		close(x->archive_fd);
+	if (x->dir_fd >= 0)
+		close(x->dir_fd);
+	free(x->entries);
+	free(x->names);
+	free(x->made_dir);
+	free(x->path);
+	pool_put(x->block);
+	for (unsigned i = 0; x->pools != NULL && i < x->pool_count; i++)
+		pool_free(x->pools[i]);
+	free(x->pools);
+}
+
+int8_t zip_extract(ZipArchive *archive, const char *filename,
+		   const ZipExtractOptions *opts)
+{
+	struct extraction x = {
+		.archive_fd = -1,
+		.dir_fd = -1,
+		.verbose = opts != NULL && opts->verbose,
+		.hardlinks = opts != NULL && opts->hardlinks,
+		.budget = {
+			.lock = PTHREAD_MUTEX_INITIALIZER,
+			.freed = PTHREAD_COND_INITIALIZER,
+		},
+	};
+
+	if (archive == NULL || filename == NULL)
+		return -1;
+
+	x.archive_fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (x.archive_fd < 0) {
+		perror(filename);
+		return -1;
+	}
+	posix_fadvise(x.archive_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	int8_t err = collect_entries(&x, archive);
+	if (err == 0) {
+		x.dir_fd = open_destination(opts != NULL ? opts->dir : NULL);
+		x.made_dir = calloc(1, ZIP_NAME_MAX + 1);
+		x.path = malloc(ZIP_NAME_MAX + 1);
+		if (x.dir_fd < 0 || x.made_dir == NULL || x.path == NULL)
+			err = -1;
+	}
+	if (err == 0 && opts != NULL && opts->resume)
+		err = skip_resumed(&x);
+	if (err == 0)
+		find_duplicates(&x);
+	if (err != 0) {
+		free_extraction(&x);
+		return err;
+	}
+
+	unsigned jobs = opts != NULL ? opts->jobs : 0;
+	if (jobs == 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		jobs = cpus > 0 ? cpus : 1;
+	}
+	/* Only the pipeline is capped at one thread per entry */
+	unsigned parallel_jobs = jobs;
+	for (size_t i = 0; parallel_jobs > 1 && i < x.count; i++) {
+		struct extract_entry *e = &x.entries[i];
+
+		e->parallel = !e->skip &&
+			      e->entry.comp_method == ZIP_METHOD_DEFLATE &&
+			      !(e->entry.bit_flag & ZIP_FLAG_ENCRYPTED) &&
+			      e->entry.comp_size >= PARALLEL_MIN;
+		e->skip |= e->parallel;
+	}
+	if (jobs > x.count)
+		jobs = x.count > 0 ? x.count : 1;
+	budget_init(&x, opts != NULL ? opts->memory : 0, jobs);
+
+	x.pools = calloc(jobs + 1, sizeof(*x.pools));
+	if (x.pools != NULL) {
+		bool huge = opts != NULL && opts->huge_pages;
+
+		while (x.pool_count < jobs + 1 &&
+		       (x.pools[x.pool_count] = pool_new(huge)) != NULL)
+			x.pool_count++;
+		if (x.pool_count == jobs + 1)
+			x.block = pool_get(x.pools[0], READ_BLOCK);
+	}
+
+	pthread_t *threads = calloc(jobs + 1, sizeof(*threads));
+	if (threads == NULL || x.block == NULL ||
+	    queue_init(&x.tasks, x.pools[0], TASKS_PER_JOB * (size_t)jobs) !=
+		    0) {
+		perror("MALLOC");
+		free(threads);
+		free_extraction(&x);
+		return -1;
+	}
+	if (queue_init(&x.pieces, x.pools[0], PIECES_PER_JOB * (size_t)jobs) !=
+	    0) {
+		perror("MALLOC");
+		queue_destroy(&x.tasks);
+		free(threads);
+		free_extraction(&x);
+		return -1;
+	}
+
+	x.workers = jobs;
+	unsigned started = 0;
+	while (started < jobs && pthread_create(&threads[started + 1], NULL,
+						decode_worker, &x) == 0)
+		started++;
+	if (started < jobs &&
+	    __atomic_sub_fetch(&x.workers, jobs - started, __ATOMIC_ACQ_REL) ==
+		    0)
+		queue_close(&x.pieces);
+
+	bool reading = started > 0 &&
+		       pthread_create(&threads[0], NULL, reader_thread, &x) ==
+			       0;
+	if (!reading) {
+		fprintf(stderr, "%s: cannot start extraction threads\n",
+			filename);
+		err = -1;
+		queue_close(&x.tasks);
+	}
+
+	write_pieces(&x);
+
+	if (reading)
+		pthread_join(threads[0], NULL);
+	for (unsigned i = 0; i < started; i++)
+		pthread_join(threads[i + 1], NULL);
+	free(threads);
+	queue_destroy(&x.tasks);
+	queue_destroy(&x.pieces);
+
+	for (size_t i = 0; i < x.count && err == 0 && x.read_err == 0; i++)
+		if (x.entries[i].parallel)
+			extract_parallel(&x, &x.entries[i], parallel_jobs);
+	for (size_t i = 0; i < x.count && err == 0 && x.read_err == 0; i++)
+		if (x.entries[i].copy_of != NULL)
+			extract_copy(&x, &x.entries[i]);
+
+	if (x.verbose && x.sparse > 0)
+		printf("%" PRIu64 " zero bytes skipped as holes\n", x.sparse);
+	if (x.verbose && x.resumed > 0)
+		printf("%" PRIu64 " entries already extracted\n", x.resumed);
+	if (err == 0)
+		err = x.read_err != 0 ? x.read_err : (x.failed > 0 ? -2 : 0);
+	if (err == 0) {
+		journal_close(x.journal, true);
+		x.journal = NULL;
+	}
+	free_extraction(&x);
+
+	return err;
+}
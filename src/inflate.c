@@ -0,0 +1,1145 @@
+/*
+ * inflate.c -- DEFLATE Decoder
+ * Copyright (C) 2025 Jacopo Costantini
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "inflate.h"
+#include "cpu.h"
+#include "crc32.h"
+#include "deflate.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define WSIZE DEFLATE_WINDOW_SIZE
+#define OUT_SIZE (WSIZE + INFLATE_CHUNK + INFLATE_SLACK)
+#define MAX_OVERRUN 8 /* zero bytes read past the input before giving up */
+#define CRC_STEP (16 << 10) /* output checksummed while still in L1 */
+#define CHUNK_EXPANSION 16 /* output symbols a parallel chunk may grow to */
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_BMI2_KERNEL
+#endif
+
+/* Hot helpers go wherever they are used, in every kernel variant */
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+
+#define LITLEN_SYMS 288
+#define DIST_SYMS 30
+#define PRECODE_SYMS 19
+#define END_OF_BLOCK 256
+#define MAX_CODE_LEN 15
+
+/* Codes up to this long decode with one lookup, longer ones bit by bit */
+#define LITLEN_FAST_BITS 10
+#define DIST_FAST_BITS 8
+#define PRECODE_FAST_BITS 7
+
+#define BLOCK_STORED 0
+#define BLOCK_FIXED 1
+#define BLOCK_DYNAMIC 2
+
+static const uint16_t len_base[29] = { 3,  4,  5,  6,   7,   8,   9,   10,
+				       11, 13, 15, 17,  19,  23,  27,  31,
+				       35, 43, 51, 59,  67,  83,  99,  115,
+				       131, 163, 195, 227, 258 };
+
+static const uint8_t len_extra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1,
+				       1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+				       4, 4, 4, 4, 5, 5, 5, 5, 0 };
+
+static const uint16_t dist_base[30] = { 1,    2,    3,     4,     5,
+					7,    9,    13,    17,    25,
+					33,   49,   65,    97,    129,
+					193,  257,  385,   513,   769,
+					1025, 1537, 2049,  3073,  4097,
+					6145, 8193, 12289, 16385, 24577 };
+
+static const uint8_t dist_extra[30] = { 0, 0, 0,  0,  1,  1,  2,  2,
+					3, 3, 4,  4,  5,  5,  6,  6,
+					7, 7, 8,  8,  9,  9,  10, 10,
+					11, 11, 12, 12, 13, 13 };
+
+static const uint8_t precode_order[PRECODE_SYMS] = {
+	16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+/* Canonical code: symbols sorted by code, plus a direct lookup table */
+struct huffman {
+	uint16_t count[MAX_CODE_LEN + 1];
+	uint16_t symbol[LITLEN_SYMS];
+	uint16_t fast[1u << LITLEN_FAST_BITS]; /* symbol << 4 | len, or 0 */
+	unsigned fast_bits;
+	bool complete; /* no code left unused */
+};
+
+struct InflateDecoder {
+	inflate_read_fn read;
+	inflate_write_fn write;
+	inflate_next_fn next; /* output buffers to go on in, or stay in out */
+	void *ctx;
+	const unsigned char *in;
+	const unsigned char *in_end;
+	const unsigned char *in_start; /* bit positions count from here */
+	bool eof;
+	unsigned overrun; /* zero bytes made up past the end of the input */
+
+	uint64_t bitbuf;
+	unsigned bitcnt;
+
+	/*
+	 * Decoded bytes, the last WSIZE of them kept as history, in window or
+	 * straight in the caller's buffer. Past flush_limit they are flushed,
+	 * or in a caller's buffer, too many. Every CRC_STEP bytes decoding
+	 * stops at limit to checksum them.
+	 */
+	unsigned char *window;
+	unsigned char *out;
+	size_t limit;
+	size_t flush_limit;
+	size_t pos;
+	size_t flushed; /* out[0, flushed) already went to write */
+	size_t checked; /* out[checked, pos) not in crc yet */
+	uint32_t crc;
+
+	struct huffman litlen;
+	struct huffman dist;
+};
+
+InflateDecoder *inflate_decoder_new(void)
+{
+	InflateDecoder *dec = malloc(sizeof(*dec));
+	if (dec == NULL)
+		return NULL;
+
+	dec->window = malloc(OUT_SIZE);
+	if (dec->window == NULL) {
+		free(dec);
+		return NULL;
+	}
+
+	return dec;
+}
+
+void inflate_decoder_free(InflateDecoder *dec)
+{
+	if (dec == NULL)
+		return;
+
+	free(dec->window);
+	free(dec);
+}
+
+size_t inflate_decoder_size(void)
+{
+	return sizeof(InflateDecoder) + OUT_SIZE;
+}
+
+static bool fetch(InflateDecoder *d)
+{
+	if (d->eof || d->read == NULL) {
+		d->eof = true;
+		return false;
+	}
+
+	size_t n = d->read(d->ctx, &d->in);
+	if (n == 0) {
+		d->eof = true;
+		return false;
+	}
+	d->in_end = d->in + n;
+
+	return true;
+}
+
+/* Tops the bit buffer up to at least 56 bits, padding with zeros at EOF */
+static ALWAYS_INLINE void refill(InflateDecoder *d)
+{
+	if (d->in_end - d->in >= 8) {
+		uint64_t v;
+
+		memcpy(&v, d->in, sizeof(v));
+		d->bitbuf |= v << d->bitcnt;
+		d->in += (63 - d->bitcnt) >> 3;
+		d->bitcnt |= 56;
+		return;
+	}
+
+	while (d->bitcnt <= 56) {
+		if (d->in == d->in_end && !fetch(d)) {
+			d->overrun++;
+			d->bitcnt += 8;
+			continue;
+		}
+		d->bitbuf |= (uint64_t)*d->in++ << d->bitcnt;
+		d->bitcnt += 8;
+	}
+}
+
+static ALWAYS_INLINE uint32_t take(InflateDecoder *d, unsigned n)
+{
+	uint32_t v = d->bitbuf & ((1ull << n) - 1);
+
+	d->bitbuf >>= n;
+	d->bitcnt -= n;
+
+	return v;
+}
+
+static int8_t huffman_build(struct huffman *h, const uint8_t *lengths,
+			    unsigned n, unsigned fast_bits)
+{
+	uint16_t offs[MAX_CODE_LEN + 2];
+
+	memset(h->count, 0, sizeof(h->count));
+	for (unsigned i = 0; i < n; i++)
+		h->count[lengths[i]]++;
+	h->count[0] = 0;
+
+	/* Over-subscribed codes are invalid; incomplete ones just fail later */
+	int left = 1;
+	for (unsigned len = 1; len <= MAX_CODE_LEN; len++) {
+		left = (left << 1) - h->count[len];
+		if (left < 0)
+			return -2;
+	}
+	h->complete = left == 0;
+
+	offs[1] = 0;
+	for (unsigned len = 1; len < MAX_CODE_LEN; len++)
+		offs[len + 1] = offs[len] + h->count[len];
+	for (unsigned i = 0; i < n; i++)
+		if (lengths[i] != 0)
+			h->symbol[offs[lengths[i]]++] = i;
+
+	h->fast_bits = fast_bits;
+	memset(h->fast, 0, sizeof(h->fast[0]) << fast_bits);
+
+	unsigned code = 0, index = 0;
+	for (unsigned len = 1; len <= fast_bits; len++) {
+		for (unsigned k = 0; k < h->count[len]; k++, code++) {
+			unsigned rev = 0;
+
+			/* Codes are stored most significant bit first */
+			for (unsigned b = 0; b < len; b++)
+				rev |= ((code >> b) & 1) << (len - 1 - b);
+			uint16_t entry = h->symbol[index++] << 4 | len;
+			for (unsigned r = rev; r < 1u << fast_bits;
+			     r += 1u << len)
+				h->fast[r] = entry;
+		}
+		code <<= 1;
+	}
+
+	return 0;
+}
+
+/* Codes longer than the lookup table, one bit at a time */
+static int decode_slow(InflateDecoder *d, const struct huffman *h)
+{
+	int code = 0, first = 0, index = 0;
+
+	for (unsigned len = 1; len <= MAX_CODE_LEN; len++) {
+		code |= take(d, 1);
+		int count = h->count[len];
+		if (code - count < first)
+			return h->symbol[index + (code - first)];
+		index += count;
+		first = (first + count) << 1;
+		code <<= 1;
+	}
+
+	return -1;
+}
+
+/* Needs MAX_CODE_LEN bits in the buffer */
+static ALWAYS_INLINE int decode(InflateDecoder *d, const struct huffman *h)
+{
+	unsigned entry = h->fast[d->bitbuf & ((1u << h->fast_bits) - 1)];
+
+	if (entry == 0)
+		return decode_slow(d, h);
+	take(d, entry & 0xF);
+
+	return entry >> 4;
+}
+
+static void checksum(InflateDecoder *d)
+{
+	d->crc = crc32_update(d->crc, d->out + d->checked, d->pos - d->checked);
+	d->checked = d->pos;
+}
+
+/* Hands over what is pending and keeps only the history */
+static int8_t flush(InflateDecoder *d)
+{
+	if (d->write == NULL)
+		return -2;
+	checksum(d);
+	/* A buffer from next goes with its piece, so the history moves out */
+	if (d->next != NULL && d->pos > WSIZE)
+		memcpy(d->window, d->out + d->pos - WSIZE, WSIZE);
+	if (d->pos > d->flushed &&
+	    d->write(d->ctx, d->out + d->flushed, d->pos - d->flushed) != 0)
+		return -1;
+
+	if (d->pos > WSIZE) {
+		if (d->next == NULL) {
+			memmove(d->out, d->out + d->pos - WSIZE, WSIZE);
+		} else {
+			d->out = d->next(d->ctx);
+			if (d->out == NULL)
+				return -1;
+			memcpy(d->out, d->window, WSIZE);
+		}
+		d->pos = WSIZE;
+	}
+	d->flushed = d->pos;
+	d->checked = d->pos;
+
+	return 0;
+}
+
+/* Once pos reaches limit: checksums, flushes if due, sets the next limit */
+static int8_t advance(InflateDecoder *d)
+{
+	if (d->pos >= d->flush_limit) {
+		int8_t err = flush(d);
+		if (err != 0)
+			return err;
+	} else {
+		checksum(d);
+	}
+	d->limit = d->pos + CRC_STEP < d->flush_limit ? d->pos + CRC_STEP :
+							 d->flush_limit;
+
+	return 0;
+}
+
+static ALWAYS_INLINE int8_t inflate_stored(InflateDecoder *d)
+{
+	int8_t err;
+
+	take(d, d->bitcnt & 7);
+	refill(d);
+
+	uint32_t len = take(d, 16);
+	if ((take(d, 16) ^ 0xFFFF) != len)
+		return -2;
+
+	/* Whole bytes still buffered come first, then the input itself */
+	while (len > 0 && d->bitcnt >= 8) {
+		if (d->pos >= d->limit && (err = advance(d)) != 0)
+			return err;
+		d->out[d->pos++] = take(d, 8);
+		len--;
+	}
+	if (d->overrun * 8 > d->bitcnt)
+		return -2;
+	if (d->bitcnt == 0)
+		d->bitbuf = 0;
+
+	while (len > 0) {
+		if (d->pos >= d->limit && (err = advance(d)) != 0)
+			return err;
+		if (d->in == d->in_end && !fetch(d))
+			return -2;
+
+		size_t n = d->in_end - d->in;
+		if (n > len)
+			n = len;
+		if (n > d->limit - d->pos)
+			n = d->limit - d->pos;
+		memcpy(d->out + d->pos, d->in, n);
+		d->in += n;
+		d->pos += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/* Small entries are mostly fixed blocks, so these are built just once */
+static struct huffman fixed_litlen;
+static struct huffman fixed_dist;
+
+static int8_t blocks_generic(InflateDecoder *d);
+#ifdef HAVE_BMI2_KERNEL
+static int8_t blocks_bmi2(InflateDecoder *d);
+#endif
+static int8_t (*inflate_blocks)(InflateDecoder *d);
+
+__attribute__((constructor)) static void inflate_init(void)
+{
+	uint8_t lengths[LITLEN_SYMS];
+
+	memset(lengths, 8, 144);
+	memset(lengths + 144, 9, 112);
+	memset(lengths + 256, 7, 24);
+	memset(lengths + 280, 8, 8);
+	huffman_build(&fixed_litlen, lengths, LITLEN_SYMS, LITLEN_FAST_BITS);
+
+	memset(lengths, 5, DIST_SYMS);
+	huffman_build(&fixed_dist, lengths, DIST_SYMS, DIST_FAST_BITS);
+
+	inflate_blocks = blocks_generic;
+#ifdef HAVE_BMI2_KERNEL
+	if (cpu_level() >= CPU_AVX2)
+		inflate_blocks = blocks_bmi2;
+#endif
+}
+
+static int8_t build_dynamic(InflateDecoder *d)
+{
+	uint8_t lengths[LITLEN_SYMS + DIST_SYMS];
+	uint8_t precode[PRECODE_SYMS] = { 0 };
+
+	refill(d);
+	unsigned nlitlen = take(d, 5) + 257;
+	unsigned ndist = take(d, 5) + 1;
+	unsigned nprecode = take(d, 4) + 4;
+	if (nlitlen > 286 || ndist > DIST_SYMS)
+		return -2;
+
+	for (unsigned i = 0; i < nprecode; i++) {
+		refill(d);
+		precode[precode_order[i]] = take(d, 3);
+	}
+
+	/* The distance code is built last, so it holds the precode meanwhile */
+	if (huffman_build(&d->dist, precode, PRECODE_SYMS,
+			  PRECODE_FAST_BITS) != 0)
+		return -2;
+
+	unsigned n = nlitlen + ndist;
+	for (unsigned i = 0; i < n;) {
+		refill(d);
+		int sym = decode(d, &d->dist);
+		if (sym < 0)
+			return -2;
+		if (sym < 16) {
+			lengths[i++] = sym;
+			continue;
+		}
+
+		unsigned repeat;
+		uint8_t value = 0;
+		if (sym == 16) {
+			if (i == 0)
+				return -2;
+			value = lengths[i - 1];
+			repeat = 3 + take(d, 2);
+		} else if (sym == 17) {
+			repeat = 3 + take(d, 3);
+		} else {
+			repeat = 11 + take(d, 7);
+		}
+		if (repeat > n - i)
+			return -2;
+		memset(lengths + i, value, repeat);
+		i += repeat;
+	}
+
+	if (lengths[END_OF_BLOCK] == 0)
+		return -2;
+	if (huffman_build(&d->litlen, lengths, nlitlen, LITLEN_FAST_BITS) != 0)
+		return -2;
+
+	return huffman_build(&d->dist, lengths + nlitlen, ndist,
+			     DIST_FAST_BITS);
+}
+
+static ALWAYS_INLINE int8_t inflate_codes(InflateDecoder *d,
+					   const struct huffman *litlen,
+					   const struct huffman *dist)
+{
+	int8_t err;
+
+	for (;;) {
+		if (d->overrun > MAX_OVERRUN)
+			return -2;
+
+		/* 56 bits cover the longest length and distance pair */
+		refill(d);
+		int sym = decode(d, litlen);
+		if (sym < 0)
+			return -2;
+		if (sym == END_OF_BLOCK)
+			return 0;
+		if (d->pos >= d->limit && (err = advance(d)) != 0)
+			return err;
+		if (sym < END_OF_BLOCK) {
+			d->out[d->pos++] = sym;
+			continue;
+		}
+
+		sym -= END_OF_BLOCK + 1;
+		if (sym >= 29)
+			return -2;
+		size_t len = len_base[sym] + take(d, len_extra[sym]);
+
+		int dsym = decode(d, dist);
+		if (dsym < 0 || dsym >= DIST_SYMS)
+			return -2;
+		size_t dist = dist_base[dsym] + take(d, dist_extra[dsym]);
+		if (dist > d->pos)
+			return -2;
+
+		unsigned char *dst = d->out + d->pos;
+		const unsigned char *src = dst - dist;
+		if (dist >= 8) {
+			/* May copy up to 7 bytes too many, into the slack */
+			for (size_t i = 0; i < len; i += 8)
+				memcpy(dst + i, src + i, 8);
+		} else if (dist == 1) {
+			memset(dst, *src, len);
+		} else {
+			for (size_t i = 0; i < len; i++)
+				dst[i] = src[i];
+		}
+		d->pos += len;
+	}
+}
+
+/*
+ * The block loop, with all it inlines, is built for the baseline and with
+ * BMI2, whose flag-free shifts and bit extracts suit the bit reader.
+ */
+static ALWAYS_INLINE int8_t blocks(InflateDecoder *d)
+{
+	bool final;
+
+	d->eof = false;
+	d->overrun = 0;
+	d->bitbuf = 0;
+	d->bitcnt = 0;
+	d->pos = 0;
+	d->flushed = 0;
+	d->checked = 0;
+	d->crc = 0;
+	d->limit = CRC_STEP < d->flush_limit ? CRC_STEP : d->flush_limit;
+
+	do {
+		int8_t err;
+
+		refill(d);
+		final = take(d, 1);
+		switch (take(d, 2)) {
+		case BLOCK_STORED:
+			err = inflate_stored(d);
+			break;
+		case BLOCK_FIXED:
+			err = inflate_codes(d, &fixed_litlen, &fixed_dist);
+			break;
+		case BLOCK_DYNAMIC:
+			err = build_dynamic(d);
+			if (err == 0)
+				err = inflate_codes(d, &d->litlen, &d->dist);
+			break;
+		default:
+			err = -2;
+		}
+		if (err != 0)
+			return err;
+		if (d->overrun > MAX_OVERRUN)
+			return -2;
+	} while (!final);
+
+	/* Any zero padding must still be sitting unused in the buffer */
+	return d->overrun * 8 > d->bitcnt ? -2 : 0;
+}
+
+static int8_t blocks_generic(InflateDecoder *d)
+{
+	return blocks(d);
+}
+
+#ifdef HAVE_BMI2_KERNEL
+__attribute__((target("bmi,bmi2,lzcnt"))) static int8_t
+blocks_bmi2(InflateDecoder *d)
+{
+	return blocks(d);
+}
+#endif
+
+const char *inflate_kernel(void)
+{
+	return inflate_blocks == blocks_generic ? "generic" : "bmi2";
+}
+
+int8_t inflate_decode(InflateDecoder *d, inflate_read_fn read,
+		      inflate_write_fn write, void *ctx)
+{
+	d->read = read;
+	d->write = write;
+	d->next = NULL;
+	d->ctx = ctx;
+	d->in = d->in_end = NULL;
+	d->out = d->window;
+	d->flush_limit = WSIZE + INFLATE_CHUNK;
+
+	int8_t err = inflate_blocks(d);
+	return err != 0 ? err : flush(d);
+}
+
+int8_t inflate_decode_into(InflateDecoder *d, inflate_read_fn read,
+			   inflate_next_fn next, size_t span,
+			   inflate_write_fn write, void *ctx)
+{
+	d->read = read;
+	d->write = write;
+	d->next = next;
+	d->ctx = ctx;
+	d->in = d->in_end = NULL;
+	d->flush_limit = WSIZE + span;
+	d->out = next(ctx);
+	if (d->out == NULL)
+		return -1;
+
+	/* The last piece needs no buffer after it */
+	int8_t err = inflate_blocks(d);
+	d->next = NULL;
+	if (err != 0)
+		return err;
+	checksum(d);
+	if (d->pos > d->flushed &&
+	    write(ctx, d->out + d->flushed, d->pos - d->flushed) != 0)
+		return -1;
+
+	return 0;
+}
+
+int8_t inflate_decode_buffer(InflateDecoder *d, const void *in,
+			     size_t in_len, void *out, size_t out_cap,
+			     size_t *out_len)
+{
+	d->read = NULL;
+	d->write = NULL;
+	d->in = in;
+	d->in_end = d->in + in_len;
+	d->out = out;
+	d->flush_limit = out_cap;
+
+	int8_t err = inflate_blocks(d);
+	if (err == 0 && d->pos > out_cap)
+		err = -2;
+	if (err == 0)
+		checksum(d);
+	*out_len = d->pos;
+
+	return err;
+}
+
+uint32_t inflate_crc(const InflateDecoder *dec)
+{
+	return dec->crc;
+}
+
+/*
+ * Part of a stream decoded without knowing what came before it. Output
+ * symbols are bytes, or 256 + i for byte i of the 32 KiB that preceded
+ * the chunk, resolved once those are known.
+ */
+struct spec_chunk {
+	InflateDecoder *dec;
+	const unsigned char *in;
+	size_t in_len;
+	uint64_t from; /* bit to start at, or to start searching from */
+	uint64_t stop; /* decoding ends at the first block boundary past it */
+	bool search;
+	bool threaded;
+	size_t max_len; /* or once this many symbols are out */
+
+	uint16_t *out;
+	size_t len;
+	size_t cap;
+	uint64_t start; /* block boundary decoding began at */
+	bool start_stored; /* rather the length of a stored block there */
+	uint64_t end; /* and the one it ended at */
+	bool final; /* the last block of the stream ended the chunk */
+	unsigned min_ref; /* lowest window byte referred to, WSIZE if none */
+	int8_t err;
+};
+
+static uint64_t bit_pos(const InflateDecoder *d)
+{
+	return (uint64_t)(d->in - d->in_start + d->overrun) * 8 - d->bitcnt;
+}
+
+static void seek_bit(InflateDecoder *d, uint64_t bit)
+{
+	d->in = d->in_start + bit / 8;
+	d->eof = false;
+	d->overrun = 0;
+	d->bitbuf = 0;
+	d->bitcnt = 0;
+	refill(d);
+	take(d, bit % 8);
+}
+
+static int8_t reserve_symbols(struct spec_chunk *c, size_t n)
+{
+	if (c->len + n <= c->cap)
+		return 0;
+
+	size_t cap = c->cap > 0 ? c->cap : 1 << 16;
+	while (cap < c->len + n)
+		cap *= 2;
+	uint16_t *out = realloc(c->out, cap * sizeof(*out));
+	if (out == NULL)
+		return -1;
+	c->out = out;
+	c->cap = cap;
+
+	return 0;
+}
+
+static int8_t stored_symbols(InflateDecoder *d, struct spec_chunk *c)
+{
+	take(d, d->bitcnt & 7);
+	refill(d);
+
+	uint32_t len = take(d, 16);
+	if ((take(d, 16) ^ 0xFFFF) != len)
+		return -2;
+	if (reserve_symbols(c, len) != 0)
+		return -1;
+
+	while (len > 0 && d->bitcnt >= 8) {
+		c->out[c->len++] = take(d, 8);
+		len--;
+	}
+	if (d->overrun * 8 > d->bitcnt)
+		return -2;
+	if (d->bitcnt == 0)
+		d->bitbuf = 0;
+	if (len > (size_t)(d->in_end - d->in))
+		return -2;
+	for (size_t i = 0; i < len; i++)
+		c->out[c->len + i] = d->in[i];
+	c->len += len;
+	d->in += len;
+
+	return 0;
+}
+
+/* inflate_codes for symbols, matches reaching before the chunk included */
+static int8_t code_symbols(InflateDecoder *d, struct spec_chunk *c,
+			   const struct huffman *litlen,
+			   const struct huffman *dist_code)
+{
+	for (;;) {
+		if (d->overrun > MAX_OVERRUN)
+			return -2;
+
+		refill(d);
+		int sym = decode(d, litlen);
+		if (sym < 0)
+			return -2;
+		if (sym == END_OF_BLOCK)
+			return 0;
+		if (reserve_symbols(c, 258) != 0)
+			return -1;
+		if (sym < END_OF_BLOCK) {
+			c->out[c->len++] = sym;
+			continue;
+		}
+
+		sym -= END_OF_BLOCK + 1;
+		if (sym >= 29)
+			return -2;
+		size_t len = len_base[sym] + take(d, len_extra[sym]);
+
+		int dsym = decode(d, dist_code);
+		if (dsym < 0 || dsym >= DIST_SYMS)
+			return -2;
+		size_t dist = dist_base[dsym] + take(d, dist_extra[dsym]);
+		if (dist > c->len + WSIZE)
+			return -2;
+
+		uint16_t *dst = c->out + c->len;
+		size_t i = 0;
+		if (dist > c->len) {
+			unsigned ref = WSIZE - (dist - c->len);
+
+			if (ref < c->min_ref)
+				c->min_ref = ref;
+			for (; i < len && i < dist - c->len; i++)
+				dst[i] = 256 + ref + i;
+		}
+		if (dist >= len)
+			memcpy(dst + i, dst + i - dist,
+			       (len - i) * sizeof(*dst));
+		else
+			for (; i < len; i++)
+				dst[i] = dst[i - dist];
+		c->len += len;
+	}
+}
+
+/* Decodes whole blocks until the chunk has reached its stop */
+static int8_t chunk_blocks(InflateDecoder *d, struct spec_chunk *c)
+{
+	for (;;) {
+		uint64_t at = bit_pos(d);
+		if (at >= c->stop || c->len >= c->max_len) {
+			c->end = at;
+			return 0;
+		}
+
+		int8_t err;
+		refill(d);
+		bool final = take(d, 1);
+		switch (take(d, 2)) {
+		case BLOCK_STORED:
+			err = stored_symbols(d, c);
+			break;
+		case BLOCK_FIXED:
+			err = code_symbols(d, c, &fixed_litlen, &fixed_dist);
+			break;
+		case BLOCK_DYNAMIC:
+			err = build_dynamic(d);
+			if (err == 0)
+				err = code_symbols(d, c, &d->litlen, &d->dist);
+			break;
+		default:
+			err = -2;
+		}
+		if (err != 0)
+			return err;
+		if (d->overrun * 8 > d->bitcnt)
+			return -2;
+		if (final) {
+			c->final = true;
+			c->end = bit_pos(d);
+			return 0;
+		}
+	}
+}
+
+/* Bits [bit, bit + n) of in, n at most 57, zeros past its end */
+static uint64_t peek_bits(const unsigned char *in, size_t len, uint64_t bit,
+			  unsigned n)
+{
+	unsigned char bytes[8] = { 0 };
+	uint64_t at = bit / 8;
+	uint64_t v;
+
+	if (at < len)
+		memcpy(bytes, in + at, len - at < 8 ? len - at : 8);
+	memcpy(&v, bytes, sizeof(v));
+
+	return (v >> (bit % 8)) & ((1ull << n) - 1);
+}
+
+/*
+ * Whether a dynamic block header could start at bit: counts in range and
+ * a code length code that is exactly complete, as encoders write it.
+ * Most positions fail here, before anything is built.
+ */
+static bool plausible_header(const unsigned char *in, size_t len,
+			     uint64_t bit)
+{
+	uint64_t h = peek_bits(in, len, bit, 17);
+
+	if (((h >> 1) & 3) != BLOCK_DYNAMIC || ((h >> 3) & 31) > 29 ||
+	    ((h >> 8) & 31) > 29)
+		return false;
+
+	unsigned nprecode = ((h >> 13) & 15) + 4;
+	uint64_t lengths = peek_bits(in, len, bit + 17, 57);
+	unsigned kraft = 0;
+	for (unsigned i = 0; i < nprecode; i++) {
+		unsigned l = (lengths >> (3 * i)) & 7;
+
+		if (l != 0)
+			kraft += 128 >> l;
+	}
+
+	return kraft == 128;
+}
+
+/*
+ * Whether the byte at bit could start the length of a stored block, its
+ * header just before: the length must check out and so must the header
+ * of the block after it. Incompressible data comes in these.
+ */
+static bool plausible_stored(const unsigned char *in, size_t len,
+			     uint64_t bit)
+{
+	uint64_t v = peek_bits(in, len, bit, 32);
+	if (((v & 0xFFFF) ^ (v >> 16)) != 0xFFFF)
+		return false;
+
+	uint64_t next = bit + 32 + (v & 0xFFFF) * 8;
+	if (next >= (uint64_t)len * 8)
+		return false;
+	switch ((peek_bits(in, len, next, 3) >> 1) & 3) {
+	case BLOCK_STORED:
+		v = peek_bits(in, len, (next + 10) & ~(uint64_t)7, 32);
+		return ((v & 0xFFFF) ^ (v >> 16)) == 0xFFFF;
+	case BLOCK_FIXED:
+		return true;
+	case BLOCK_DYNAMIC:
+		return plausible_header(in, len, next);
+	default:
+		return false;
+	}
+}
+
+/*
+ * Whether a chunk that guessed its start decoded from the block boundary
+ * at pos. For a stored block the guess is where its length lies, which
+ * the header at pos must lead to.
+ */
+static bool chunk_starts_at(const struct spec_chunk *c, uint64_t pos)
+{
+	if (!c->start_stored)
+		return c->start == pos;
+
+	return ((pos + 10) & ~(uint64_t)7) == c->start &&
+	       peek_bits(c->in, c->in_len, pos, 3) == 0;
+}
+
+/*
+ * Finds the first bit from c->from at which a dynamic block decodes
+ * cleanly to its end, or a stored one plausibly begins, then carries on
+ * from there. A wrong guess only costs the caller a second decode from
+ * the right place.
+ */
+static int8_t chunk_search(InflateDecoder *d, struct spec_chunk *c)
+{
+	uint64_t end = (uint64_t)c->in_len * 8;
+
+	for (uint64_t bit = c->from; bit < c->stop && bit < end; bit++) {
+		if (bit % 8 == 0 && plausible_stored(c->in, c->in_len, bit)) {
+			seek_bit(d, bit);
+			c->len = 0;
+			c->min_ref = WSIZE;
+			c->start = bit;
+			c->start_stored = true;
+
+			int8_t err = stored_symbols(d, c);
+			return err != 0 ? err : chunk_blocks(d, c);
+		}
+		if (!plausible_header(c->in, c->in_len, bit))
+			continue;
+
+		seek_bit(d, bit);
+		c->len = 0;
+		c->min_ref = WSIZE;
+		bool final = take(d, 1);
+		take(d, 2);
+		if (build_dynamic(d) != 0 || !d->litlen.complete)
+			continue;
+
+		int8_t err = code_symbols(d, c, &d->litlen, &d->dist);
+		if (err == -1)
+			return err;
+		if (err != 0 || d->overrun * 8 > d->bitcnt)
+			continue;
+
+		c->start = bit;
+		if (final) {
+			c->final = true;
+			c->end = bit_pos(d);
+			return 0;
+		}
+		return chunk_blocks(d, c);
+	}
+
+	return -2;
+}
+
+static int8_t decode_chunk(struct spec_chunk *c)
+{
+	InflateDecoder *d = c->dec;
+
+	d->read = NULL;
+	d->write = NULL;
+	d->in_start = c->in;
+	d->in_end = c->in + c->in_len;
+	c->len = 0;
+	c->final = false;
+	c->min_ref = WSIZE;
+	c->start_stored = false;
+	if (c->search)
+		return chunk_search(d, c);
+	if (c->from >= (uint64_t)c->in_len * 8)
+		return -2;
+
+	seek_bit(d, c->from);
+	c->start = c->from;
+
+	return chunk_blocks(d, c);
+}
+
+static void *chunk_thread(void *arg)
+{
+	struct spec_chunk *c = arg;
+
+	c->err = decode_chunk(c);
+
+	return NULL;
+}
+
+/*
+ * Maps symbols to bytes: the first 256 to themselves, the rest to the
+ * history before the chunk, newest byte last.
+ */
+struct history {
+	unsigned char map[256 + WSIZE];
+	size_t len;
+	uint32_t crc;
+	unsigned char *out; /* the resolved chunk */
+	size_t out_cap;
+};
+
+static int8_t emit_chunk(const struct spec_chunk *c, struct history *h,
+			 inflate_write_fn write, void *ctx)
+{
+	if (c->min_ref < WSIZE - h->len)
+		return -2; /* a match reaching before the stream */
+
+	if (h->out_cap < c->len) {
+		unsigned char *out = realloc(h->out, c->len);
+		if (out == NULL)
+			return -1;
+		h->out = out;
+		h->out_cap = c->len;
+	}
+	for (size_t at = 0; at < c->len; at += CRC_STEP) {
+		size_t n = c->len - at < CRC_STEP ? c->len - at : CRC_STEP;
+
+		for (size_t i = at; i < at + n; i++)
+			h->out[i] = h->map[c->out[i]];
+		h->crc = crc32_update(h->crc, h->out + at, n);
+	}
+	if (c->len > 0 && write(ctx, h->out, c->len) != 0)
+		return -1;
+
+	unsigned char *bytes = h->map + 256;
+	if (c->len >= WSIZE) {
+		memcpy(bytes, h->out + c->len - WSIZE, WSIZE);
+	} else {
+		memmove(bytes, bytes + c->len, WSIZE - c->len);
+		memcpy(bytes + WSIZE - c->len, h->out, c->len);
+	}
+	h->len = h->len + c->len < WSIZE ? h->len + c->len : WSIZE;
+
+	return 0;
+}
+
+/*
+ * One round: chunk 0 starts at the known boundary *pos, the others guess
+ * theirs in parallel. In order, a chunk whose guess matches where the
+ * previous one ended is kept, any other is decoded again from there.
+ */
+static int8_t parallel_round(struct spec_chunk *chunks, unsigned jobs,
+			     size_t chunk_len, uint64_t *pos, bool *done,
+			     struct history *h, inflate_write_fn write,
+			     void *ctx, pthread_t *threads)
+{
+	size_t in_len = chunks[0].in_len;
+	uint64_t base = *pos / 8;
+	unsigned n = 0;
+
+	for (; n < jobs; n++) {
+		struct spec_chunk *c = &chunks[n];
+		uint64_t s = base + (uint64_t)n * chunk_len;
+
+		if (n > 0 && s >= in_len)
+			break;
+		c->from = n == 0 ? *pos : s * 8;
+		c->stop = (s + chunk_len) * 8;
+		c->search = n > 0;
+		c->threaded = n > 0 && pthread_create(&threads[n], NULL,
+						      chunk_thread, c) == 0;
+		if (n > 0 && !c->threaded)
+			c->err = decode_chunk(c);
+	}
+	chunks[0].err = decode_chunk(&chunks[0]);
+	for (unsigned k = 1; k < n; k++)
+		if (chunks[k].threaded)
+			pthread_join(threads[k], NULL);
+
+	for (unsigned k = 0; k < n && !*done; k++) {
+		struct spec_chunk *c = &chunks[k];
+
+		if (k > 0 && *pos >= c->stop)
+			continue; /* an earlier chunk ran past all of it */
+		if (k > 0 && (c->err != 0 || !chunk_starts_at(c, *pos))) {
+			c->from = *pos;
+			c->search = false;
+			c->err = decode_chunk(c);
+		}
+		if (c->err != 0)
+			return c->err;
+
+		int8_t err = emit_chunk(c, h, write, ctx);
+		if (err != 0)
+			return err;
+		*pos = c->end;
+		*done = c->final;
+	}
+
+	return *done || *pos < (uint64_t)in_len * 8 ? 0 : -2;
+}
+
+int8_t inflate_decode_parallel(const void *in, size_t in_len, unsigned jobs,
+			       size_t chunk_len, inflate_write_fn write,
+			       void *ctx, uint32_t *crc)
+{
+	struct spec_chunk *chunks = calloc(jobs, sizeof(*chunks));
+	pthread_t *threads = calloc(jobs, sizeof(*threads));
+	struct history *h = calloc(1, sizeof(*h));
+	int8_t err = 0;
+
+	if (chunks == NULL || threads == NULL || h == NULL)
+		err = -1;
+	for (unsigned v = 0; h != NULL && v < 256; v++)
+		h->map[v] = v;
+	for (unsigned k = 0; err == 0 && k < jobs; k++) {
+		chunks[k] = (struct spec_chunk){
+			.dec = inflate_decoder_new(),
+			.in = in,
+			.in_len = in_len,
+			.max_len = chunk_len * CHUNK_EXPANSION,
+		};
+		if (chunks[k].dec == NULL)
+			err = -1;
+	}
+
+	uint64_t pos = 0;
+	bool done = false;
+	while (err == 0 && !done)
+		err = parallel_round(chunks, jobs, chunk_len, &pos, &done, h,
+				     write, ctx, threads);
+
+	for (unsigned k = 0; chunks != NULL && k < jobs; k++) {
+		inflate_decoder_free(chunks[k].dec);
+		free(chunks[k].out);
+	}
+	if (h != NULL) {
+		*crc = h->crc;
+		free(h->out);
+	}
+	free(h);
+	free(threads);
+	free(chunks);
+
+	return err;
+}
@@ -0,0 +1,242 @@
+/*
+ * journal.c -- Resumable Extraction Journal
+ * Copyright (C) 2025 Jacopo Costantini
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include "journal.h"
+#include "unzip.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define JOURNAL_NAME ".zippeek-resume"
+#define JOURNAL_MAGIC 0x4a52505a /* "ZPRJ" */
+#define JOURNAL_HEADER 32 /* magic, version, archive size, mtime, count */
+#define JOURNAL_RECORD 20 /* index, CRC, size */
+#define JOURNAL_BATCH 16384 /* records per append, at most */
+#define JOURNAL_PERIOD 5 /* seconds between appends, at least */
+#define JOURNAL_BYTES (256 << 20) /* output that forces one out earlier */
+
+struct record {
+	uint64_t index;
+	uint64_t size;
+	uint32_t crc;
+};
+
+struct ResumeJournal {
+	int dir_fd;
+	int fd; /* -1 once a write failed */
+	struct record *done; /* loaded, sorted by index */
+	size_t done_count;
+	unsigned char batch[JOURNAL_BATCH * JOURNAL_RECORD];
+	size_t batched;
+	uint64_t batched_bytes;
+	time_t flushed; /* when the last append went out */
+};
+
+static void fill_header(unsigned char *p, const struct stat *archive,
+			uint64_t entry_count)
+{
+	write_u32(p, 0, JOURNAL_MAGIC);
+	write_u32(p, 4, 1);
+	write_u64(p, 8, archive->st_size);
+	write_u64(p, 16, archive->st_mtim.tv_sec * 1000000000ull +
+				 archive->st_mtim.tv_nsec);
+	write_u64(p, 24, entry_count);
+}
+
+static time_t now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+
+	return ts.tv_sec;
+}
+
+static int compare_index(const void *a, const void *b)
+{
+	const struct record *x = a, *y = b;
+
+	return (x->index > y->index) - (x->index < y->index);
+}
+
+/*
+ * Loads the records of a journal about this archive, 0 when there are
+ * none to load. A torn last record is left out.
+ */
+static int8_t load_records(ResumeJournal *j, const unsigned char *header)
+{
+	unsigned char head[JOURNAL_HEADER];
+	struct stat st;
+
+	if (pread(j->fd, head, sizeof(head), 0) != sizeof(head) ||
+	    memcmp(head, header, sizeof(head)) != 0)
+		return 0;
+	if (fstat(j->fd, &st) != 0) {
+		perror(JOURNAL_NAME);
+		return -1;
+	}
+
+	size_t len = st.st_size - JOURNAL_HEADER;
+	size_t count = len / JOURNAL_RECORD;
+	unsigned char *buf = malloc(len + 1);
+	j->done = malloc((count + 1) * sizeof(*j->done));
+	if (buf == NULL || j->done == NULL) {
+		perror("MALLOC");
+		free(buf);
+		return -1;
+	}
+	if (pread(j->fd, buf, len, JOURNAL_HEADER) != (ssize_t)len) {
+		perror(JOURNAL_NAME);
+		free(buf);
+		return -1;
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		const unsigned char *p = buf + i * JOURNAL_RECORD;
+
+		j->done[i] = (struct record){
+			.index = read_u64(p, 0),
+			.crc = read_u32(p, 8),
+			.size = read_u64(p, 12),
+		};
+	}
+	free(buf);
+	j->done_count = count;
+	qsort(j->done, count, sizeof(*j->done), compare_index);
+
+	/* Appends resume after the last whole record */
+	if (ftruncate(j->fd, JOURNAL_HEADER + count * JOURNAL_RECORD) != 0) {
+		perror(JOURNAL_NAME);
+		return -1;
+	}
+
+	return 1;
+}
+
+ResumeJournal *journal_open(int dir_fd, const struct stat *archive,
+			    uint64_t entry_count)
+{
+	ResumeJournal *j = calloc(1, sizeof(*j));
+	unsigned char header[JOURNAL_HEADER];
+
+	if (j == NULL) {
+		perror("MALLOC");
+		return NULL;
+	}
+	j->dir_fd = dir_fd;
+	j->flushed = now();
+	j->fd = openat(dir_fd, JOURNAL_NAME,
+		       O_RDWR | O_CREAT | O_APPEND | O_NOFOLLOW | O_CLOEXEC,
+		       0644);
+	if (j->fd < 0) {
+		perror(JOURNAL_NAME);
+		free(j);
+		return NULL;
+	}
+
+	fill_header(header, archive, entry_count);
+	int8_t loaded = load_records(j, header);
+	if (loaded == 0 &&
+	    (ftruncate(j->fd, 0) != 0 ||
+	     write(j->fd, header, sizeof(header)) != sizeof(header))) {
+		perror(JOURNAL_NAME);
+		loaded = -1;
+	}
+	if (loaded < 0) {
+		close(j->fd);
+		free(j->done);
+		free(j);
+		return NULL;
+	}
+
+	return j;
+}
+
+bool journal_has(const ResumeJournal *j, uint64_t index, uint32_t crc,
+		 uint64_t size)
+{
+	struct record key = { .index = index };
+	const struct record *r = NULL;
+
+	if (j->done_count > 0)
+		r = bsearch(&key, j->done, j->done_count, sizeof(*j->done),
+			    compare_index);
+
+	return r != NULL && r->crc == crc && r->size == size;
+}
+
+static void flush_batch(ResumeJournal *j)
+{
+	size_t len = j->batched * JOURNAL_RECORD;
+
+	j->flushed = now();
+	j->batched = 0;
+	j->batched_bytes = 0;
+	if (j->fd < 0 || len == 0)
+		return;
+
+	/*
+	 * The data first, so that the records never run ahead of it. That
+	 * writes back everything dirty on the file system, hence the batches.
+	 */
+	if (syncfs(j->dir_fd) != 0 ||
+	    write(j->fd, j->batch, len) != (ssize_t)len) {
+		perror(JOURNAL_NAME);
+		close(j->fd);
+		j->fd = -1;
+	}
+}
+
+void journal_add(ResumeJournal *j, uint64_t index, uint32_t crc,
+		 uint64_t size)
+{
+	unsigned char *p = j->batch + j->batched * JOURNAL_RECORD;
+
+	write_u64(p, 0, index);
+	write_u32(p, 8, crc);
+	write_u64(p, 12, size);
+	j->batched++;
+	j->batched_bytes += size;
+	if (j->batched == JOURNAL_BATCH || j->batched_bytes >= JOURNAL_BYTES ||
+	    now() - j->flushed >= JOURNAL_PERIOD)
+		flush_batch(j);
+}
+
+void journal_close(ResumeJournal *j, bool finished)
+{
+	if (j == NULL)
+		return;
+
+	if (finished) {
+		if (unlinkat(j->dir_fd, JOURNAL_NAME, 0) != 0 &&
+		    errno != ENOENT)
+			perror(JOURNAL_NAME);
+	} else {
+		flush_batch(j);
+	}
+	if (j->fd >= 0)
+		close(j->fd);
+	free(j->done);
+	free(j);
+}
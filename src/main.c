@@ -16,24 +16,276 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include "cpu.h"
+#include "crc32.h"
+#include "deflate.h"
+#include "extract.h"
+#include "inflate.h"
+#include "print.h"
+#include "probe.h"
+#include "scan.h"
 #include "unzip.h"
+#include "zipwrite.h"
+#include <ctype.h>
+#include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+enum {
+	OPT_OPTIMAL = 256,
+	OPT_NO_SAMPLE,
+	OPT_RSYNCABLE,
+	OPT_INDEX,
+	OPT_FRONT_CODED,
+	OPT_LAZY,
+	OPT_PROBE,
+	OPT_CACHE_NEUTRAL,
+	OPT_MEMORY,
+	OPT_HUGE_PAGES,
+	OPT_CPU_INFO,
+	OPT_RESUME,
+	OPT_HARDLINKS,
+};
+
+static const struct option long_options[] = {
+	{ "create", no_argument, NULL, 'c' },
+	{ "extract", no_argument, NULL, 'x' },
+	{ "directory", required_argument, NULL, 'd' },
+	{ "jobs", required_argument, NULL, 'j' },
+	{ "memory", required_argument, NULL, OPT_MEMORY },
+	{ "huge-pages", no_argument, NULL, OPT_HUGE_PAGES },
+	{ "resume", no_argument, NULL, OPT_RESUME },
+	{ "hardlinks", no_argument, NULL, OPT_HARDLINKS },
+	{ "list", no_argument, NULL, 'l' },
+	{ "print", no_argument, NULL, 'p' },
+	{ "optimal", no_argument, NULL, OPT_OPTIMAL },
+	{ "no-sample", no_argument, NULL, OPT_NO_SAMPLE },
+	{ "rsyncable", no_argument, NULL, OPT_RSYNCABLE },
+	{ "index", no_argument, NULL, OPT_INDEX },
+	{ "front-coded", no_argument, NULL, OPT_FRONT_CODED },
+	{ "lazy", no_argument, NULL, OPT_LAZY },
+	{ "probe", no_argument, NULL, OPT_PROBE },
+	{ "test", no_argument, NULL, 't' },
+	{ "cache-neutral", no_argument, NULL, OPT_CACHE_NEUTRAL },
+	{ "cpu-info", no_argument, NULL, OPT_CPU_INFO },
+	{ "verbose", no_argument, NULL, 'v' },
+	{ "help", no_argument, NULL, 'h' },
+	{ NULL, 0, NULL, 0 },
+};
+
+/* Byte count with an optional K, M or G suffix, 0 when malformed */
+static uint64_t parse_size(const char *s)
+{
+	char *end;
+	uint64_t size = strtoull(s, &end, 10);
+	const char *units = "KMG";
+	const char *unit = *end != '\0' ? strchr(units, toupper(*end)) : NULL;
+
+	if (unit != NULL) {
+		size <<= 10 * (unit - units + 1);
+		end++;
+	}
+
+	return end != s && *end == '\0' ? size : 0;
+}
+
+/* Which build of each hot loop this CPU runs */
+static void cpu_info(void)
+{
+	printf("cpu:     %s\n", cpu_level_name(cpu_level()));
+	printf("crc32:   %s\n", crc32_kernel());
+	printf("inflate: %s\n", inflate_kernel());
+	printf("scan:    %s\n", zip_scan_kernel());
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Use: %s [options] file.zip\n"
+		"     %s -l file.zip\n"
+		"     %s -p file.zip entry\n"
+		"     %s -t [--cache-neutral] file.zip\n"
+		"     %s -x [-d dir] [-j N] [--memory SIZE] [--resume] file.zip\n"
+		"     %s --probe [file...]\n"
+		"     %s --cpu-info\n"
+		"     %s -c [options] file.zip path...\n"
+		"\n"
+		"  -l, --list        list the entries in constant memory\n"
+		"  -p, --print       write one entry to stdout\n"
+		"  -t, --test        check the CRC and size of every entry\n"
+		"      --cache-neutral\n"
+		"                    scan without filling the page cache\n"
+		"      --probe       classify files (paths from stdin if none)\n"
+		"  -x, --extract     extract every entry\n"
+		"  -d, --directory DIR\n"
+		"                    extract under DIR instead of here\n"
+		"      --memory SIZE decode within SIZE bytes, K/M/G suffixes\n"
+		"                    allowed (default 256M)\n"
+		"      --huge-pages  back large buffers with huge pages\n"
+		"      --resume      keep a journal in DIR and skip the entries\n"
+		"                    an interrupted run already extracted\n"
+		"      --hardlinks   hard link duplicate entries to one file\n"
+		"  -c, --create      create file.zip from the given paths\n"
+		"  -0 ... -9         compression level (default 6)\n"
+		"      --optimal     near-optimal parsing, slowest and smallest\n"
+		"  -j, --jobs N      (de)compression threads (default one per CPU)\n"
+		"      --no-sample   compress entries whose samples don't shrink\n"
+		"      --rsyncable   reset the compressor at content-defined points\n"
+		"      --index       embed a name index for instant lookups\n"
+		"  -v, --verbose     report what happened to each entry\n"
+		"      --front-coded keep names front-coded in memory\n"
+		"      --lazy        decode the central directory on demand\n"
+		"      --cpu-info    show the code paths picked for this CPU\n",
+		prog, prog, prog, prog, prog, prog, prog, prog);
+}
 
 int main(int argc, char *argv[])
 {
-	if (argc != 2) {
-		fprintf(stderr, "Use: %s file.zip\n", argv[0]);
+	ZipWriteOptions write_opts = { .level = DEFLATE_LEVEL_DEFAULT };
+	ZipOpenOptions open_opts = { 0 };
+	ZipScanOptions scan_opts = { 0 };
+	ZipExtractOptions extract_opts = { 0 };
+	bool create = false;
+	bool list = false;
+	bool print = false;
+	bool probe = false;
+	bool test = false;
+	bool extract = false;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "0123456789cd:hj:lptvx", long_options,
+				  NULL)) != -1) {
+		if (opt >= '0' && opt <= '9') {
+			write_opts.level = opt - '0';
+			continue;
+		}
+
+		switch (opt) {
+		case OPT_OPTIMAL:
+			write_opts.level = DEFLATE_LEVEL_OPTIMAL;
+			break;
+		case 'c':
+			create = true;
+			break;
+		case 'd':
+			extract_opts.dir = optarg;
+			break;
+		case 'j':
+			write_opts.jobs = strtoul(optarg, NULL, 10);
+			extract_opts.jobs = write_opts.jobs;
+			break;
+		case 'l':
+			list = true;
+			open_opts.scan_only = true;
+			break;
+		case 'p':
+			print = true;
+			open_opts.lazy = true;
+			break;
+		case 't':
+			test = true;
+			open_opts.scan_only = true;
+			break;
+		case OPT_MEMORY:
+			extract_opts.memory = parse_size(optarg);
+			if (extract_opts.memory == 0) {
+				fprintf(stderr, "bad memory size: %s\n",
+					optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case OPT_HUGE_PAGES:
+			extract_opts.huge_pages = true;
+			break;
+		case OPT_RESUME:
+			extract_opts.resume = true;
+			break;
+		case OPT_HARDLINKS:
+			extract_opts.hardlinks = true;
+			break;
+		case OPT_CACHE_NEUTRAL:
+			scan_opts.cache_neutral = true;
+			break;
+		case OPT_NO_SAMPLE:
+			write_opts.no_sample = true;
+			break;
+		case OPT_RSYNCABLE:
+			write_opts.rsyncable = true;
+			break;
+		case OPT_INDEX:
+			write_opts.index = true;
+			break;
+		case OPT_FRONT_CODED:
+			open_opts.front_coded = true;
+			break;
+		case OPT_LAZY:
+			open_opts.lazy = true;
+			break;
+		case OPT_PROBE:
+			probe = true;
+			break;
+		case OPT_CPU_INFO:
+			cpu_info();
+			exit(EXIT_SUCCESS);
+		case 'v':
+			write_opts.verbose = true;
+			extract_opts.verbose = true;
+			break;
+		case 'x':
+			extract = true;
+			open_opts.scan_only = true;
+			break;
+		default:
+			usage(argv[0]);
+			exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+		}
+	}
+
+	if (probe) {
+		if (zip_probe(optind < argc ? argv + optind : NULL,
+			      argc - optind) != 0)
+			exit(EXIT_FAILURE);
+
+		return EXIT_SUCCESS;
+	}
+
+	if (create) {
+		if (argc - optind < 2) {
+			usage(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+		if (zip_create(argv[optind], argv + optind + 1,
+			       argc - optind - 1, &write_opts) != 0)
+			exit(EXIT_FAILURE);
+
+		return EXIT_SUCCESS;
+	}
+
+	if (argc - optind != (print ? 2 : 1)) {
+		usage(argv[0]);
 		exit(EXIT_FAILURE);
 	}
 
 	ZipArchive *archive;
-	if ((archive = openzip(argv[1])) == NULL)
+	if ((archive = openzip_ex(argv[optind], &open_opts)) == NULL)
 		exit(EXIT_FAILURE);
 
-	zip_inspect_archive(archive);
+	int8_t err = 0;
+	if (print)
+		err = zip_print_entry(archive, argv[optind], argv[optind + 1],
+				      STDOUT_FILENO);
+	else if (extract)
+		err = zip_extract(archive, argv[optind], &extract_opts);
+	else if (test)
+		err = zip_test_archive(archive, argv[optind], &scan_opts);
+	else if (list)
+		err = zip_list_archive(archive);
+	else
+		zip_inspect_archive(archive);
 
 	closezip(archive);
 
-	return EXIT_SUCCESS;
+	return err == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 }
@@ -0,0 +1,188 @@
+/*
+ * pool.c -- Buffer Pools
+ * Copyright (C) 2025 Jacopo Costantini
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include "pool.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#define POOL_MIN_SHIFT 6 /* smallest class, 64 bytes */
+#define POOL_CLASSES 17 /* up to 4 MiB; larger buffers are not kept */
+#define POOL_HEADER 64 /* keeps the data cache-line aligned */
+#define HUGE_PAGE (2 << 20)
+
+/* Sits just before the data of every buffer */
+struct pool_buf {
+	struct pool_buf *next;
+	BufferPool *owner;
+	void *map; /* mapping of a huge-page buffer, NULL from malloc */
+	size_t map_len;
+	unsigned cls;
+};
+
+struct BufferPool {
+	bool huge_pages;
+	struct pool_buf *free[POOL_CLASSES]; /* owner thread only */
+	struct pool_buf *returned; /* pushed by anyone, emptied by the owner */
+};
+
+static unsigned size_class(size_t size)
+{
+	if (size <= (1u << POOL_MIN_SHIFT))
+		return 0;
+
+	return 64 - __builtin_clzll(size - 1) - POOL_MIN_SHIFT;
+}
+
+size_t pool_class_size(size_t size)
+{
+	unsigned cls = size_class(size);
+
+	if (cls < POOL_CLASSES)
+		return (size_t)1 << (cls + POOL_MIN_SHIFT);
+
+	return (size + POOL_HEADER - 1) & ~(size_t)(POOL_HEADER - 1);
+}
+
+BufferPool *pool_new(bool huge_pages)
+{
+	BufferPool *pool = calloc(1, sizeof(*pool));
+
+	if (pool != NULL)
+		pool->huge_pages = huge_pages;
+
+	return pool;
+}
+
+static void release(struct pool_buf *b)
+{
+	if (b->map != NULL)
+		munmap(b->map, b->map_len);
+	else
+		free(b);
+}
+
+/*
+ * A huge-page buffer starts on a 2 MiB boundary with its header at the
+ * end of the page before. The slack around them is never touched, so it
+ * costs address space only.
+ */
+static struct pool_buf *alloc_huge(size_t size)
+{
+	size_t len = size + 2 * HUGE_PAGE;
+	char *map = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (map == MAP_FAILED)
+		return NULL;
+
+	char *data = (char *)(((uintptr_t)map + HUGE_PAGE) &
+			      ~(uintptr_t)(HUGE_PAGE - 1));
+	madvise(data, size, MADV_HUGEPAGE);
+
+	struct pool_buf *b = (struct pool_buf *)(data - POOL_HEADER);
+	b->map = map;
+	b->map_len = len;
+
+	return b;
+}
+
+void *pool_get(BufferPool *pool, size_t size)
+{
+	unsigned cls = size_class(size);
+	struct pool_buf *b;
+
+	size = pool_class_size(size);
+	if (cls < POOL_CLASSES) {
+		if (pool->free[cls] == NULL) {
+			/* Take back everything other threads returned */
+			b = __atomic_exchange_n(&pool->returned, NULL,
+						__ATOMIC_ACQUIRE);
+			while (b != NULL) {
+				struct pool_buf *next = b->next;
+
+				b->next = pool->free[b->cls];
+				pool->free[b->cls] = b;
+				b = next;
+			}
+		}
+		b = pool->free[cls];
+		if (b != NULL) {
+			pool->free[cls] = b->next;
+			return (char *)b + POOL_HEADER;
+		}
+	}
+
+	if (pool->huge_pages && size >= HUGE_PAGE) {
+		b = alloc_huge(size);
+	} else {
+		b = aligned_alloc(POOL_HEADER, POOL_HEADER + size);
+		if (b != NULL)
+			b->map = NULL;
+	}
+	if (b == NULL)
+		return NULL;
+	b->owner = pool;
+	b->cls = cls;
+
+	return (char *)b + POOL_HEADER;
+}
+
+void pool_put(void *buf)
+{
+	if (buf == NULL)
+		return;
+
+	struct pool_buf *b = (struct pool_buf *)((char *)buf - POOL_HEADER);
+	if (b->cls >= POOL_CLASSES) {
+		release(b);
+		return;
+	}
+
+	/* Only the owner ever pops, and all at once, so ABA cannot bite */
+	BufferPool *pool = b->owner;
+	b->next = __atomic_load_n(&pool->returned, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&pool->returned, &b->next, b, true,
+					    __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+}
+
+void pool_free(BufferPool *pool)
+{
+	if (pool == NULL)
+		return;
+
+	struct pool_buf *b = pool->returned;
+	while (b != NULL) {
+		struct pool_buf *next = b->next;
+
+		release(b);
+		b = next;
+	}
+	for (unsigned cls = 0; cls < POOL_CLASSES; cls++) {
+		for (b = pool->free[cls]; b != NULL;) {
+			struct pool_buf *next = b->next;
+
+			release(b);
+			b = next;
+		}
+	}
+	free(pool);
+}
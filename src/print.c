@@ -0,0 +1,224 @@
+/*
+ * print.c -- Single Entry Output
+ * Copyright (C) 2025 Jacopo Costantini
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include "print.h"
+#include "crc32.h"
+#include "inflate.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define PIPE_SIZE (1 << 20) /* asked for, the default limit for users */
+#define STORED_STEP (1 << 20) /* stored bytes checksummed per splice */
+
+struct output {
+	int fd;
+	bool pipe;
+	const unsigned char *in;
+	size_t in_len;
+	uint64_t size;
+};
+
+static size_t print_read(void *ctx, const unsigned char **buf)
+{
+	struct output *o = ctx;
+	size_t len = o->in_len;
+
+	*buf = o->in;
+	o->in_len = 0;
+
+	return len;
+}
+
+static int8_t print_write(void *ctx, const unsigned char *buf, size_t len)
+{
+	struct output *o = ctx;
+
+	o->size += len;
+	while (len > 0) {
+		ssize_t n = write(o->fd, buf, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			perror("WRITE");
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/* Moves stored data from the page cache into the pipe, checksumming it */
+static int8_t splice_stored(struct output *o, int fd, uint64_t pos,
+			    uint32_t *crc)
+{
+	for (size_t done = 0; done < o->in_len;) {
+		size_t step = o->in_len - done;
+		if (step > STORED_STEP)
+			step = STORED_STEP;
+		*crc = crc32_update(*crc, o->in + done, step);
+
+		loff_t off = pos + done;
+		for (size_t left = step; left > 0;) {
+			ssize_t n = splice(fd, &off, o->fd, NULL, left,
+					   SPLICE_F_MORE);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n < 0) {
+				perror("SPLICE");
+				return -1;
+			}
+			if (n == 0)
+				return -2; /* the archive shrank */
+			left -= n;
+		}
+		o->size += step;
+		done += step;
+	}
+
+	return 0;
+}
+
+static int8_t print_stored(struct output *o, int fd, uint64_t pos,
+			   uint32_t *crc)
+{
+	if (o->pipe)
+		return splice_stored(o, fd, pos, crc);
+
+	*crc = crc32_update(0, o->in, o->in_len);
+
+	return print_write(o, o->in, o->in_len);
+}
+
+static int8_t print_deflated(struct output *o, uint32_t *crc)
+{
+	InflateDecoder *dec = inflate_decoder_new();
+
+	if (dec == NULL) {
+		perror("MALLOC");
+		return -1;
+	}
+
+	int8_t err = inflate_decode(dec, print_read, print_write, o);
+	*crc = inflate_crc(dec);
+	inflate_decoder_free(dec);
+
+	return err;
+}
+
+/* Maps the data of entry and prints it, -2 when it is not all there */
+static int8_t print_data(struct output *o, int fd, const ZipEntry *entry,
+			 uint32_t *crc)
+{
+	unsigned char lfh[LFH_FIXED_SIZE];
+	uint64_t pos = entry->local_header_offset;
+	struct stat st;
+
+	if (pread(fd, lfh, sizeof(lfh), pos) != sizeof(lfh) ||
+	    read_u32(lfh, 0) != LFH_SIGNATURE || fstat(fd, &st) != 0)
+		return -2;
+	pos += LFH_FIXED_SIZE + read_u16(lfh, 26) + read_u16(lfh, 28);
+	if (pos + entry->comp_size > (uint64_t)st.st_size)
+		return -2;
+
+	uint64_t map_off = pos & ~(uint64_t)(sysconf(_SC_PAGESIZE) - 1);
+	size_t map_len = pos - map_off + entry->comp_size;
+	unsigned char *map = NULL;
+	if (map_len > 0) {
+		map = mmap(NULL, map_len, PROT_READ, MAP_SHARED, fd, map_off);
+		if (map == MAP_FAILED) {
+			perror("MMAP");
+			return -1;
+		}
+		madvise(map, map_len, MADV_SEQUENTIAL | MADV_WILLNEED);
+		o->in = map + (pos - map_off);
+	}
+	o->in_len = entry->comp_size;
+
+	int8_t err = entry->comp_method == ZIP_METHOD_STORE ?
+			     print_stored(o, fd, pos, crc) :
+			     print_deflated(o, crc);
+	if (map != NULL)
+		munmap(map, map_len);
+
+	return err;
+}
+
+int8_t zip_print_entry(ZipArchive *archive, const char *filename,
+		       const char *name, int fd)
+{
+	ZipEntry entry;
+	int64_t index = zip_locate(archive, name);
+
+	if (index < 0) {
+		fprintf(stderr, "%s: no such entry\n", name);
+		return -2;
+	}
+	if (zip_get_entry(archive, index, &entry) != 0)
+		return -1;
+	if (entry.bit_flag & ZIP_FLAG_ENCRYPTED) {
+		fprintf(stderr, "%s: skipping, encrypted\n", name);
+		return -2;
+	}
+	if (entry.comp_method != ZIP_METHOD_STORE &&
+	    entry.comp_method != ZIP_METHOD_DEFLATE) {
+		fprintf(stderr, "%s: skipping, unsupported method %u\n", name,
+			entry.comp_method);
+		return -2;
+	}
+
+	int archive_fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (archive_fd < 0) {
+		perror(filename);
+		return -1;
+	}
+
+	struct output o = { .fd = fd };
+	struct stat st;
+	uint32_t crc = 0;
+
+	/* Fewer, larger pipe transfers; failing that is harmless */
+	if (fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode)) {
+		o.pipe = true;
+		fcntl(fd, F_SETPIPE_SZ, PIPE_SIZE);
+	}
+	int8_t err = print_data(&o, archive_fd, &entry, &crc);
+	close(archive_fd);
+
+	if (err == -2 || (err == 0 && o.size != entry.uncomp_size)) {
+		fprintf(stderr, "%s: bad compressed data\n", name);
+		err = -2;
+	} else if (err == 0 && crc != entry.crc32) {
+		fprintf(stderr,
+			"%s: bad CRC %08" PRIx32 " (should be %08" PRIx32 ")\n",
+			name, crc, entry.crc32);
+		err = -2;
+	}
+
+	return err;
+}
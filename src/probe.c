@@ -0,0 +1,566 @@
+/*
+ * probe.c -- Archive Probe
+ * Copyright (C) 2025 Jacopo Costantini
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include "probe.h"
+#include "unzip.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <linux/io_uring.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define PROBE_BATCH 256
+#define PROBE_HEAD 64
+#define PROBE_TAIL 4096 /* end records of archives without long comments */
+#define PROBE_TAIL_MAX                                                       \
+	(EOCD_MAX_COMMENT_LEN + EOCD_FIXED_SIZE + ZIP64_EOCD_FIXED_SIZE + \
+	 ZIP64_EOCD_LOCATOR_SIZE)
+#define SPANNED_SIGNATURE 0x08074b50
+
+enum probe_status {
+	PROBE_ERROR,
+	PROBE_NOT_ZIP,
+	PROBE_TRUNCATED,
+	PROBE_ZIP,
+};
+
+/* Steps, kept in the low bits of user_data */
+enum probe_step {
+	STEP_STATX,
+	STEP_OPEN,
+	STEP_HEAD,
+	STEP_TAIL,
+};
+
+struct probe {
+	const char *path;
+	int fd;
+	int err; /* errno of the step that failed */
+	struct statx stx;
+	unsigned char head[PROBE_HEAD];
+	size_t head_len;
+	unsigned char tail[PROBE_TAIL];
+	size_t tail_len;
+
+	enum probe_status status;
+	bool zip64;
+	uint64_t entries;
+};
+
+struct ring {
+	int fd;
+	unsigned entries;
+	unsigned pending; /* queued but not yet submitted */
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_map;
+	void *cq_map;
+	size_t sq_map_len;
+	size_t cq_map_len;
+	size_t sqes_len;
+};
+
+static void ring_free(struct ring *r)
+{
+	if (r->sqes != NULL)
+		munmap(r->sqes, r->sqes_len);
+	if (r->cq_map != NULL && r->cq_map != r->sq_map)
+		munmap(r->cq_map, r->cq_map_len);
+	if (r->sq_map != NULL)
+		munmap(r->sq_map, r->sq_map_len);
+	if (r->fd >= 0)
+		close(r->fd);
+}
+
+static int8_t ring_init(struct ring *r, unsigned entries)
+{
+	struct io_uring_params p = { 0 };
+
+	memset(r, 0, sizeof(*r));
+	r->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (r->fd < 0)
+		return -1;
+
+	r->entries = p.sq_entries;
+	r->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_map_len = p.cq_off.cqes +
+			p.cq_entries * sizeof(struct io_uring_cqe);
+	r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cq_map_len > r->sq_map_len)
+			r->sq_map_len = r->cq_map_len;
+		r->cq_map_len = r->sq_map_len;
+	}
+
+	r->sq_map = mmap(NULL, r->sq_map_len, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_map == MAP_FAILED) {
+		r->sq_map = NULL;
+		goto fail;
+	}
+
+	r->cq_map = r->sq_map;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+		r->cq_map = mmap(NULL, r->cq_map_len, PROT_READ | PROT_WRITE,
+				 MAP_SHARED | MAP_POPULATE, r->fd,
+				 IORING_OFF_CQ_RING);
+		if (r->cq_map == MAP_FAILED) {
+			r->cq_map = NULL;
+			goto fail;
+		}
+	}
+
+	r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED) {
+		r->sqes = NULL;
+		goto fail;
+	}
+
+	unsigned char *sq = r->sq_map, *cq = r->cq_map;
+	r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *)(sq + p.sq_off.array);
+	r->cq_head = (unsigned *)(cq + p.cq_off.head);
+	r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	return 0;
+
+fail:
+	ring_free(r);
+	return -1;
+}
+
+/* Next free submission entry, cleared; callers never queue past entries */
+static struct io_uring_sqe *ring_sqe(struct ring *r, uint8_t opcode, int fd,
+				     uint64_t user_data)
+{
+	unsigned index = (*r->sq_tail + r->pending) & *r->sq_mask;
+	struct io_uring_sqe *sqe = &r->sqes[index];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->user_data = user_data;
+	r->sq_array[index] = index;
+	r->pending++;
+
+	return sqe;
+}
+
+static unsigned ring_ready(const struct ring *r)
+{
+	return __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE) - *r->cq_head;
+}
+
+/* Submits everything queued and waits until all of it has completed */
+static int8_t ring_run(struct ring *r)
+{
+	unsigned submit = r->pending, count = r->pending;
+
+	__atomic_store_n(r->sq_tail, *r->sq_tail + submit, __ATOMIC_RELEASE);
+	r->pending = 0;
+
+	while (submit > 0 || ring_ready(r) < count) {
+		int ret = syscall(__NR_io_uring_enter, r->fd, submit, count,
+				  IORING_ENTER_GETEVENTS, NULL, 0);
+		if (ret < 0 && errno != EINTR)
+			return -1;
+		if (ret > 0)
+			submit -= ret;
+	}
+
+	return 0;
+}
+
+static bool ring_reap(struct ring *r, struct io_uring_cqe *cqe)
+{
+	if (ring_ready(r) == 0)
+		return false;
+
+	*cqe = r->cqes[*r->cq_head & *r->cq_mask];
+	__atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+static int8_t read_at(int fd, void *buf, size_t len, uint64_t offset)
+{
+	size_t done = 0;
+
+	while (done < len) {
+		ssize_t n = pread(fd, (char *)buf + done, len - done,
+				  offset + done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			if (n == 0)
+				errno = EIO;
+			return -1;
+		}
+		done += n;
+	}
+
+	return 0;
+}
+
+static bool has_zip_head(const struct probe *p)
+{
+	if (p->head_len < 4)
+		return false;
+
+	uint32_t signature = read_u32(p->head, 0);
+	return signature == LFH_SIGNATURE || signature == EOCD_SIGNATURE ||
+	       signature == SPANNED_SIGNATURE;
+}
+
+/*
+ * Reads the end records around the EOCD found at eocd_off in tail, which
+ * holds the file from tail_pos on, and checks that the central directory
+ * fits before them.
+ */
+static void classify_end(struct probe *p, const unsigned char *tail,
+			 size_t len, uint64_t tail_pos, size_t eocd_off)
+{
+	uint64_t eocd_pos = tail_pos + eocd_off;
+	EOCD eocd;
+
+	memcpy(&eocd, tail + eocd_off, sizeof(eocd));
+	p->entries = eocd.total_entries;
+	uint64_t cd_offset = eocd.central_dir_offset;
+	uint64_t cd_size = eocd.central_dir_size;
+	uint64_t limit = eocd_pos;
+
+	unsigned char buf[ZIP64_EOCD_FIXED_SIZE];
+	const unsigned char *locator = tail + eocd_off -
+				       ZIP64_EOCD_LOCATOR_SIZE;
+	if (eocd_off < ZIP64_EOCD_LOCATOR_SIZE) {
+		locator = buf;
+		if (eocd_pos < ZIP64_EOCD_LOCATOR_SIZE ||
+		    read_at(p->fd, buf, ZIP64_EOCD_LOCATOR_SIZE,
+			    eocd_pos - ZIP64_EOCD_LOCATOR_SIZE) != 0)
+			locator = NULL;
+	}
+
+	uint64_t record_pos;
+	if (locator != NULL &&
+	    zip_parse_zip64_locator(locator, &record_pos) == 0) {
+		const unsigned char *record = buf;
+		ZIP64_EOCD zip64;
+
+		if (record_pos >= tail_pos &&
+		    record_pos + ZIP64_EOCD_FIXED_SIZE <= tail_pos + len)
+			record = tail + (record_pos - tail_pos);
+		else if (read_at(p->fd, buf, sizeof(buf), record_pos) != 0)
+			record = NULL;
+
+		if (record != NULL && zip_parse_zip64_eocd(record, &zip64) == 0) {
+			p->zip64 = true;
+			p->entries = zip64.total_entries;
+			cd_offset = zip64.central_dir_offset;
+			cd_size = zip64.central_dir_size;
+			limit = record_pos;
+		}
+	}
+
+	if (cd_offset <= limit && cd_size <= limit - cd_offset)
+		p->status = PROBE_ZIP;
+	else
+		p->status = has_zip_head(p) ? PROBE_TRUNCATED : PROBE_NOT_ZIP;
+}
+
+static void classify(struct probe *p)
+{
+	uint64_t size = p->stx.stx_size;
+	uint64_t tail_pos = size - p->tail_len;
+
+	if (size <= PROBE_TAIL) {
+		p->head_len = p->tail_len < PROBE_HEAD ? p->tail_len :
+							 PROBE_HEAD;
+		memcpy(p->head, p->tail, p->head_len);
+	}
+
+	int64_t i = zip_scan_eocd(p->tail, p->tail_len);
+	if (i >= 0) {
+		classify_end(p, p->tail, p->tail_len, tail_pos, i);
+		return;
+	}
+
+	bool zip_head = has_zip_head(p);
+	if (!zip_head || size <= p->tail_len) {
+		p->status = zip_head ? PROBE_TRUNCATED : PROBE_NOT_ZIP;
+		return;
+	}
+
+	/* A long archive comment: search the whole range it may cover */
+	size_t len = size < PROBE_TAIL_MAX ? size : PROBE_TAIL_MAX;
+	unsigned char *tail = malloc(len);
+	if (tail == NULL || read_at(p->fd, tail, len, size - len) != 0) {
+		p->status = PROBE_ERROR;
+		p->err = tail == NULL ? ENOMEM : EIO;
+		free(tail);
+		return;
+	}
+
+	i = zip_scan_eocd(tail, len);
+	if (i >= 0)
+		classify_end(p, tail, len, size - len, i);
+	else
+		p->status = PROBE_TRUNCATED;
+	free(tail);
+}
+
+static void probe_sync(struct probe *p)
+{
+	p->fd = open(p->path, O_RDONLY | O_CLOEXEC);
+	if (p->fd < 0 || statx(p->fd, "", AT_EMPTY_PATH,
+			       STATX_TYPE | STATX_SIZE, &p->stx) != 0) {
+		p->err = errno;
+		return;
+	}
+	if (!S_ISREG(p->stx.stx_mode))
+		return;
+
+	uint64_t size = p->stx.stx_size;
+	p->tail_len = size < PROBE_TAIL ? size : PROBE_TAIL;
+	if (size > PROBE_TAIL) {
+		p->head_len = PROBE_HEAD;
+		if (read_at(p->fd, p->head, p->head_len, 0) != 0) {
+			p->err = errno;
+			return;
+		}
+	}
+	if (read_at(p->fd, p->tail, p->tail_len, size - p->tail_len) != 0) {
+		p->err = errno;
+		return;
+	}
+
+	classify(p);
+}
+
+/*
+ * Three rounds per batch: statx and open for every file, then head and tail
+ * reads for the regular ones, then close. Each round is one submission.
+ */
+static int8_t probe_batch_ring(struct ring *r, struct probe *probes,
+			       size_t count)
+{
+	struct io_uring_cqe cqe;
+
+	for (size_t i = 0; i < count; i++) {
+		struct probe *p = &probes[i];
+		struct io_uring_sqe *sqe;
+
+		sqe = ring_sqe(r, IORING_OP_STATX, AT_FDCWD, i << 2 | STEP_STATX);
+		sqe->addr = (uintptr_t)p->path;
+		sqe->len = STATX_TYPE | STATX_SIZE;
+		sqe->off = (uintptr_t)&p->stx;
+
+		sqe = ring_sqe(r, IORING_OP_OPENAT, AT_FDCWD, i << 2 | STEP_OPEN);
+		sqe->addr = (uintptr_t)p->path;
+		sqe->open_flags = O_RDONLY | O_CLOEXEC;
+	}
+	if (ring_run(r) != 0)
+		return -1;
+	while (ring_reap(r, &cqe)) {
+		struct probe *p = &probes[cqe.user_data >> 2];
+
+		if (cqe.res < 0)
+			p->err = -cqe.res;
+		else if ((cqe.user_data & 3) == STEP_OPEN)
+			p->fd = cqe.res;
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		struct probe *p = &probes[i];
+		struct io_uring_sqe *sqe;
+
+		if (p->fd < 0 || p->err != 0 || !S_ISREG(p->stx.stx_mode))
+			continue;
+
+		uint64_t size = p->stx.stx_size;
+		p->tail_len = size < PROBE_TAIL ? size : PROBE_TAIL;
+		if (size > PROBE_TAIL) {
+			sqe = ring_sqe(r, IORING_OP_READ, p->fd,
+				       i << 2 | STEP_HEAD);
+			sqe->addr = (uintptr_t)p->head;
+			sqe->len = PROBE_HEAD;
+		}
+		sqe = ring_sqe(r, IORING_OP_READ, p->fd, i << 2 | STEP_TAIL);
+		sqe->addr = (uintptr_t)p->tail;
+		sqe->len = p->tail_len;
+		sqe->off = size - p->tail_len;
+	}
+	if (ring_run(r) != 0)
+		return -1;
+	while (ring_reap(r, &cqe)) {
+		struct probe *p = &probes[cqe.user_data >> 2];
+
+		if (cqe.res < 0)
+			p->err = -cqe.res;
+		else if ((cqe.user_data & 3) == STEP_HEAD)
+			p->head_len = cqe.res;
+		else if ((size_t)cqe.res < p->tail_len)
+			p->err = EIO; /* the file shrank under us */
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		struct probe *p = &probes[i];
+
+		if (p->err == 0 && S_ISREG(p->stx.stx_mode))
+			classify(p);
+		if (p->fd >= 0)
+			ring_sqe(r, IORING_OP_CLOSE, p->fd, i << 2);
+	}
+	if (ring_run(r) != 0)
+		return -1;
+	while (ring_reap(r, &cqe))
+		;
+
+	return 0;
+}
+
+static void print_probe(const struct probe *p)
+{
+	if (p->err != 0) {
+		printf("%s\terror\t%s\n", p->path, strerror(p->err));
+		return;
+	}
+
+	switch (p->status) {
+	case PROBE_ZIP:
+		printf("%s\t%s\t%" PRIu64 "\n", p->path,
+		       p->zip64 ? "zip64" : "zip", p->entries);
+		break;
+	case PROBE_TRUNCATED:
+		printf("%s\ttruncated\n", p->path);
+		break;
+	default:
+		printf("%s\tnot-zip\n", p->path);
+		break;
+	}
+}
+
+static int8_t probe_batch(struct ring *r, struct probe *probes,
+			  const char **paths, size_t count)
+{
+	/* Everything but the read buffers starts out cleared */
+	for (size_t i = 0; i < count; i++) {
+		struct probe *p = &probes[i];
+
+		memset(&p->stx, 0, sizeof(p->stx));
+		p->path = paths[i];
+		p->fd = -1;
+		p->err = 0;
+		p->head_len = 0;
+		p->tail_len = 0;
+		p->status = PROBE_NOT_ZIP;
+		p->zip64 = false;
+		p->entries = 0;
+	}
+
+	if (r != NULL) {
+		if (probe_batch_ring(r, probes, count) != 0) {
+			perror("IO_URING");
+			return -1;
+		}
+	} else {
+		for (size_t i = 0; i < count; i++) {
+			probe_sync(&probes[i]);
+			if (probes[i].fd >= 0)
+				close(probes[i].fd);
+		}
+	}
+
+	for (size_t i = 0; i < count; i++)
+		print_probe(&probes[i]);
+	return 0;
+}
+
+int8_t zip_probe(char *const paths[], size_t npaths)
+{
+	struct probe *probes = malloc(PROBE_BATCH * sizeof(*probes));
+	const char *batch[PROBE_BATCH];
+	struct ring ring;
+	struct ring *r = NULL;
+	int8_t err = 0;
+
+	if (probes == NULL) {
+		perror("MALLOC");
+		return -1;
+	}
+
+	/* Two entries per file for the statx and open round */
+	if (ring_init(&ring, 2 * PROBE_BATCH) == 0)
+		r = &ring;
+
+	if (paths != NULL) {
+		for (size_t i = 0; i < npaths && err == 0; i += PROBE_BATCH) {
+			size_t count = npaths - i < PROBE_BATCH ? npaths - i :
+								  PROBE_BATCH;
+
+			for (size_t j = 0; j < count; j++)
+				batch[j] = paths[i + j];
+			err = probe_batch(r, probes, batch, count);
+		}
+	} else {
+		char *lines[PROBE_BATCH] = { 0 };
+		size_t caps[PROBE_BATCH] = { 0 };
+		size_t count = 0;
+		ssize_t n;
+
+		while (err == 0) {
+			n = getline(&lines[count], &caps[count], stdin);
+			if (n > 0 && lines[count][n - 1] == '\n')
+				lines[count][--n] = '\0';
+			if (n > 0)
+				batch[count] = lines[count], count++;
+
+			if (count == PROBE_BATCH || (n < 0 && count > 0)) {
+				err = probe_batch(r, probes, batch, count);
+				count = 0;
+			}
+			if (n < 0)
+				break;
+		}
+
+		for (size_t i = 0; i < PROBE_BATCH; i++)
+			free(lines[i]);
+	}
+
+	if (r != NULL)
+		ring_free(r);
+	free(probes);
+	fflush(stdout);
+
+	return err;
+}
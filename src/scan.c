@@ -0,0 +1,330 @@
+/*
+ * scan.c -- Archive Scans
+ * Copyright (C) 2025 Jacopo Costantini
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include "scan.h"
+#include "crc32.h"
+#include "inflate.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SCAN_ALIGN 4096 /* O_DIRECT buffer, offset and length alignment */
+#define SCAN_CHUNK (1 << 20)
+
+enum entry_result {
+	ENTRY_OK,
+	ENTRY_BAD_CRC,
+	ENTRY_BAD_DATA,
+	ENTRY_ENCRYPTED,
+	ENTRY_UNSUPPORTED,
+};
+
+/* Sequential chunked reads of one archive, cached or not */
+struct scan_reader {
+	int fd;
+	bool direct; /* reads bypass the page cache */
+	bool drop; /* chunks leave the page cache once consumed */
+	int8_t err; /* -1 once a read failed */
+	unsigned char *buf;
+	uint64_t buf_pos; /* file offset of buf[0] */
+	size_t buf_len;
+	uint64_t data_end; /* end of the last entry read */
+};
+
+/* Compressed bytes of one entry going in, CRC and size coming out */
+struct entry_check {
+	struct scan_reader *reader;
+	uint64_t pos;
+	uint64_t left;
+	uint32_t crc;
+	uint64_t size;
+};
+
+static int8_t reader_open(struct scan_reader *r, const char *filename,
+			  bool cache_neutral)
+{
+	memset(r, 0, sizeof(*r));
+	r->buf = aligned_alloc(SCAN_ALIGN, SCAN_CHUNK);
+	if (r->buf == NULL) {
+		perror("MALLOC");
+		return -1;
+	}
+
+	r->fd = -1;
+	if (cache_neutral) {
+		r->fd = open(filename, O_RDONLY | O_CLOEXEC | O_DIRECT);
+		r->direct = r->fd >= 0;
+	}
+	if (r->fd < 0)
+		r->fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (r->fd < 0) {
+		perror("OPEN");
+		free(r->buf);
+		return -1;
+	}
+
+	r->drop = cache_neutral && !r->direct;
+	if (!r->direct)
+		posix_fadvise(r->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	return 0;
+}
+
+static void reader_close(struct scan_reader *r)
+{
+	/*
+	 * Past the entries are the central directory and end records, read
+	 * through the page cache by the iterator. Without O_DIRECT read-ahead
+	 * may have left any part of the file behind.
+	 */
+	if (r->direct)
+		posix_fadvise(r->fd, r->data_end, 0, POSIX_FADV_DONTNEED);
+	else if (r->drop)
+		posix_fadvise(r->fd, 0, 0, POSIX_FADV_DONTNEED);
+
+	close(r->fd);
+	free(r->buf);
+}
+
+/* Reads the aligned chunk holding offset */
+static int8_t reader_fill(struct scan_reader *r, uint64_t offset)
+{
+	if (r->drop && r->buf_len > 0)
+		posix_fadvise(r->fd, r->buf_pos, r->buf_len,
+			      POSIX_FADV_DONTNEED);
+
+	r->buf_pos = offset & ~(uint64_t)(SCAN_ALIGN - 1);
+	r->buf_len = 0;
+	for (;;) {
+		ssize_t n = pread(r->fd, r->buf, SCAN_CHUNK, r->buf_pos);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno == EINVAL && r->direct) {
+			/* Accepted at open, refused for reads: drop instead */
+			int flags = fcntl(r->fd, F_GETFL);
+			if (flags < 0 ||
+			    fcntl(r->fd, F_SETFL, flags & ~O_DIRECT) != 0)
+				break;
+			r->direct = false;
+			r->drop = true;
+			continue;
+		}
+		if (n < 0)
+			break;
+
+		r->buf_len = n;
+		return offset < r->buf_pos + r->buf_len ? 0 : -2;
+	}
+
+	perror("PREAD");
+	r->err = -1;
+	return -1;
+}
+
+/* Bytes from offset on, as many as the current chunk holds */
+static const unsigned char *reader_at(struct scan_reader *r, uint64_t offset,
+				      size_t *avail)
+{
+	if ((offset < r->buf_pos || offset >= r->buf_pos + r->buf_len) &&
+	    reader_fill(r, offset) != 0)
+		return NULL;
+
+	*avail = r->buf_pos + r->buf_len - offset;
+	return r->buf + (offset - r->buf_pos);
+}
+
+static int8_t reader_copy(struct scan_reader *r, uint64_t offset, void *dst,
+			  size_t len)
+{
+	while (len > 0) {
+		size_t avail;
+		const unsigned char *p = reader_at(r, offset, &avail);
+		if (p == NULL)
+			return r->err != 0 ? r->err : -2;
+
+		if (avail > len)
+			avail = len;
+		memcpy(dst, p, avail);
+		dst = (unsigned char *)dst + avail;
+		offset += avail;
+		len -= avail;
+	}
+
+	return 0;
+}
+
+static size_t check_read(void *ctx, const unsigned char **buf)
+{
+	struct entry_check *c = ctx;
+	size_t avail;
+
+	if (c->left == 0)
+		return 0;
+
+	*buf = reader_at(c->reader, c->pos, &avail);
+	if (*buf == NULL)
+		return 0;
+
+	if (avail > c->left)
+		avail = c->left;
+	c->pos += avail;
+	c->left -= avail;
+
+	return avail;
+}
+
+/* Output is only counted, the decoder checksums it */
+static int8_t check_write(void *ctx, [[maybe_unused]] const unsigned char *buf,
+			  size_t len)
+{
+	struct entry_check *c = ctx;
+
+	c->size += len;
+
+	return 0;
+}
+
+static enum entry_result test_entry(struct scan_reader *r,
+				    InflateDecoder *dec, const ZipEntry *entry,
+				    uint32_t *crc)
+{
+	unsigned char lfh[LFH_FIXED_SIZE];
+
+	*crc = 0;
+	if (entry->bit_flag & ZIP_FLAG_ENCRYPTED)
+		return ENTRY_ENCRYPTED;
+	if (entry->comp_method != ZIP_METHOD_STORE &&
+	    entry->comp_method != ZIP_METHOD_DEFLATE)
+		return ENTRY_UNSUPPORTED;
+
+	if (reader_copy(r, entry->local_header_offset, lfh, sizeof(lfh)) != 0 ||
+	    read_u32(lfh, 0) != LFH_SIGNATURE)
+		return ENTRY_BAD_DATA;
+
+	struct entry_check c = {
+		.reader = r,
+		.pos = entry->local_header_offset + LFH_FIXED_SIZE +
+		       read_u16(lfh, 26) + read_u16(lfh, 28),
+		.left = entry->comp_size,
+	};
+	if (c.pos + c.left > r->data_end)
+		r->data_end = c.pos + c.left;
+
+	if (entry->comp_method == ZIP_METHOD_DEFLATE) {
+		if (inflate_decode(dec, check_read, check_write, &c) != 0)
+			return ENTRY_BAD_DATA;
+		c.crc = inflate_crc(dec);
+	} else {
+		const unsigned char *buf;
+		size_t n;
+
+		while ((n = check_read(&c, &buf)) > 0) {
+			c.crc = crc32_update(c.crc, buf, n);
+			check_write(&c, buf, n);
+		}
+		if (c.left != 0)
+			return ENTRY_BAD_DATA;
+	}
+
+	*crc = c.crc;
+	if (c.size != entry->uncomp_size)
+		return ENTRY_BAD_DATA;
+
+	return c.crc == entry->crc32 ? ENTRY_OK : ENTRY_BAD_CRC;
+}
+
+int8_t zip_test_archive(ZipArchive *archive, const char *filename,
+			const ZipScanOptions *opts)
+{
+	struct scan_reader reader;
+	ZipEntryView view;
+	uint64_t bad = 0;
+	int8_t err;
+
+	if (reader_open(&reader, filename,
+			opts != NULL && opts->cache_neutral) != 0)
+		return -1;
+
+	InflateDecoder *dec = inflate_decoder_new();
+	ZipIterator *it = zip_iter_new(archive);
+	if (dec == NULL || it == NULL) {
+		if (dec == NULL)
+			perror("MALLOC");
+		inflate_decoder_free(dec);
+		zip_iter_free(it);
+		reader_close(&reader);
+		return -1;
+	}
+
+	printf("Archive:  %s\n", filename);
+	while ((err = zip_iter_next(it, &view)) == 0) {
+		int len = view.entry.file_name_len;
+		uint32_t crc;
+
+		switch (test_entry(&reader, dec, &view.entry, &crc)) {
+		case ENTRY_OK:
+			printf("    testing: %-22.*s   OK\n", len, view.name);
+			continue;
+		case ENTRY_BAD_CRC:
+			printf("    testing: %-22.*s   bad CRC %08" PRIx32
+			       "  (should be %08" PRIx32 ")\n",
+			       len, view.name, crc, view.entry.crc32);
+			break;
+		case ENTRY_BAD_DATA:
+			printf("    testing: %-22.*s   bad compressed data\n",
+			       len, view.name);
+			break;
+		case ENTRY_ENCRYPTED:
+			printf("   skipping: %-22.*s   encrypted\n", len,
+			       view.name);
+			break;
+		case ENTRY_UNSUPPORTED:
+			printf("   skipping: %-22.*s   unsupported method %u\n",
+			       len, view.name, view.entry.comp_method);
+			break;
+		}
+		if (reader.err != 0)
+			break;
+		bad++;
+	}
+
+	if (err < 0) {
+		fprintf(stderr, "bad central directory\n");
+	} else if (reader.err != 0) {
+		err = reader.err;
+	} else if (bad > 0) {
+		printf("At least one error was detected in %s.\n", filename);
+		err = -2;
+	} else {
+		printf("No errors detected in compressed data of %s.\n",
+		       filename);
+		err = 0;
+	}
+
+	zip_iter_free(it);
+	inflate_decoder_free(dec);
+	reader_close(&reader);
+
+	return err;
+}
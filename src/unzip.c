@@ -16,9 +16,53 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
+
 #include "unzip.h"
+#include "cpu.h"
+#include <errno.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_AVX2_SCAN
+#endif
+
+#define FC_BLOCK 16 /* names per front-coded block */
+#define CD_WINDOW (1 << 20) /* central directory bytes per lazy step */
+
+struct entry_table {
+	unsigned width;
+	size_t record_size;
+	size_t slot_size;
+	void (*store)(void *table, uint64_t index, const ZipEntry *entry,
+		      uint64_t name_offset);
+	void (*load)(const void *table, uint64_t index, ZipEntry *entry);
+	uint64_t (*name_offset)(const void *table, uint64_t index);
+	void (*set_name_offset)(void *table, uint64_t index,
+				uint64_t name_offset);
+	int (*compare_names)(const void *a, const void *b, void *arg);
+	void (*hash_insert)(ZipArchive *archive, uint64_t first,
+			    uint64_t end);
+	int64_t (*hash_locate)(const ZipArchive *archive, const char *name,
+			       size_t len);
+};
+
+struct ZipIterator {
+	int fd;
+	uint64_t window_pos; /* file offset of window[0] */
+	uint64_t cd_end;
+	uint64_t left; /* entries still to yield */
+	size_t len; /* valid bytes in window */
+	size_t off; /* next record in window */
+	unsigned char window[ZIP_ITER_WINDOW];
+};
 
 struct ZipArchive {
 	FILE *file_ptr;
@@ -26,8 +70,54 @@ struct ZipArchive {
 	uint64_t entry_count;
 	uint64_t central_dir_offset;
 	uint64_t central_dir_size;
+
+	const unsigned char *map;
+	size_t map_size;
+
+	/*
+	 * Entry table and open addressing name hash, built at open. Records
+	 * and slots are 32-bit when every size and offset fits, else 64-bit.
+	 */
+	const struct entry_table *table;
+	void *entries;
+	char *names;
+	void *name_slots; /* entry index + 1, 0 when empty */
+	uint64_t name_mask;
+	size_t names_cap;
+	size_t name_pos;
+
+	/* Central directory decoding progress, advanced in windows if lazy */
+	bool lazy;
+	int8_t parse_error;
+	uint64_t parsed; /* entries in the table */
+	uint64_t cd_pos; /* offset of the next record to decode */
+
+	/* Front-coded sorted names, replacing names and name_slots */
+	bool front_coded;
+	unsigned char *fc_names;
+	uint64_t *fc_restarts; /* offset of the first name of each block */
+	uint32_t *fc_entry; /* sorted position -> entry index */
+
+	uint64_t names_size; /* bytes spent on names and their lookup */
+
+	/* Embedded name index, used from the mapping instead when present */
+	bool has_index;
+	uint32_t index_buckets;
+	uint32_t index_slots;
+	uint64_t index_seed;
+	const unsigned char *index_displacement;
+	const unsigned char *index_slot_entry;
+	const unsigned char *index_entry_offset;
 };
 
+#define TABLE_WIDTH 32
+#include "entry_table.h"
+#undef TABLE_WIDTH
+
+#define TABLE_WIDTH 64
+#include "entry_table.h"
+#undef TABLE_WIDTH
+
 bool has_zip64_locator(FILE *fp)
 {
 	if (fseek(fp, -(long)sizeof(ZIP64_EOCD_LOCATOR), SEEK_CUR) != 0) {
@@ -46,7 +136,453 @@ bool has_zip64_locator(FILE *fp)
 	return (read_u32(temp_buffer, 0) == ZIP64_EOCD_LOCATOR_SIGNATURE);
 }
 
+/*
+ * Decodes the central directory record at p, with avail bytes readable,
+ * taking sizes and offset from the ZIP64 extra field where they overflow.
+ * Returns the record length, or 0 when it is malformed.
+ */
+static size_t decode_cdfh(const unsigned char *p, size_t avail,
+			  ZipEntry *entry)
+{
+	if (avail < CDFH_FIXED_SIZE || read_u32(p, 0) != CDFH_SIGNATURE)
+		return 0;
+
+	uint16_t name_len = read_u16(p, 28);
+	uint16_t extra_len = read_u16(p, 30);
+	size_t len = CDFH_FIXED_SIZE + name_len + extra_len + read_u16(p, 32);
+	if (len > avail)
+		return 0;
+
+	entry->bit_flag = read_u16(p, 8);
+	entry->comp_method = read_u16(p, 10);
+	entry->last_mod_file_time = read_u16(p, 12);
+	entry->last_mod_file_date = read_u16(p, 14);
+	entry->crc32 = read_u32(p, 16);
+	entry->comp_size = read_u32(p, 20);
+	entry->uncomp_size = read_u32(p, 24);
+	entry->file_name_len = name_len;
+	entry->external_file_attr = read_u32(p, 38);
+	entry->local_header_offset = read_u32(p, 42);
+
+	const unsigned char *extra = p + CDFH_FIXED_SIZE + name_len;
+	for (size_t i = 0; i + 4 <= extra_len;) {
+		size_t field = i + 4;
+		size_t end = field + read_u16(extra, i + 2);
+		if (end > extra_len)
+			break;
+
+		if (read_u16(extra, i) != ZIP64_EXTRA_ID) {
+			i = end;
+			continue;
+		}
+
+		if (entry->uncomp_size == ZIP64_LIMIT_U32 && field + 8 <= end) {
+			entry->uncomp_size = read_u64(extra, field);
+			field += 8;
+		}
+		if (entry->comp_size == ZIP64_LIMIT_U32 && field + 8 <= end) {
+			entry->comp_size = read_u64(extra, field);
+			field += 8;
+		}
+		if (entry->local_header_offset == ZIP64_LIMIT_U32 &&
+		    field + 8 <= end)
+			entry->local_header_offset = read_u64(extra, field);
+		break;
+	}
+
+	return len;
+}
+
+static int8_t map_archive(ZipArchive *archive)
+{
+	struct stat st;
+
+	if (fstat(fileno(archive->file_ptr), &st) != 0) {
+		perror("FSTAT");
+		return -1;
+	}
+
+	archive->map_size = st.st_size;
+	void *map = mmap(NULL, archive->map_size, PROT_READ, MAP_SHARED,
+			 fileno(archive->file_ptr), 0);
+	if (map == MAP_FAILED) {
+		perror("MMAP");
+		return -1;
+	}
+
+	archive->map = map;
+	if (archive->central_dir_offset > archive->map_size ||
+	    archive->central_dir_size >
+		    archive->map_size - archive->central_dir_offset)
+		return -2;
+
+	return 0;
+}
+
+/*
+ * Validates the index record ending right where the central directory
+ * starts. Anything that does not match exactly, such as a record left
+ * behind by a tool that rewrote the archive, is ignored.
+ */
+static int8_t load_embedded_index(ZipArchive *archive)
+{
+	uint64_t end = archive->central_dir_offset;
+	if (archive->entry_count == 0 ||
+	    end < ZIP_INDEX_HEADER_SIZE + ZIP_INDEX_TRAILER_SIZE)
+		return -2;
+
+	const unsigned char *trailer = archive->map + end -
+				       ZIP_INDEX_TRAILER_SIZE;
+	uint64_t size = read_u64(trailer, 0);
+	if (read_u32(trailer, 12) != ZIP_INDEX_SIGNATURE || size > end ||
+	    size < ZIP_INDEX_HEADER_SIZE + ZIP_INDEX_TRAILER_SIZE)
+		return -2;
+
+	const unsigned char *record = archive->map + end - size;
+	uint64_t count = read_u64(record, 8);
+	uint32_t nbuckets = read_u32(record, 24);
+	uint32_t nslots = read_u32(record, 28);
+	if (read_u32(record, 0) != ZIP_INDEX_SIGNATURE ||
+	    read_u16(record, 4) != ZIP_INDEX_VERSION ||
+	    count != archive->entry_count || read_u64(record, 16) != end ||
+	    nbuckets == 0 || nslots < count)
+		return -2;
+
+	uint64_t displacement = ZIP_INDEX_HEADER_SIZE;
+	uint64_t slot_entry = displacement + 4 * (uint64_t)nbuckets;
+	uint64_t entry_offset = slot_entry + 4 * (uint64_t)nslots;
+	if (entry_offset + 8 * count + ZIP_INDEX_TRAILER_SIZE != size)
+		return -2;
+
+	archive->has_index = true;
+	archive->index_buckets = nbuckets;
+	archive->index_slots = nslots;
+	archive->index_seed = read_u64(record, 32);
+	archive->index_displacement = record + displacement;
+	archive->index_slot_entry = record + slot_entry;
+	archive->index_entry_offset = record + entry_offset;
+
+	return 0;
+}
+
+static int8_t alloc_entry_table(ZipArchive *archive, bool wide,
+				size_t names_cap)
+{
+	archive->table = wide ? &entry_table64 : &entry_table32;
+	size_t table_size = archive->entry_count * archive->table->record_size;
+
+	archive->entries = malloc(table_size + names_cap);
+	if (archive->entries == NULL) {
+		perror("MALLOC");
+		return -1;
+	}
+	archive->names = (char *)archive->entries + table_size;
+	archive->names_cap = names_cap;
+
+	return 0;
+}
+
+static int8_t alloc_name_hash(ZipArchive *archive)
+{
+	uint64_t size = 16;
+	while (size < 2 * archive->entry_count)
+		size <<= 1;
+
+	archive->name_slots = calloc(size, archive->table->slot_size);
+	if (archive->name_slots == NULL) {
+		perror("CALLOC");
+		return -1;
+	}
+	archive->name_mask = size - 1;
+	archive->names_size += size * archive->table->slot_size;
+
+	return 0;
+}
+
+/* Moves a 32-bit table and its name hash to 64 bits, in lazy mode */
+static int8_t widen_table(ZipArchive *archive)
+{
+	const struct entry_table *narrow = archive->table;
+	void *entries = archive->entries;
+	char *names = archive->names;
+	void *slots = archive->name_slots;
+	uint64_t slot_bytes = 0;
+	ZipEntry entry;
+
+	if (slots != NULL)
+		slot_bytes = (archive->name_mask + 1) * narrow->slot_size;
+
+	if (alloc_entry_table(archive, true, archive->names_cap) != 0)
+		goto fail;
+	archive->names_size -= slot_bytes;
+	if (slots != NULL && alloc_name_hash(archive) != 0) {
+		free(archive->entries);
+		archive->names_size += slot_bytes;
+		goto fail;
+	}
+
+	for (uint64_t i = 0; i < archive->parsed; i++) {
+		narrow->load(entries, i, &entry);
+		archive->table->store(archive->entries, i, &entry,
+				      narrow->name_offset(entries, i));
+	}
+	memcpy(archive->names, names, archive->name_pos);
+	if (slots != NULL)
+		archive->table->hash_insert(archive, 0, archive->parsed);
+
+	free(entries);
+	free(slots);
+	return 0;
+
+fail:
+	archive->table = narrow;
+	archive->entries = entries;
+	archive->names = names;
+	archive->name_slots = slots;
+	return -1;
+}
+
+/*
+ * Decodes the central directory records that start within the next window
+ * bytes, or all remaining ones when window is 0, into the entry table and,
+ * when it exists, the name hash.
+ */
+static int8_t parse_entries(ZipArchive *archive, uint64_t window)
+{
+	const unsigned char *cd = archive->map + archive->central_dir_offset;
+	uint64_t cd_size = archive->central_dir_size;
+	uint64_t end = cd_size;
+	uint64_t first = archive->parsed;
+	ZipEntry entry;
+
+	if (window != 0 && window < cd_size - archive->cd_pos) {
+		end = archive->cd_pos + window;
+
+		/* One read for the whole window rather than a fault per page */
+		uintptr_t start = (uintptr_t)(cd + archive->cd_pos);
+		uintptr_t page = start & ~(uintptr_t)(sysconf(_SC_PAGESIZE) - 1);
+		madvise((void *)page, start - page + window, MADV_WILLNEED);
+	}
+
+	while (archive->parsed < archive->entry_count &&
+	       archive->cd_pos < end) {
+		const unsigned char *p = cd + archive->cd_pos;
+		size_t len = decode_cdfh(p, cd_size - archive->cd_pos, &entry);
+		if (len == 0 || archive->name_pos + entry.file_name_len + 1 >
+					archive->names_cap)
+			return -2;
+
+		/* Data must lie in the file, or a 32-bit table truncates */
+		if (entry.local_header_offset > archive->map_size ||
+		    entry.comp_size >
+			    archive->map_size - entry.local_header_offset)
+			return -2;
+
+		/* Widening rehashes everything parsed so far */
+		if (entry.uncomp_size > UINT32_MAX &&
+		    archive->table->width == 32) {
+			if (widen_table(archive) != 0)
+				return -1;
+			first = archive->parsed;
+		}
+
+		archive->table->store(archive->entries, archive->parsed,
+				      &entry, archive->name_pos);
+		memcpy(archive->names + archive->name_pos, p + CDFH_FIXED_SIZE,
+		       entry.file_name_len);
+		archive->names[archive->name_pos + entry.file_name_len] = '\0';
+		archive->name_pos += entry.file_name_len + 1;
+		archive->names_size += entry.file_name_len + 1;
+
+		archive->parsed++;
+		archive->cd_pos += len;
+	}
+
+	if (archive->parsed < archive->entry_count && archive->cd_pos >= cd_size)
+		return -2;
+
+	if (archive->name_slots != NULL)
+		archive->table->hash_insert(archive, first, archive->parsed);
+	return 0;
+}
+
+/* Parses windows in lazy mode until entry index is decoded */
+static int8_t parse_until(ZipArchive *archive, uint64_t index)
+{
+	while (index >= archive->parsed) {
+		if (archive->parse_error != 0)
+			return archive->parse_error;
+
+		archive->parse_error = parse_entries(archive, CD_WINDOW);
+	}
+
+	return 0;
+}
+
+static int8_t build_entry_table(ZipArchive *archive)
+{
+	const unsigned char *cd = archive->map + archive->central_dir_offset;
+	uint64_t cd_size = archive->central_dir_size;
+	uint64_t count = archive->entry_count;
+	bool wide = archive->map_size > UINT32_MAX;
+	size_t names_size = 0;
+	ZipEntry entry;
+
+	/*
+	 * Only uncompressed sizes can outgrow a file under 4 GiB: the data of
+	 * every entry has to lie within it, which parse_entries enforces.
+	 */
+	uint64_t pos = 0;
+	for (uint64_t i = 0; i < count; i++) {
+		size_t len = decode_cdfh(cd + pos, cd_size - pos, &entry);
+		if (len == 0)
+			return -2;
+
+		wide |= entry.uncomp_size > UINT32_MAX;
+		names_size += entry.file_name_len + 1;
+		pos += len;
+	}
+
+	if (alloc_entry_table(archive, wide, names_size) != 0)
+		return -1;
+
+	return parse_entries(archive, 0);
+}
+
+/*
+ * Lazy mode sizes the table and names for the whole central directory but
+ * decodes nothing: pages are only touched as windows get parsed.
+ */
+static int8_t prepare_lazy_table(ZipArchive *archive)
+{
+	uint64_t count = archive->entry_count;
+	size_t names_cap = archive->central_dir_size -
+			   count * (CDFH_FIXED_SIZE - 1);
+
+	if (alloc_entry_table(archive, archive->map_size > UINT32_MAX,
+			      names_cap) != 0)
+		return -1;
+
+	archive->lazy = true;
+	return alloc_name_hash(archive);
+}
+
+static size_t put_varint(unsigned char *p, size_t value)
+{
+	size_t n = 0;
+
+	for (; value >= 0x80; value >>= 7)
+		p[n++] = value | 0x80;
+	p[n++] = value;
+	return n;
+}
+
+static size_t get_varint(const unsigned char **p)
+{
+	size_t value = 0;
+
+	for (unsigned shift = 0;; shift += 7) {
+		unsigned char byte = *(*p)++;
+		value |= (size_t)(byte & 0x7F) << shift;
+		if (byte < 0x80)
+			return value;
+	}
+}
+
+static size_t common_prefix(const unsigned char *a, size_t a_len,
+			    const unsigned char *b, size_t b_len)
+{
+	size_t len = a_len < b_len ? a_len : b_len, i = 0;
+
+	for (; i + 8 <= len; i += 8) {
+		uint64_t diff = read_u64(a, i) ^ read_u64(b, i);
+		if (diff != 0)
+			return i + __builtin_ctzll(diff) / 8;
+	}
+	while (i < len && a[i] == b[i])
+		i++;
+	return i;
+}
+
+/*
+ * Sorts the names and front-codes them in blocks of FC_BLOCK: the first name
+ * of a block is stored whole, as a restart point for binary search, and
+ * each following one as the length it shares with its predecessor plus the
+ * rest. The raw names pool and the name hash are dropped.
+ */
+static int8_t build_front_coded(ZipArchive *archive)
+{
+	uint64_t count = archive->entry_count;
+	uint64_t nblocks = (count + FC_BLOCK - 1) / FC_BLOCK;
+
+	archive->fc_entry = malloc(count * sizeof(*archive->fc_entry));
+	archive->fc_restarts = malloc(nblocks * sizeof(*archive->fc_restarts));
+	archive->fc_names = malloc(archive->names_size + 6 * count);
+	if (archive->fc_entry == NULL || archive->fc_restarts == NULL ||
+	    archive->fc_names == NULL) {
+		perror("MALLOC");
+		return -1;
+	}
+
+	for (uint64_t i = 0; i < count; i++)
+		archive->fc_entry[i] = i;
+	qsort_r(archive->fc_entry, count, sizeof(*archive->fc_entry),
+		archive->table->compare_names, archive);
+
+	const unsigned char *prev = NULL;
+	size_t prev_len = 0, pos = 0;
+	for (uint64_t r = 0; r < count; r++) {
+		uint32_t index = archive->fc_entry[r];
+		const unsigned char *name =
+			(const unsigned char *)archive->names +
+			archive->table->name_offset(archive->entries, index);
+		ZipEntry entry;
+		size_t shared = 0;
+
+		archive->table->load(archive->entries, index, &entry);
+		size_t len = entry.file_name_len;
+
+		if (r % FC_BLOCK == 0)
+			archive->fc_restarts[r / FC_BLOCK] = pos;
+		else
+			shared = common_prefix(prev, prev_len, name, len);
+
+		if (r % FC_BLOCK != 0)
+			pos += put_varint(archive->fc_names + pos, shared);
+		pos += put_varint(archive->fc_names + pos, len - shared);
+		memcpy(archive->fc_names + pos, name + shared, len - shared);
+		pos += len - shared;
+
+		prev = name;
+		prev_len = len;
+	}
+
+	/* Sorted positions replace pool offsets once the pool is unused */
+	for (uint64_t r = 0; r < count; r++)
+		archive->table->set_name_offset(archive->entries,
+						archive->fc_entry[r], r);
+
+	unsigned char *shrunk = realloc(archive->fc_names, pos ? pos : 1);
+	if (shrunk != NULL)
+		archive->fc_names = shrunk;
+	void *table = realloc(archive->entries,
+			      count * archive->table->record_size);
+	if (table != NULL)
+		archive->entries = table;
+	archive->names = NULL;
+
+	archive->front_coded = true;
+	archive->names_size = pos + nblocks * sizeof(*archive->fc_restarts) +
+			      count * sizeof(*archive->fc_entry);
+	return 0;
+}
+
 ZipArchive *openzip(const char *filename)
+{
+	return openzip_ex(filename, NULL);
+}
+
+ZipArchive *openzip_ex(const char *filename, const ZipOpenOptions *opts)
 {
 	FILE *fp;
 	EOCD eocd;
@@ -57,18 +593,21 @@ ZipArchive *openzip(const char *filename)
 
 	if (find_eocd(fp, &eocd) != 0) {
 		perror("FIND EOCD");
+		fclose(fp);
 		return NULL;
 	}
 
-	ZipArchive *archive = malloc(sizeof(*archive));
+	ZipArchive *archive = calloc(1, sizeof(*archive));
 	if (archive == NULL) {
+		fclose(fp);
 		return NULL;
 	}
 
 	archive->file_ptr = fp;
 	ZIP64_EOCD zip64_eocd;
-	int err;
-	if ((err = find_zip64_eocd(fp, &zip64_eocd)) == 0) {
+	if (fseek(fp, -(long)sizeof(eocd), SEEK_CUR) == 0 &&
+	    find_zip64_eocd(fp, &zip64_eocd) == 0) {
+		archive->is_zip64 = true;
 		archive->entry_count = zip64_eocd.total_entries;
 		archive->central_dir_offset = zip64_eocd.central_dir_offset;
 		archive->central_dir_size = zip64_eocd.central_dir_size;
@@ -79,6 +618,39 @@ ZipArchive *openzip(const char *filename)
 		archive->central_dir_size = eocd.central_dir_size;
 	}
 
+	int8_t err = map_archive(archive);
+	if (err == 0 && archive->entry_count >
+				archive->central_dir_size / CDFH_FIXED_SIZE)
+		err = -2;
+
+	if (err == 0 && load_embedded_index(archive) != 0) {
+		bool front_coded = opts != NULL && opts->front_coded &&
+				   archive->entry_count < UINT32_MAX;
+
+		if (opts != NULL && opts->scan_only) {
+			/* Nothing to build */
+		} else if (front_coded) {
+			err = build_entry_table(archive);
+			if (err == 0)
+				err = build_front_coded(archive);
+		} else if (opts != NULL && opts->lazy) {
+			err = prepare_lazy_table(archive);
+		} else {
+			err = build_entry_table(archive);
+			if (err == 0)
+				err = alloc_name_hash(archive);
+			if (err == 0)
+				archive->table->hash_insert(archive, 0,
+							    archive->parsed);
+		}
+	}
+	if (err != 0) {
+		if (err == -2)
+			fprintf(stderr, "%s: bad central directory\n", filename);
+		closezip(archive);
+		return NULL;
+	}
+
 	rewind(fp);
 	return archive;
 }
@@ -88,92 +660,512 @@ void closezip(ZipArchive *archive)
 	if (archive == NULL)
 		return;
 
+	if (archive->map != NULL)
+		munmap((void *)archive->map, archive->map_size);
+	free(archive->entries);
+	free(archive->name_slots);
+	free(archive->fc_names);
+	free(archive->fc_restarts);
+	free(archive->fc_entry);
 	fclose(archive->file_ptr);
 	free(archive);
 	archive = NULL;
 }
 
-int8_t find_eocd(FILE *fp, EOCD *eocd)
+uint64_t zip_entry_count(const ZipArchive *archive)
 {
-	if (fp == NULL || eocd == NULL)
+	return archive->entry_count;
+}
+
+/* Central directory record of an entry, found through the embedded index */
+static const unsigned char *indexed_cdfh(const ZipArchive *archive,
+					 uint64_t index, size_t *avail)
+{
+	uint64_t offset = read_u64(archive->index_entry_offset, 8 * index);
+	uint64_t end = archive->central_dir_offset + archive->central_dir_size;
+
+	if (offset < archive->central_dir_offset || offset >= end)
+		return NULL;
+
+	*avail = end - offset;
+	return archive->map + offset;
+}
+
+int8_t zip_get_entry(ZipArchive *archive, uint64_t index, ZipEntry *entry)
+{
+	if (archive == NULL || entry == NULL || index >= archive->entry_count)
 		return -1;
 
-	if (fseek(fp, 0, SEEK_END) != 0) {
-		perror("FSEEK");
+	if (archive->has_index) {
+		size_t avail;
+		const unsigned char *p = indexed_cdfh(archive, index, &avail);
+
+		return p != NULL && decode_cdfh(p, avail, entry) != 0 ? 0 : -2;
+	}
+
+	if (archive->table == NULL)
 		return -1;
+
+	int8_t err = parse_until(archive, index);
+	if (err == 0)
+		archive->table->load(archive->entries, index, entry);
+	return err;
+}
+
+static const char *front_coded_name(const ZipArchive *archive,
+				    uint64_t position, char *buf)
+{
+	if (buf == NULL)
+		return NULL;
+
+	uint64_t first = position - position % FC_BLOCK;
+	const unsigned char *p =
+		archive->fc_names + archive->fc_restarts[first / FC_BLOCK];
+	size_t len = get_varint(&p);
+
+	memcpy(buf, p, len);
+	p += len;
+	for (uint64_t r = first; r < position; r++) {
+		size_t shared = get_varint(&p);
+		size_t suffix = get_varint(&p);
+
+		memcpy(buf + shared, p, suffix);
+		p += suffix;
+		len = shared + suffix;
 	}
 
-	long file_size = ftell(fp);
-	if (file_size == -1L) {
-		perror("FTELL");
-		return -2;
+	buf[len] = '\0';
+	return buf;
+}
+
+const char *zip_entry_name(ZipArchive *archive, uint64_t index, char *buf)
+{
+	if (archive == NULL || index >= archive->entry_count ||
+	    (archive->table == NULL && !archive->has_index))
+		return NULL;
+
+	if (archive->front_coded)
+		return front_coded_name(
+			archive,
+			archive->table->name_offset(archive->entries, index),
+			buf);
+	if (archive->lazy) {
+		if (buf == NULL || parse_until(archive, index) != 0)
+			return NULL;
+
+		/* Widening the table moves the pool: hand out a copy */
+		uint64_t offset =
+			archive->table->name_offset(archive->entries, index);
+		return strcpy(buf, archive->names + offset);
 	}
+	if (!archive->has_index)
+		return archive->names +
+		       archive->table->name_offset(archive->entries, index);
+
+	ZipEntry entry;
+	size_t avail;
+	const unsigned char *p = indexed_cdfh(archive, index, &avail);
+	if (buf == NULL || p == NULL || decode_cdfh(p, avail, &entry) == 0)
+		return NULL;
 
-	uint32_t search_buffer_size = EOCD_MAX_COMMENT_LEN + EOCD_FIXED_SIZE;
-	long start_scan_pos = file_size - EOCD_FIXED_SIZE;
-	long search_limit = file_size - search_buffer_size;
-	if (search_limit < 0)
-		search_limit = 0;
+	memcpy(buf, p + CDFH_FIXED_SIZE, entry.file_name_len);
+	buf[entry.file_name_len] = '\0';
+	return buf;
+}
 
-	unsigned char temp_buffer[4];
-	for (long i = start_scan_pos; i >= search_limit; --i) {
-		if (fseek(fp, i, SEEK_SET) != 0)
-			return -1;
+static int64_t locate_indexed(ZipArchive *archive, const char *name,
+			      size_t len)
+{
+	uint64_t hash = zip_name_hash(name, len, archive->index_seed);
+	uint32_t bucket = zip_index_bucket(hash, archive->index_buckets);
+	uint32_t displacement = read_u32(archive->index_displacement,
+					 4 * (size_t)bucket);
+	uint32_t slot = zip_index_slot(hash, displacement,
+				       archive->index_slots);
+	uint32_t index = read_u32(archive->index_slot_entry, 4 * (size_t)slot);
+	if (index == ZIP_INDEX_EMPTY || index >= archive->entry_count)
+		return -1;
 
-		if (fread(temp_buffer, sizeof(temp_buffer), 1, fp) != 1)
-			return -1;
+	/* A perfect hash maps any name somewhere: confirm it is this one */
+	size_t avail;
+	const unsigned char *p = indexed_cdfh(archive, index, &avail);
+	if (p == NULL || avail < CDFH_FIXED_SIZE + len ||
+	    read_u16(p, 28) != len || memcmp(p + CDFH_FIXED_SIZE, name, len))
+		return -1;
+
+	return index;
+}
+
+/*
+ * Binary searches the restart points, then walks one block tracking how much
+ * of name the current entry matches, so names are compared but never decoded.
+ */
+static int64_t locate_front_coded(const ZipArchive *archive,
+				  const unsigned char *name, size_t len)
+{
+	uint64_t count = archive->entry_count;
+	uint64_t lo = 0, hi = (count + FC_BLOCK - 1) / FC_BLOCK;
+	const unsigned char *p;
+	size_t cur_len;
+
+	while (lo < hi) {
+		uint64_t mid = lo + (hi - lo) / 2;
+
+		p = archive->fc_names + archive->fc_restarts[mid];
+		cur_len = get_varint(&p);
+		int cmp = memcmp(p, name, cur_len < len ? cur_len : len);
+		if (cmp < 0 || (cmp == 0 && cur_len <= len))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == 0)
+		return -1;
 
-		if (read_u32(temp_buffer, 0) == EOCD_SIGNATURE) {
-			fseek(fp, i, SEEK_SET);
-			if (fread(eocd, sizeof(*eocd), 1, fp) != 1)
+	uint64_t r = (lo - 1) * FC_BLOCK;
+	uint64_t end = r + FC_BLOCK < count ? r + FC_BLOCK : count;
+	p = archive->fc_names + archive->fc_restarts[lo - 1];
+	cur_len = get_varint(&p);
+	size_t matched = common_prefix(p, cur_len, name, len);
+	if (matched == cur_len && matched == len)
+		return archive->fc_entry[r];
+	p += cur_len;
+
+	/* Names sharing more than matched with their predecessor still sort
+	 * before name; sharing less, they sort after it. */
+	while (++r < end) {
+		size_t shared = get_varint(&p);
+		size_t suffix = get_varint(&p);
+
+		if (shared < matched)
+			return -1;
+		if (shared == matched) {
+			size_t m = common_prefix(p, suffix, name + shared,
+						 len - shared);
+
+			matched += m;
+			cur_len = shared + suffix;
+			if (matched == cur_len && matched == len)
+				return archive->fc_entry[r];
+			if (matched < cur_len &&
+			    (matched == len || p[m] > name[matched]))
 				return -1;
+		}
+		p += suffix;
+	}
+
+	return -1;
+}
+
+int64_t zip_locate(ZipArchive *archive, const char *name)
+{
+	if (archive == NULL || name == NULL)
+		return -1;
+
+	size_t len = strlen(name);
+	if (len > ZIP_NAME_MAX)
+		return -1;
+
+	if (archive->has_index)
+		return locate_indexed(archive, name, len);
+	if (archive->front_coded)
+		return locate_front_coded(archive, (const unsigned char *)name,
+					  len);
+	if (archive->table == NULL)
+		return -1;
 
-			return 0;
+	/* Lazy mode decodes further windows until the name turns up */
+	int64_t index;
+	while ((index = archive->table->hash_locate(archive, name, len)) < 0 &&
+	       archive->parsed < archive->entry_count)
+		if (parse_until(archive, archive->parsed) != 0)
+			break;
+
+	return index;
+}
+
+ZipIterator *zip_iter_new(ZipArchive *archive)
+{
+	if (archive == NULL)
+		return NULL;
+
+	ZipIterator *it = malloc(sizeof(*it));
+	if (it == NULL) {
+		perror("MALLOC");
+		return NULL;
+	}
+
+	it->fd = fileno(archive->file_ptr);
+	it->window_pos = archive->central_dir_offset;
+	it->cd_end = archive->central_dir_offset + archive->central_dir_size;
+	it->left = archive->entry_count;
+	it->len = 0;
+	it->off = 0;
+
+	return it;
+}
+
+/* Slides the window to start at the next record */
+static int8_t iter_refill(ZipIterator *it)
+{
+	it->window_pos += it->off;
+	it->off = 0;
+	it->len = 0;
+
+	uint64_t want = it->cd_end - it->window_pos;
+	if (want > sizeof(it->window))
+		want = sizeof(it->window);
+
+	while (it->len < want) {
+		ssize_t n = pread(it->fd, it->window + it->len, want - it->len,
+				  it->window_pos + it->len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			perror("PREAD");
+			return -1;
 		}
+		if (n == 0)
+			return -2;
+		it->len += n;
 	}
 
-	return -2;
+	return 0;
 }
 
-int8_t find_zip64_eocd(FILE *fp, ZIP64_EOCD *eocd_out)
+int8_t zip_iter_next(ZipIterator *it, ZipEntryView *view)
 {
-	if (fp == NULL || eocd_out == NULL)
+	if (it == NULL || view == NULL)
 		return -1;
+	if (it->left == 0)
+		return 1;
+
+	size_t len = decode_cdfh(it->window + it->off, it->len - it->off,
+				 &view->entry);
+	if (len == 0) {
+		/* Either cut by the window edge or really malformed */
+		int8_t err = iter_refill(it);
+		if (err != 0)
+			return err;
+
+		len = decode_cdfh(it->window, it->len, &view->entry);
+		if (len == 0)
+			return -2;
+	}
+
+	view->name = (const char *)it->window + it->off + CDFH_FIXED_SIZE;
+	it->off += len;
+	it->left--;
+
+	return 0;
+}
+
+void zip_iter_free(ZipIterator *it)
+{
+	free(it);
+}
+
+int8_t zip_list_archive(ZipArchive *archive)
+{
+	ZipIterator *it = zip_iter_new(archive);
+	ZipEntryView view;
+	uint64_t total = 0, count = 0;
+	int8_t err;
 
-	if (fseek(fp, -sizeof(ZIP64_EOCD_LOCATOR), SEEK_CUR) != 0)
+	if (it == NULL)
 		return -1;
 
-	ZIP64_EOCD_LOCATOR locator;
-	if (fread(&locator, sizeof(locator), 1, fp) != 1)
+	printf("  Length      Date    Time    Name\n"
+	       "---------  ---------- -----   ----\n");
+	while ((err = zip_iter_next(it, &view)) == 0) {
+		uint16_t date = view.entry.last_mod_file_date;
+		uint16_t time = view.entry.last_mod_file_time;
+
+		printf("%9" PRIu64 "  %04u-%02u-%02u %02u:%02u   %.*s\n",
+		       view.entry.uncomp_size, (date >> 9) + 1980,
+		       (date >> 5) & 0xF, date & 0x1F, time >> 11,
+		       (time >> 5) & 0x3F, view.entry.file_name_len, view.name);
+		total += view.entry.uncomp_size;
+		count++;
+	}
+	printf("---------                     -------\n"
+	       "%9" PRIu64 "                     %" PRIu64 " files\n",
+	       total, count);
+
+	zip_iter_free(it);
+	if (err < 0)
+		fprintf(stderr, "bad central directory\n");
+
+	return err < 0 ? err : 0;
+}
+
+/* The last i in [limit, end) with the EOCD signature at tail + i, or -1 */
+static int64_t scan_back(const unsigned char *tail, size_t limit, size_t end)
+{
+	for (size_t i = end; i-- > limit;)
+		if (read_u32(tail, i) == EOCD_SIGNATURE)
+			return i;
+
+	return -1;
+}
+
+#ifdef HAVE_AVX2_SCAN
+/*
+ * 32 candidate offsets at a time, one compare per signature byte. Reads
+ * up to 3 bytes past end, which the fixed part of the record covers.
+ */
+__attribute__((target("avx2"))) static int64_t
+scan_back_avx2(const unsigned char *tail, size_t limit, size_t end)
+{
+	const __m256i sig[4] = {
+		_mm256_set1_epi8(EOCD_SIGNATURE & 0xFF),
+		_mm256_set1_epi8((EOCD_SIGNATURE >> 8) & 0xFF),
+		_mm256_set1_epi8((EOCD_SIGNATURE >> 16) & 0xFF),
+		_mm256_set1_epi8(EOCD_SIGNATURE >> 24),
+	};
+
+	for (; end >= limit + 32; end -= 32) {
+		const unsigned char *p = tail + end - 32;
+		__m256i m = _mm256_set1_epi8(-1);
+
+		for (int k = 0; k < 4; k++) {
+			__m256i v = _mm256_loadu_si256((const __m256i *)(p + k));
+			m = _mm256_and_si256(m, _mm256_cmpeq_epi8(v, sig[k]));
+		}
+		uint32_t bits = _mm256_movemask_epi8(m);
+		if (bits != 0)
+			return end - 32 + 31 - __builtin_clz(bits);
+	}
+
+	return scan_back(tail, limit, end);
+}
+#endif
+
+static int64_t (*scan_eocd)(const unsigned char *tail, size_t limit,
+			    size_t end) = scan_back;
+
+__attribute__((constructor)) static void unzip_init(void)
+{
+#ifdef HAVE_AVX2_SCAN
+	if (cpu_level() >= CPU_AVX2)
+		scan_eocd = scan_back_avx2;
+#endif
+}
+
+const char *zip_scan_kernel(void)
+{
+	return scan_eocd == scan_back ? "generic" : "avx2";
+}
+
+int64_t zip_scan_eocd(const unsigned char *tail, size_t len)
+{
+	if (tail == NULL || len < EOCD_FIXED_SIZE)
 		return -1;
 
-	if (locator.signature != ZIP64_EOCD_LOCATOR_SIGNATURE)
+	size_t limit = 0;
+	if (len > EOCD_MAX_COMMENT_LEN + EOCD_FIXED_SIZE)
+		limit = len - (EOCD_MAX_COMMENT_LEN + EOCD_FIXED_SIZE);
+
+	return scan_eocd(tail, limit, len - EOCD_FIXED_SIZE + 1);
+}
+
+int8_t zip_parse_zip64_locator(const unsigned char *p, uint64_t *record_offset)
+{
+	if (read_u32(p, 0) != ZIP64_EOCD_LOCATOR_SIGNATURE)
 		return -2;
 
-	if (fseek(fp, locator.zip64_eocd_offset, SEEK_SET) != 0)
+	*record_offset = read_u64(p, 8);
+	return 0;
+}
+
+int8_t zip_parse_zip64_eocd(const unsigned char *p, ZIP64_EOCD *eocd)
+{
+	if (read_u32(p, 0) != ZIP64_EOCD_SIGNATURE)
+		return -2;
+
+	memcpy(eocd, p, sizeof(*eocd));
+	return 0;
+}
+
+int8_t find_eocd(FILE *fp, EOCD *eocd)
+{
+	if (fp == NULL || eocd == NULL)
 		return -1;
 
-	uint32_t final_signature;
-	if (fread(&final_signature, sizeof(final_signature), 1, fp) != 1)
+	if (fseek(fp, 0, SEEK_END) != 0) {
+		perror("FSEEK");
 		return -1;
+	}
 
-	if (final_signature != ZIP64_EOCD_SIGNATURE)
+	long file_size = ftell(fp);
+	if (file_size == -1L) {
+		perror("FTELL");
 		return -2;
+	}
+
+	/* One read of the whole search range instead of a seek per byte */
+	size_t len = EOCD_MAX_COMMENT_LEN + EOCD_FIXED_SIZE;
+	if ((long)len > file_size)
+		len = file_size;
+
+	unsigned char *tail = malloc(len ? len : 1);
+	if (tail == NULL)
+		return -1;
+
+	int8_t err = -1;
+	if (fseek(fp, file_size - len, SEEK_SET) != 0 ||
+	    fread(tail, 1, len, fp) != len)
+		goto out;
+
+	int64_t i = zip_scan_eocd(tail, len);
+	err = -2;
+	if (i < 0)
+		goto out;
+
+	memcpy(eocd, tail + i, sizeof(*eocd));
+	err = 0;
+	if (fseek(fp, file_size - len + i + sizeof(*eocd), SEEK_SET) != 0)
+		err = -1;
+out:
+	free(tail);
+	return err;
+}
+
+int8_t find_zip64_eocd(FILE *fp, ZIP64_EOCD *eocd_out)
+{
+	if (fp == NULL || eocd_out == NULL)
+		return -1;
 
-	if (fseek(fp, -sizeof(final_signature), SEEK_CUR) != 0)
+	if (fseek(fp, -(long)ZIP64_EOCD_LOCATOR_SIZE, SEEK_CUR) != 0)
 		return -1;
 
-	if (fread(eocd_out, sizeof(*eocd_out), 1, fp) != 1)
+	unsigned char locator[ZIP64_EOCD_LOCATOR_SIZE];
+	if (fread(locator, sizeof(locator), 1, fp) != 1)
 		return -1;
 
-	return 0;
+	uint64_t record_offset;
+	if (zip_parse_zip64_locator(locator, &record_offset) != 0)
+		return -2;
+
+	unsigned char record[ZIP64_EOCD_FIXED_SIZE];
+	if (fseek(fp, record_offset, SEEK_SET) != 0 ||
+	    fread(record, sizeof(record), 1, fp) != 1)
+		return -1;
+
+	return zip_parse_zip64_eocd(record, eocd_out);
 }
 
 void zip_inspect_archive(ZipArchive *archive)
 {
-	printf("ZIP64: %d\tEC: %llu\tCDO: %llu\tCDS: %llu\n", archive->is_zip64,
-	       archive->entry_count, archive->central_dir_offset,
-	       archive->central_dir_size);
+	printf("ZIP64: %d\tEC: %" PRIu64 "\tCDO: %" PRIu64 "\tCDS: %" PRIu64
+	       "\tIDX: %s\tNAMES: %" PRIu64 "\tTABLE: %u\n",
+	       archive->is_zip64, archive->entry_count,
+	       archive->central_dir_offset, archive->central_dir_size,
+	       archive->has_index ? "embedded" :
+	       archive->front_coded ? "front-coded" :
+	       archive->lazy ? "lazy" : "built",
+	       archive->names_size,
+	       archive->table != NULL ? archive->table->width : 0);
 }
 
 /* static uint32_t */
@@ -0,0 +1,870 @@
+/*
+ * zipwrite.c -- Zip Writer
+ * Copyright (C) 2025 Jacopo Costantini
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include "zipwrite.h"
+#include "crc32.h"
+#include "deflate.h"
+#include "unzip.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define VERSION_MADE_BY ((3 << 8) | 45) /* Unix, spec 4.5 */
+#define VERSION_STORE 10
+#define VERSION_DEFLATE 20
+#define VERSION_ZIP64 45
+#define EXTERNAL_ATTR_DIR 0x10
+
+#define INDEX_SEEDS 8
+#define INDEX_MAX_DISPLACEMENT (1U << 30)
+#define INDEX_MAX_BUCKET 64
+
+#define SAMPLE_SIZE 4096
+#define SAMPLE_COUNT 4
+#define SAMPLE_MIN_FILE (16 * SAMPLE_SIZE) /* smaller files just compress */
+#define SAMPLE_STORE_RATIO 970 /* per mille: store samples shrinking less */
+#define SAMPLE_BOUND (SAMPLE_SIZE + (SAMPLE_SIZE >> 6) + 64)
+
+enum decision {
+	DECIDE_NONE, /* directory, empty file or level 0 */
+	DECIDE_COMPRESSED,
+	DECIDE_STORED_SAMPLE, /* samples did not shrink, never compressed */
+	DECIDE_STORED_NO_GAIN, /* compressed, but no smaller than stored */
+};
+
+struct entry {
+	char *name; /* archive path, ending in '/' for directories */
+	char *path; /* file to read, NULL for directories */
+	uint32_t mode;
+	uint16_t mod_time;
+	uint16_t mod_date;
+
+	/* Filled by the compression workers */
+	const uint8_t *data;
+	void *owned; /* buffer or mapping behind data */
+	size_t owned_len;
+	bool mapped;
+	uint64_t comp_size;
+	uint64_t uncomp_size;
+	uint32_t crc32;
+	uint16_t method;
+	enum decision decision;
+	uint16_t sample_ratio; /* per mille, 0 when not sampled */
+	bool done;
+	bool failed;
+
+	uint64_t offset; /* of the local file header */
+};
+
+struct entry_list {
+	struct entry *items;
+	size_t count;
+	size_t cap;
+};
+
+struct job_queue {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct entry *entries;
+	size_t count;
+	size_t next; /* next entry to compress */
+	size_t written; /* entries already in the archive */
+	size_t ahead; /* entries compressed but not written, at most */
+	int level;
+	bool sample;
+	bool rsyncable;
+};
+
+static void dos_time(time_t t, uint16_t *dos_time, uint16_t *dos_date)
+{
+	struct tm tm;
+
+	if (localtime_r(&t, &tm) == NULL || tm.tm_year < 80) {
+		*dos_time = 0;
+		*dos_date = (1 << 5) | 1;
+		return;
+	}
+
+	*dos_time = (tm.tm_hour << 11) | (tm.tm_min << 5) | (tm.tm_sec / 2);
+	*dos_date = ((tm.tm_year - 80) << 9) | ((tm.tm_mon + 1) << 5) |
+		    tm.tm_mday;
+}
+
+static int8_t add_entry(struct entry_list *list, const char *path,
+			const struct stat *st)
+{
+	if (list->count == list->cap) {
+		size_t cap = list->cap ? list->cap * 2 : 64;
+		struct entry *items = realloc(list->items, cap * sizeof(*items));
+		if (items == NULL)
+			return -1;
+		list->items = items;
+		list->cap = cap;
+	}
+
+	/* Archive names are relative: drop leading "/" and "./" */
+	const char *name = path;
+	for (;;) {
+		if (name[0] == '/')
+			name++;
+		else if (name[0] == '.' && name[1] == '/')
+			name += 2;
+		else
+			break;
+	}
+
+	bool is_dir = S_ISDIR(st->st_mode);
+	size_t name_len = strlen(name);
+	if (name_len == 0)
+		return 0;
+
+	struct entry *e = &list->items[list->count];
+	memset(e, 0, sizeof(*e));
+	e->name = malloc(name_len + 2);
+	e->path = is_dir ? NULL : strdup(path);
+	if (e->name == NULL || (!is_dir && e->path == NULL)) {
+		free(e->name);
+		free(e->path);
+		return -1;
+	}
+
+	memcpy(e->name, name, name_len + 1);
+	if (is_dir && name[name_len - 1] != '/')
+		strcpy(e->name + name_len, "/");
+	e->mode = st->st_mode;
+	dos_time(st->st_mtime, &e->mod_time, &e->mod_date);
+	list->count++;
+
+	return 0;
+}
+
+static int8_t collect(struct entry_list *list, const char *path)
+{
+	struct stat st;
+
+	if (lstat(path, &st) != 0) {
+		perror(path);
+		return -1;
+	}
+
+	if (S_ISREG(st.st_mode))
+		return add_entry(list, path, &st);
+
+	if (!S_ISDIR(st.st_mode)) {
+		fprintf(stderr, "%s: skipping, not a regular file\n", path);
+		return 0;
+	}
+
+	if (add_entry(list, path, &st) != 0)
+		return -1;
+
+	struct dirent **names;
+	int n = scandir(path, &names, NULL, alphasort);
+	if (n < 0) {
+		perror(path);
+		return -1;
+	}
+
+	int8_t err = 0;
+	for (int i = 0; i < n; i++) {
+		const char *d = names[i]->d_name;
+		if (err == 0 && strcmp(d, ".") != 0 && strcmp(d, "..") != 0) {
+			size_t len = strlen(path) + strlen(d) + 2;
+			char *child = malloc(len);
+			if (child == NULL) {
+				err = -1;
+			} else {
+				snprintf(child, len, "%s%s%s", path,
+					 path[strlen(path) - 1] == '/' ? "" :
+									  "/",
+					 d);
+				err = collect(list, child);
+				free(child);
+			}
+		}
+		free(names[i]);
+	}
+	free(names);
+
+	return err;
+}
+
+static void release_data(struct entry *e)
+{
+	if (e->owned == NULL)
+		return;
+
+	if (e->mapped)
+		munmap(e->owned, e->owned_len);
+	else
+		free(e->owned);
+	e->owned = NULL;
+	e->data = NULL;
+}
+
+/*
+ * Compresses SAMPLE_COUNT slices spread over data with the fastest level
+ * and returns their compressed size in per mille of the input.
+ */
+static unsigned sample_ratio(DeflateEncoder *probe, const uint8_t *data,
+			     size_t size)
+{
+	uint8_t out[SAMPLE_BOUND];
+	size_t total = 0;
+
+	for (size_t i = 0; i < SAMPLE_COUNT; i++) {
+		size_t at = (size - SAMPLE_SIZE) * i / (SAMPLE_COUNT - 1);
+		size_t comp = deflate_compress(probe, data + at, SAMPLE_SIZE,
+					       out, sizeof(out));
+		total += comp != 0 ? comp : SAMPLE_SIZE;
+	}
+
+	return total * 1000 / (SAMPLE_SIZE * SAMPLE_COUNT);
+}
+
+/* Reads, checksums and compresses one entry, storing what won't shrink */
+static void compress_entry(DeflateEncoder *enc, DeflateEncoder *probe,
+			   int level, struct entry *e)
+{
+	e->method = ZIP_METHOD_STORE;
+	if (e->path == NULL)
+		return;
+
+	int fd = open(e->path, O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		perror(e->path);
+		if (fd >= 0)
+			close(fd);
+		e->failed = true;
+		return;
+	}
+
+	size_t size = st.st_size;
+	if (size == 0) {
+		close(fd);
+		return;
+	}
+
+	void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		perror(e->path);
+		e->failed = true;
+		return;
+	}
+	madvise(map, size, MADV_SEQUENTIAL);
+
+	e->data = map;
+	e->owned = map;
+	e->owned_len = size;
+	e->mapped = true;
+	e->uncomp_size = size;
+	e->comp_size = size;
+	e->crc32 = crc32_update(0, map, size);
+
+	if (level == DEFLATE_LEVEL_STORE || enc == NULL)
+		return;
+
+	e->decision = DECIDE_STORED_NO_GAIN;
+	if (probe != NULL && size >= SAMPLE_MIN_FILE) {
+		e->sample_ratio = sample_ratio(probe, map, size);
+		if (e->sample_ratio >= SAMPLE_STORE_RATIO) {
+			e->decision = DECIDE_STORED_SAMPLE;
+			return;
+		}
+	}
+
+	size_t cap = deflate_bound(size);
+	uint8_t *out = malloc(cap);
+	if (out == NULL)
+		return;
+
+	size_t comp = deflate_compress(enc, map, size, out, cap);
+	if (comp == 0 || comp >= size) {
+		free(out);
+		return;
+	}
+
+	munmap(map, size);
+	e->data = out;
+	e->owned = out;
+	e->owned_len = cap;
+	e->mapped = false;
+	e->comp_size = comp;
+	e->method = ZIP_METHOD_DEFLATE;
+	e->decision = DECIDE_COMPRESSED;
+}
+
+static void *compress_worker(void *arg)
+{
+	struct job_queue *q = arg;
+	DeflateEncoder *enc = NULL;
+	DeflateEncoder *probe = NULL;
+
+	if (q->level != DEFLATE_LEVEL_STORE)
+		enc = deflate_encoder_new(q->level);
+	deflate_set_rsyncable(enc, q->rsyncable);
+	if (q->level != DEFLATE_LEVEL_STORE && q->sample)
+		probe = deflate_encoder_new(DEFLATE_LEVEL_FASTEST);
+
+	pthread_mutex_lock(&q->lock);
+	for (;;) {
+		while (q->next < q->count && q->next >= q->written + q->ahead)
+			pthread_cond_wait(&q->cond, &q->lock);
+		if (q->next >= q->count)
+			break;
+
+		struct entry *e = &q->entries[q->next++];
+		pthread_mutex_unlock(&q->lock);
+
+		compress_entry(enc, probe, q->level, e);
+
+		pthread_mutex_lock(&q->lock);
+		e->done = true;
+		pthread_cond_broadcast(&q->cond);
+	}
+	pthread_mutex_unlock(&q->lock);
+
+	deflate_encoder_free(enc);
+	deflate_encoder_free(probe);
+	return NULL;
+}
+
+static bool needs_zip64(const struct entry *e)
+{
+	return e->uncomp_size >= ZIP64_LIMIT_U32 ||
+	       e->comp_size >= ZIP64_LIMIT_U32;
+}
+
+static uint16_t version_needed(const struct entry *e, bool zip64)
+{
+	if (zip64)
+		return VERSION_ZIP64;
+	if (e->method == ZIP_METHOD_DEFLATE || e->path == NULL)
+		return VERSION_DEFLATE;
+
+	return VERSION_STORE;
+}
+
+static int8_t write_local_entry(FILE *fp, uint64_t *offset, struct entry *e)
+{
+	unsigned char header[LFH_FIXED_SIZE];
+	unsigned char extra[20];
+	size_t name_len = strlen(e->name);
+	bool zip64 = needs_zip64(e);
+
+	e->offset = *offset;
+	write_u32(header, 0, LFH_SIGNATURE);
+	write_u16(header, 4, version_needed(e, zip64));
+	write_u16(header, 6, 0);
+	write_u16(header, 8, e->method);
+	write_u16(header, 10, e->mod_time);
+	write_u16(header, 12, e->mod_date);
+	write_u32(header, 14, e->crc32);
+	write_u32(header, 18, zip64 ? ZIP64_LIMIT_U32 : e->comp_size);
+	write_u32(header, 22, zip64 ? ZIP64_LIMIT_U32 : e->uncomp_size);
+	write_u16(header, 26, name_len);
+	write_u16(header, 28, zip64 ? sizeof(extra) : 0);
+
+	write_u16(extra, 0, ZIP64_EXTRA_ID);
+	write_u16(extra, 2, 16);
+	write_u64(extra, 4, e->uncomp_size);
+	write_u64(extra, 12, e->comp_size);
+
+	if (fwrite(header, sizeof(header), 1, fp) != 1 ||
+	    fwrite(e->name, name_len, 1, fp) != 1 ||
+	    (zip64 && fwrite(extra, sizeof(extra), 1, fp) != 1) ||
+	    (e->comp_size > 0 && fwrite(e->data, e->comp_size, 1, fp) != 1))
+		return -1;
+
+	*offset += sizeof(header) + name_len + (zip64 ? sizeof(extra) : 0) +
+		   e->comp_size;
+	return 0;
+}
+
+static size_t central_extra_len(const struct entry *e)
+{
+	size_t len = 8 * ((e->uncomp_size >= ZIP64_LIMIT_U32) +
+			  (e->comp_size >= ZIP64_LIMIT_U32) +
+			  (e->offset >= ZIP64_LIMIT_U32));
+
+	return len != 0 ? len + 4 : 0;
+}
+
+static int8_t write_central_entry(FILE *fp, uint64_t *size,
+				  const struct entry *e)
+{
+	unsigned char header[CDFH_FIXED_SIZE];
+	unsigned char extra[28];
+	size_t name_len = strlen(e->name);
+	size_t extra_len = 4;
+	bool big_uncomp = e->uncomp_size >= ZIP64_LIMIT_U32;
+	bool big_comp = e->comp_size >= ZIP64_LIMIT_U32;
+	bool big_offset = e->offset >= ZIP64_LIMIT_U32;
+
+	if (big_uncomp) {
+		write_u64(extra, extra_len, e->uncomp_size);
+		extra_len += 8;
+	}
+	if (big_comp) {
+		write_u64(extra, extra_len, e->comp_size);
+		extra_len += 8;
+	}
+	if (big_offset) {
+		write_u64(extra, extra_len, e->offset);
+		extra_len += 8;
+	}
+	if (extra_len == 4)
+		extra_len = 0;
+	write_u16(extra, 0, ZIP64_EXTRA_ID);
+	write_u16(extra, 2, extra_len - 4);
+
+	uint32_t attr = (e->mode & 0xFFFF) << 16;
+	if (e->path == NULL)
+		attr |= EXTERNAL_ATTR_DIR;
+
+	write_u32(header, 0, CDFH_SIGNATURE);
+	write_u16(header, 4, VERSION_MADE_BY);
+	write_u16(header, 6, version_needed(e, extra_len != 0));
+	write_u16(header, 8, 0);
+	write_u16(header, 10, e->method);
+	write_u16(header, 12, e->mod_time);
+	write_u16(header, 14, e->mod_date);
+	write_u32(header, 16, e->crc32);
+	write_u32(header, 20, big_comp ? ZIP64_LIMIT_U32 : e->comp_size);
+	write_u32(header, 24, big_uncomp ? ZIP64_LIMIT_U32 : e->uncomp_size);
+	write_u16(header, 28, name_len);
+	write_u16(header, 30, extra_len);
+	write_u16(header, 32, 0);
+	write_u16(header, 34, 0);
+	write_u16(header, 36, 0);
+	write_u32(header, 38, attr);
+	write_u32(header, 42, big_offset ? ZIP64_LIMIT_U32 : e->offset);
+
+	if (fwrite(header, sizeof(header), 1, fp) != 1 ||
+	    fwrite(e->name, name_len, 1, fp) != 1 ||
+	    (extra_len && fwrite(extra, extra_len, 1, fp) != 1))
+		return -1;
+
+	*size += sizeof(header) + name_len + extra_len;
+	return 0;
+}
+
+static int compare_buckets(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x < y) - (x > y);
+}
+
+/*
+ * Hash and displace: names fall into buckets of about ZIP_INDEX_BUCKET_SIZE,
+ * then each bucket, largest first, searches for the displacement that sends
+ * all of its names to free slots. Duplicate names keep their first entry.
+ * Returns false when this seed cannot separate the names.
+ */
+static bool place_names(const struct entry_list *list, uint64_t seed,
+			uint32_t nbuckets, uint32_t *displacement,
+			uint32_t *slot_entry, uint64_t *hashes,
+			uint32_t *members, uint64_t *order)
+{
+	uint32_t nslots = list->count;
+
+	memset(order, 0, nbuckets * sizeof(*order));
+	for (size_t i = 0; i < list->count; i++) {
+		const char *name = list->items[i].name;
+
+		hashes[i] = zip_name_hash(name, strlen(name), seed);
+		order[zip_index_bucket(hashes[i], nbuckets)] += 1ULL << 32;
+	}
+
+	/* Bucket starts in members, kept in the low half of order */
+	uint32_t start = 0;
+	for (uint32_t b = 0; b < nbuckets; b++) {
+		order[b] |= start;
+		start += order[b] >> 32;
+	}
+	for (size_t i = 0; i < list->count; i++) {
+		uint64_t *o = &order[zip_index_bucket(hashes[i], nbuckets)];
+
+		members[(uint32_t)*o] = i;
+		*o += 1;
+	}
+	for (uint32_t b = 0; b < nbuckets; b++) {
+		uint32_t size = order[b] >> 32;
+
+		displacement[b] = 0;
+		order[b] = (uint64_t)size << 32 | (uint32_t)(order[b] - size);
+	}
+	qsort(order, nbuckets, sizeof(*order), compare_buckets);
+
+	memset(slot_entry, 0xFF, nslots * sizeof(*slot_entry));
+	for (uint32_t b = 0; b < nbuckets && (order[b] >> 32) != 0; b++) {
+		uint32_t *keys = &members[(uint32_t)order[b]];
+		uint32_t size = order[b] >> 32;
+		uint32_t slots[INDEX_MAX_BUCKET];
+		uint32_t n = 0;
+
+		/* Equal hashes can only be told apart by a new seed */
+		for (uint32_t i = 0; i < size; i++) {
+			uint32_t j = 0;
+			while (j < n && hashes[keys[j]] != hashes[keys[i]])
+				j++;
+			if (j == n)
+				keys[n++] = keys[i];
+			else if (strcmp(list->items[keys[j]].name,
+					list->items[keys[i]].name) != 0)
+				return false;
+		}
+		if (n > INDEX_MAX_BUCKET)
+			return false;
+
+		uint32_t d;
+		for (d = 0; d < INDEX_MAX_DISPLACEMENT; d++) {
+			uint32_t i;
+			for (i = 0; i < n; i++) {
+				slots[i] = zip_index_slot(hashes[keys[i]], d,
+							  nslots);
+				if (slot_entry[slots[i]] != ZIP_INDEX_EMPTY)
+					break;
+
+				uint32_t j = 0;
+				while (j < i && slots[j] != slots[i])
+					j++;
+				if (j < i)
+					break;
+			}
+			if (i == n)
+				break;
+		}
+		if (d == INDEX_MAX_DISPLACEMENT)
+			return false;
+
+		uint32_t bucket = zip_index_bucket(hashes[keys[0]], nbuckets);
+		displacement[bucket] = d;
+		for (uint32_t i = 0; i < n; i++)
+			slot_entry[slots[i]] = keys[i];
+	}
+
+	return true;
+}
+
+/*
+ * Writes the name index record that ends right where the central directory
+ * will start, so the entry offsets it holds can be computed up front.
+ */
+static int8_t write_name_index(FILE *fp, uint64_t *offset,
+			       const struct entry_list *list)
+{
+	uint32_t count = list->count;
+	uint32_t nbuckets = count / ZIP_INDEX_BUCKET_SIZE + 1;
+	size_t slot_pos = ZIP_INDEX_HEADER_SIZE + 4 * (size_t)nbuckets;
+	size_t offset_pos = slot_pos + 4 * (size_t)count;
+	size_t size = offset_pos + 8 * (size_t)count + ZIP_INDEX_TRAILER_SIZE;
+	int8_t err = -1;
+
+	uint32_t *displacement = malloc(nbuckets * sizeof(*displacement));
+	uint32_t *slot_entry = malloc(count * sizeof(*slot_entry));
+	uint64_t *hashes = malloc(count * sizeof(*hashes));
+	uint32_t *members = malloc(count * sizeof(*members));
+	uint64_t *order = malloc(nbuckets * sizeof(*order));
+	unsigned char *record = malloc(size);
+	if (displacement == NULL || slot_entry == NULL || hashes == NULL ||
+	    members == NULL || order == NULL || record == NULL)
+		goto out;
+
+	uint64_t seed;
+	for (seed = 0; seed < INDEX_SEEDS; seed++)
+		if (place_names(list, seed, nbuckets, displacement, slot_entry,
+				hashes, members, order))
+			break;
+	if (seed == INDEX_SEEDS) {
+		fprintf(stderr, "cannot build the name index, skipping it\n");
+		err = 0;
+		goto out;
+	}
+
+	write_u32(record, 0, ZIP_INDEX_SIGNATURE);
+	write_u16(record, 4, ZIP_INDEX_VERSION);
+	write_u16(record, 6, 0);
+	write_u64(record, 8, count);
+	write_u64(record, 16, *offset + size);
+	write_u32(record, 24, nbuckets);
+	write_u32(record, 28, count);
+	write_u64(record, 32, seed);
+	for (uint32_t b = 0; b < nbuckets; b++)
+		write_u32(record, ZIP_INDEX_HEADER_SIZE + 4 * (size_t)b,
+			  displacement[b]);
+
+	uint64_t cd_offset = *offset + size;
+	for (uint32_t i = 0; i < count; i++) {
+		const struct entry *e = &list->items[i];
+
+		write_u32(record, slot_pos + 4 * (size_t)i, slot_entry[i]);
+		write_u64(record, offset_pos + 8 * (size_t)i, cd_offset);
+		cd_offset += CDFH_FIXED_SIZE + strlen(e->name) +
+			     central_extra_len(e);
+	}
+
+	write_u64(record, size - ZIP_INDEX_TRAILER_SIZE, size);
+	write_u32(record, size - 8, 0);
+	write_u32(record, size - 4, ZIP_INDEX_SIGNATURE);
+
+	err = fwrite(record, size, 1, fp) == 1 ? 0 : -1;
+	if (err == 0)
+		*offset += size;
+out:
+	free(displacement);
+	free(slot_entry);
+	free(hashes);
+	free(members);
+	free(order);
+	free(record);
+	return err;
+}
+
+static int8_t write_end_records(FILE *fp, uint64_t count, uint64_t cd_offset,
+				uint64_t cd_size)
+{
+	unsigned char eocd[EOCD_FIXED_SIZE];
+	bool zip64 = count >= ZIP64_LIMIT_U16 ||
+		     cd_offset >= ZIP64_LIMIT_U32 || cd_size >= ZIP64_LIMIT_U32;
+
+	if (zip64) {
+		unsigned char record[ZIP64_EOCD_FIXED_SIZE];
+		unsigned char locator[ZIP64_EOCD_LOCATOR_SIZE];
+		uint64_t record_offset = cd_offset + cd_size;
+
+		write_u32(record, 0, ZIP64_EOCD_SIGNATURE);
+		write_u64(record, 4, ZIP64_EOCD_FIXED_SIZE - 12);
+		write_u16(record, 12, VERSION_MADE_BY);
+		write_u16(record, 14, VERSION_ZIP64);
+		write_u32(record, 16, 0);
+		write_u32(record, 20, 0);
+		write_u64(record, 24, count);
+		write_u64(record, 32, count);
+		write_u64(record, 40, cd_size);
+		write_u64(record, 48, cd_offset);
+
+		write_u32(locator, 0, ZIP64_EOCD_LOCATOR_SIGNATURE);
+		write_u32(locator, 4, 0);
+		write_u64(locator, 8, record_offset);
+		write_u32(locator, 16, 1);
+
+		if (fwrite(record, sizeof(record), 1, fp) != 1 ||
+		    fwrite(locator, sizeof(locator), 1, fp) != 1)
+			return -1;
+	}
+
+	write_u32(eocd, 0, EOCD_SIGNATURE);
+	write_u16(eocd, 4, 0);
+	write_u16(eocd, 6, 0);
+	write_u16(eocd, 8, zip64 ? ZIP64_LIMIT_U16 : count);
+	write_u16(eocd, 10, zip64 ? ZIP64_LIMIT_U16 : count);
+	write_u32(eocd, 12, zip64 ? ZIP64_LIMIT_U32 : cd_size);
+	write_u32(eocd, 16, zip64 ? ZIP64_LIMIT_U32 : cd_offset);
+	write_u16(eocd, 20, 0);
+
+	return fwrite(eocd, sizeof(eocd), 1, fp) == 1 ? 0 : -1;
+}
+
+static void report_entry(const struct entry *e)
+{
+	static const char *const verbs[] = {
+		[DECIDE_NONE] = "stored",
+		[DECIDE_COMPRESSED] = "deflated",
+		[DECIDE_STORED_SAMPLE] = "stored",
+		[DECIDE_STORED_NO_GAIN] = "stored",
+	};
+
+	fprintf(stderr, "  %-8s %s", verbs[e->decision], e->name);
+	if (e->uncomp_size > 0)
+		fprintf(stderr, " (%" PRIu64 " -> %" PRIu64 ")", e->uncomp_size,
+			e->comp_size);
+	if (e->sample_ratio != 0)
+		fprintf(stderr, " [sample %u.%u%%]", e->sample_ratio / 10,
+			e->sample_ratio % 10);
+	if (e->decision == DECIDE_STORED_NO_GAIN)
+		fprintf(stderr, " [no gain]");
+	fputc('\n', stderr);
+}
+
+static void report_summary(const struct entry_list *list, double seconds)
+{
+	size_t count[DECIDE_STORED_NO_GAIN + 1] = { 0 };
+	uint64_t bytes[DECIDE_STORED_NO_GAIN + 1] = { 0 };
+	uint64_t in = 0, out = 0;
+
+	for (size_t i = 0; i < list->count; i++) {
+		const struct entry *e = &list->items[i];
+		count[e->decision]++;
+		bytes[e->decision] += e->uncomp_size;
+		in += e->uncomp_size;
+		out += e->comp_size;
+	}
+
+	fprintf(stderr,
+		"%zu entries, %" PRIu64 " -> %" PRIu64 " bytes in %.2fs\n"
+		"  deflated:           %zu (%" PRIu64 " bytes)\n"
+		"  stored by sampling: %zu (%" PRIu64 " bytes)\n"
+		"  stored, no gain:    %zu (%" PRIu64 " bytes)\n",
+		list->count, in, out, seconds, count[DECIDE_COMPRESSED],
+		bytes[DECIDE_COMPRESSED], count[DECIDE_STORED_SAMPLE],
+		bytes[DECIDE_STORED_SAMPLE], count[DECIDE_STORED_NO_GAIN],
+		bytes[DECIDE_STORED_NO_GAIN]);
+}
+
+static void free_entries(struct entry_list *list)
+{
+	for (size_t i = 0; i < list->count; i++) {
+		release_data(&list->items[i]);
+		free(list->items[i].name);
+		free(list->items[i].path);
+	}
+	free(list->items);
+}
+
+int8_t zip_create(const char *filename, char *const paths[], size_t npaths,
+		  const ZipWriteOptions *opts)
+{
+	struct entry_list list = { 0 };
+	struct timespec start, end;
+	int8_t err = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	if (filename == NULL || opts == NULL || opts->level < 0 ||
+	    opts->level > DEFLATE_LEVEL_OPTIMAL)
+		return -1;
+
+	for (size_t i = 0; i < npaths && err == 0; i++)
+		err = collect(&list, paths[i]);
+	if (err != 0) {
+		free_entries(&list);
+		return err;
+	}
+
+	FILE *fp = fopen(filename, "wb");
+	if (fp == NULL) {
+		perror(filename);
+		free_entries(&list);
+		return -1;
+	}
+
+	unsigned jobs = opts->jobs;
+	if (jobs == 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		jobs = cpus > 0 ? cpus : 1;
+	}
+	if (jobs > list.count)
+		jobs = list.count > 0 ? list.count : 1;
+
+	struct job_queue q = {
+		.entries = list.items,
+		.count = list.count,
+		.ahead = 2 * (size_t)jobs,
+		.level = opts->level,
+		.sample = !opts->no_sample,
+		.rsyncable = opts->rsyncable,
+	};
+	pthread_mutex_init(&q.lock, NULL);
+	pthread_cond_init(&q.cond, NULL);
+
+	pthread_t *threads = calloc(jobs, sizeof(*threads));
+	unsigned started = 0;
+	while (threads != NULL && started < jobs &&
+	       pthread_create(&threads[started], NULL, compress_worker, &q) ==
+		       0)
+		started++;
+	if (started == 0) {
+		fprintf(stderr, "%s: cannot start compression threads\n",
+			filename);
+		err = -1;
+		pthread_mutex_lock(&q.lock);
+		q.next = q.count;
+		pthread_mutex_unlock(&q.lock);
+	}
+
+	/* Entries are written in order as soon as their data is ready */
+	uint64_t offset = 0;
+	for (size_t i = 0; i < list.count && err == 0; i++) {
+		struct entry *e = &list.items[i];
+
+		pthread_mutex_lock(&q.lock);
+		while (!e->done)
+			pthread_cond_wait(&q.cond, &q.lock);
+		pthread_mutex_unlock(&q.lock);
+
+		if (e->failed || write_local_entry(fp, &offset, e) != 0)
+			err = -1;
+		else if (opts->verbose)
+			report_entry(e);
+		release_data(e);
+
+		pthread_mutex_lock(&q.lock);
+		q.written++;
+		if (err != 0)
+			q.next = q.count;
+		pthread_cond_broadcast(&q.cond);
+		pthread_mutex_unlock(&q.lock);
+	}
+
+	for (unsigned i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	pthread_mutex_destroy(&q.lock);
+	pthread_cond_destroy(&q.cond);
+
+	if (err == 0 && opts->index && list.count > 0) {
+		if (list.count < ZIP_INDEX_EMPTY)
+			err = write_name_index(fp, &offset, &list);
+		else
+			fprintf(stderr, "%s: too many entries to index\n",
+				filename);
+	}
+
+	uint64_t cd_size = 0;
+	for (size_t i = 0; i < list.count && err == 0; i++)
+		err = write_central_entry(fp, &cd_size, &list.items[i]);
+	if (err == 0)
+		err = write_end_records(fp, list.count, offset, cd_size);
+
+	if (fclose(fp) != 0 || err != 0) {
+		perror(filename);
+		err = -1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (err == 0 && opts->verbose)
+		report_summary(&list, (end.tv_sec - start.tv_sec) +
+					      (end.tv_nsec - start.tv_nsec) / 1e9);
+	free_entries(&list);
+
+	return err;
+}